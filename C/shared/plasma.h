@@ -28,6 +28,8 @@
 #define GPIOA_IN          0x20000050
 #define COUNTER_REG       0x20000060
 #define ETHERNET_REG      0x20000070
+#define CORE_ID_REG       0x200000e0 //multi-core mlite: this core
+#define CORE_COUNT_REG    0x200000f0 //multi-core mlite: number of cores
 #define FLASH_BASE        0x30000000
 #define CTRL_SL_RST       0x400000C0
 #define CTRL_SL_RW        0x400000C4
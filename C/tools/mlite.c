@@ -9,51 +9,63 @@
 -- DESCRIPTION:
 --   Plasma CPU simulator in C code.  
 --   This file served as the starting point for the VHDL code.
---   Assumes running on a little endian PC.
+--   Command line front end and debugger; the simulator itself is
+--   the plasmasim.c library.
 --------------------------------------------------------------------*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include <assert.h>
-
-//#define ENABLE_CACHE
-#define SIMPLE_CACHE
-
-#define MEM_SIZE (1024*1024*2)
-#define ntohs(A) ( ((A)>>8) | (((A)&0xff)<<8) )
-#define htons(A) ntohs(A)
-#define ntohl(A) ( ((A)>>24) | (((A)&0xff0000)>>8) | (((A)&0xff00)<<8) | ((A)<<24) )
-#define htonl(A) ntohl(A)
+#include "plasmasim.h"
 
 #ifndef WIN32
 //Support for Linux
 #define putch putchar
 #include <termios.h>
 #include <unistd.h>
+#include <sys/select.h>
 
 void Sleep(unsigned int value)
 { 
    usleep(value * 1000);
 }
 
+//Switch the terminal to unbuffered input once; restored at exit
+static struct termios termSaved;
+static int termRaw;
+
+static void term_restore(void)
+{
+   tcsetattr(STDIN_FILENO, TCSANOW, &termSaved);
+}
+
+static void term_raw(void)
+{
+   struct termios newt;
+
+   if(termRaw)
+      return;
+   termRaw = 1;
+   if(tcgetattr(STDIN_FILENO, &termSaved) != 0)
+      return;
+   newt = termSaved;
+   newt.c_lflag &= ~(ICANON | ECHO);
+   tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+   atexit(term_restore);
+}
+
 int kbhit(void)
 {
-   struct termios oldt, newt;
    struct timeval tv;
    fd_set read_fd;
 
-   tcgetattr(STDIN_FILENO, &oldt);
-   newt = oldt;
-   newt.c_lflag &= ~(ICANON | ECHO);
-   tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+   term_raw();
    tv.tv_sec=0;
    tv.tv_usec=0;
    FD_ZERO(&read_fd);
    FD_SET(0,&read_fd);
    if(select(1, &read_fd, NULL, NULL, &tv) == -1)
       return 0;
-   //tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
    if(FD_ISSET(0,&read_fd))
       return 1;
    return 0;
@@ -61,778 +73,31 @@ int kbhit(void)
 
 int getch(void)
 {
-   struct termios oldt, newt;
-   int ch;
-
-   tcgetattr(STDIN_FILENO, &oldt);
-   newt = oldt;
-   newt.c_lflag &= ~(ICANON | ECHO);
-   tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-   ch = getchar();
-   //tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-   return ch;
+   term_raw();
+   return getchar();
 }
+
 #else
 //Support for Windows
 #include <conio.h>
 extern void __stdcall Sleep(unsigned long value);
 #endif
 
-#define UART_WRITE        0x20000000
-#define UART_READ         0x20000000
-#define IRQ_MASK          0x20000010
-#define IRQ_STATUS        0x20000020
-#define CONFIG_REG        0x20000070
-#define MMU_PROCESS_ID    0x20000080
-#define MMU_FAULT_ADDR    0x20000090
-#define MMU_TLB           0x200000a0
-
-#define IRQ_UART_READ_AVAILABLE  0x001
-#define IRQ_UART_WRITE_AVAILABLE 0x002
-#define IRQ_COUNTER18_NOT        0x004
-#define IRQ_COUNTER18            0x008
-#define IRQ_MMU                  0x200
-
-#define MMU_ENTRIES 4
-#define MMU_MASK (1024*4-1)
-
-typedef struct
-{
-   unsigned int virtualAddress;
-   unsigned int physicalAddress;
-} MmuEntry;
-
-typedef struct {
-   int r[32];
-   int pc, pc_next, epc;
-   unsigned int hi;
-   unsigned int lo;
-   int status;
-   int userMode;
-   int processId;
-   int exceptionId;
-   int faultAddr;
-   int irqStatus;
-   int skip;
-   unsigned char *mem;
-   int wakeup;
-   int big_endian;
-   MmuEntry mmuEntry[MMU_ENTRIES];
-} State;
-
-static char *opcode_string[]={
-   "SPECIAL","REGIMM","J","JAL","BEQ","BNE","BLEZ","BGTZ",
-   "ADDI","ADDIU","SLTI","SLTIU","ANDI","ORI","XORI","LUI",
-   "COP0","COP1","COP2","COP3","BEQL","BNEL","BLEZL","BGTZL",
-   "?","?","?","?","?","?","?","?",
-   "LB","LH","LWL","LW","LBU","LHU","LWR","?",
-   "SB","SH","SWL","SW","?","?","SWR","CACHE",
-   "LL","LWC1","LWC2","LWC3","?","LDC1","LDC2","LDC3"
-   "SC","SWC1","SWC2","SWC3","?","SDC1","SDC2","SDC3"
-};
-
-static char *special_string[]={
-   "SLL","?","SRL","SRA","SLLV","?","SRLV","SRAV",
-   "JR","JALR","MOVZ","MOVN","SYSCALL","BREAK","?","SYNC",
-   "MFHI","MTHI","MFLO","MTLO","?","?","?","?",
-   "MULT","MULTU","DIV","DIVU","?","?","?","?",
-   "ADD","ADDU","SUB","SUBU","AND","OR","XOR","NOR",
-   "?","?","SLT","SLTU","?","DADDU","?","?",
-   "TGE","TGEU","TLT","TLTU","TEQ","?","TNE","?",
-   "?","?","?","?","?","?","?","?"
-};
-
-static char *regimm_string[]={
-   "BLTZ","BGEZ","BLTZL","BGEZL","?","?","?","?",
-   "TGEI","TGEIU","TLTI","TLTIU","TEQI","?","TNEI","?",
-   "BLTZAL","BEQZAL","BLTZALL","BGEZALL","?","?","?","?",
-   "?","?","?","?","?","?","?","?"
-};
-
-static unsigned int HWMemory[8];
-
-
-static int mem_read(State *s, int size, unsigned int address)
-{
-   unsigned int value=0, ptr;
-
-   s->irqStatus |= IRQ_UART_WRITE_AVAILABLE;
-   switch(address)
-   {
-      case UART_READ: 
-         if(kbhit())
-            HWMemory[0] = getch();
-         s->irqStatus &= ~IRQ_UART_READ_AVAILABLE; //clear bit
-         return HWMemory[0];
-      case IRQ_MASK: 
-         return HWMemory[1];
-      case IRQ_MASK + 4:
-         Sleep(10);
-         return 0;
-      case IRQ_STATUS: 
-         if(kbhit())
-            s->irqStatus |= IRQ_UART_READ_AVAILABLE;
-         return s->irqStatus;
-      case MMU_PROCESS_ID:
-         return s->processId;
-      case MMU_FAULT_ADDR:
-         return s->faultAddr;
-   }
-
-   ptr = (unsigned int)s->mem + (address % MEM_SIZE);
-
-   if(0x10000000 <= address && address < 0x10000000 + 1024*1024)
-      ptr += 1024*1024;
-
-   switch(size) 
-   {
-      case 4: 
-         if(address & 3)
-            printf("Unaligned access PC=0x%x address=0x%x\n", (int)s->pc, (int)address);
-         assert((address & 3) == 0);
-         value = *(int*)ptr;
-         if(s->big_endian) 
-            value = ntohl(value);
-         break;
-      case 2:
-         assert((address & 1) == 0);
-         value = *(unsigned short*)ptr;
-         if(s->big_endian) 
-            value = ntohs((unsigned short)value);
-         break;
-      case 1:
-         value = *(unsigned char*)ptr;
-         break;
-      default: 
-         printf("ERROR");
-   }
-   return(value);
-}
-
-static void mem_write(State *s, int size, int unsigned address, unsigned int value)
-{
-   unsigned int ptr;
-
-   switch(address)
-   {
-      case UART_WRITE: 
-         putch(value); 
-         fflush(stdout);
-         return;
-      case IRQ_MASK:   
-         HWMemory[1] = value; 
-         return;
-      case IRQ_STATUS: 
-         s->irqStatus = value; 
-         return;
-      case CONFIG_REG:
-         return;
-      case MMU_PROCESS_ID:
-         //printf("processId=%d\n", value);
-         s->processId = value;
-         return;
-   }
-
-   if(MMU_TLB <= address && address <= MMU_TLB+MMU_ENTRIES * 8)
-   {
-      //printf("TLB 0x%x 0x%x\n", address - MMU_TLB, value);
-      ptr = (unsigned int)s->mmuEntry + address - MMU_TLB;
-      *(int*)ptr = value;
-      s->irqStatus &= ~IRQ_MMU;
-      return;
-   }
-
-   ptr = (unsigned int)s->mem + (address % MEM_SIZE);
-
-   if(0x10000000 <= address && address < 0x10000000 + 1024*1024)
-      ptr += 1024*1024;
-
-   switch(size) 
-   {
-      case 4: 
-         assert((address & 3) == 0);
-         if(s->big_endian) 
-            value = htonl(value);
-         *(int*)ptr = value;
-         break;
-      case 2:
-         assert((address & 1) == 0);
-         if(s->big_endian) 
-            value = htons((unsigned short)value);
-         *(short*)ptr = (unsigned short)value; 
-         break;
-      case 1:
-         *(char*)ptr = (unsigned char)value; 
-         break;
-      default: 
-         printf("ERROR");
-   }
-}
-
-#ifdef ENABLE_CACHE
-/************* Optional MMU and cache implementation *************/
-/* TAG = VirtualAddress | ProcessId | WriteableBit */
-unsigned int mmu_lookup(State *s, unsigned int processId, 
-                         unsigned int address, int write)
-{
-   int i;
-   unsigned int compare, tag;
-
-   if(processId == 0 || s->userMode == 0)
-      return address;
-   //if(address < 0x30000000)
-   //   return address;
-   compare = (address & ~MMU_MASK) | (processId << 1);
-   for(i = 0; i < MMU_ENTRIES; ++i)
-   {
-      tag = s->mmuEntry[i].virtualAddress;
-      if((tag & ~1) == compare && (write == 0 || (tag & 1)))
-         return s->mmuEntry[i].physicalAddress | (address & MMU_MASK);
-   }
-   //printf("\nMMUTlbMiss 0x%x PC=0x%x w=%d pid=%d user=%d\n", 
-   //   address, s->pc, write, processId, s->userMode);
-   //printf("m");
-   s->exceptionId = 1;
-   s->faultAddr = address & ~MMU_MASK;
-   s->irqStatus |= IRQ_MMU;
-   return address;
-}
-
-
-#define CACHE_SET_ASSOC_LN2   0
-#define CACHE_SET_ASSOC       (1 << CACHE_SET_ASSOC_LN2)
-#define CACHE_SIZE_LN2        (13 - CACHE_SET_ASSOC_LN2)  //8 KB
-#define CACHE_SIZE            (1 << CACHE_SIZE_LN2)
-#define CACHE_LINE_SIZE_LN2   2                           //4 bytes
-#define CACHE_LINE_SIZE       (1 << CACHE_LINE_SIZE_LN2)
-
-static int cacheData[CACHE_SET_ASSOC][CACHE_SIZE/sizeof(int)];
-static int cacheAddr[CACHE_SET_ASSOC][CACHE_SIZE/CACHE_LINE_SIZE];
-static int cacheSetNext;
-static int cacheMiss, cacheWriteBack, cacheCount;
-
-static void cache_init(void)
-{
-   int set, i;
-   for(set = 0; set < CACHE_SET_ASSOC; ++set)
-   {
-      for(i = 0; i < CACHE_SIZE/CACHE_LINE_SIZE; ++i)
-         cacheAddr[set][i] = 0xffff0000;
-   }
-}
-
-/* Write-back cache memory tagged by virtual address and processId */
-/* TAG = virtualAddress | processId | dirtyBit */
-static int cache_load(State *s, unsigned int address, int write)
-{
-   int set, i, pid, miss, offsetAddr, offsetData, offsetMem;
-   unsigned int addrTagMatch, addrPrevMatch=0;
-   unsigned int addrPrev;
-   unsigned int addressPhysical, tag;
-
-   ++cacheCount;
-   addrTagMatch = address & ~(CACHE_SIZE-1);
-   offsetAddr = (address & (CACHE_SIZE-1)) >> CACHE_LINE_SIZE_LN2;
-
-   /* Find match */
-   miss = 1;
-   for(set = 0; set < CACHE_SET_ASSOC; ++set)
-   {
-      addrPrevMatch = cacheAddr[set][offsetAddr] & ~(CACHE_SIZE-1);
-      if(addrPrevMatch == addrTagMatch)
-      {
-         miss = 0;
-         break;
-      }
-   }
-
-   /* Cache miss? */
-   if(miss)
-   {
-      ++cacheMiss;
-      set = cacheSetNext;
-      cacheSetNext = (cacheSetNext + 1) & (CACHE_SET_ASSOC-1);
-   }
-   //else if(write || (address >> 28) != 0x1)
-   //{
-   //   tag = cacheAddr[set][offsetAddr];
-   //   pid = (tag & (CACHE_SIZE-1)) >> 1; 
-   //   if(pid != s->processId)
-   //      miss = 1;
-   //}
-
-   if(miss)
-   {
-      offsetData = address & (CACHE_SIZE-1) & ~(CACHE_LINE_SIZE-1);
-
-      /* Cache line dirty? */
-      if(cacheAddr[set][offsetAddr] & 1)
-      {
-         /* Write back cache line */
-         tag = cacheAddr[set][offsetAddr];
-         addrPrev = tag & ~(CACHE_SIZE-1);
-         addrPrev |= address & (CACHE_SIZE-1);
-         pid = (tag & (CACHE_SIZE-1)) >> 1; 
-         addressPhysical = mmu_lookup(s, pid, addrPrev, 1);   //virtual->physical
-         if(s->exceptionId)
-            return 0;
-         offsetMem = addressPhysical & ~(CACHE_LINE_SIZE-1);
-         for(i = 0; i < CACHE_LINE_SIZE; i += 4)
-            mem_write(s, 4, offsetMem + i, cacheData[set][(offsetData + i) >> 2]);
-         ++cacheWriteBack;
-      }
-
-      /* Read cache line */
-      addressPhysical = mmu_lookup(s, s->processId, address, write); //virtual->physical
-      if(s->exceptionId)
-         return 0;
-      offsetMem = addressPhysical & ~(CACHE_LINE_SIZE-1);
-      cacheAddr[set][offsetAddr] = addrTagMatch;
-      for(i = 0; i < CACHE_LINE_SIZE; i += 4)
-         cacheData[set][(offsetData + i) >> 2] = mem_read(s, 4, offsetMem + i);
-   }
-   cacheAddr[set][offsetAddr] |= write;
-   return set;
-}
-
-static int cache_read(State *s, int size, unsigned int address)
-{
-   int set, offset;
-   int value;
-
-   if((address & 0xfe000000) != 0x10000000)
-      return mem_read(s, size, address);
-
-   set = cache_load(s, address, 0);
-   if(s->exceptionId)
-      return 0;
-   offset = (address & (CACHE_SIZE-1)) >> 2;
-   value = cacheData[set][offset];
-   if(s->big_endian)
-      address ^= 3;
-   switch(size) 
-   {
-      case 2: 
-         value = (value >> ((address & 2) << 3)) & 0xffff;
-         break;
-      case 1:
-         value = (value >> ((address & 3) << 3)) & 0xff;
-         break;
-   }
-   return value;
-}
-
-static void cache_write(State *s, int size, int unsigned address, unsigned int value)
-{
-   int set, offset;
-   unsigned int mask;
-
-   if((address >> 28) != 0x1) // && (s->processId == 0 || s->userMode == 0))
-   {
-      mem_write(s, size, address, value);
-      return;
-   }
-
-   set = cache_load(s, address, 1);
-   if(s->exceptionId)
-      return;
-   offset = (address & (CACHE_SIZE-1)) >> 2;
-   if(s->big_endian)
-      address ^= 3;
-   switch(size) 
-   {
-      case 2:
-         value &= 0xffff;
-         value |= value << 16;
-         mask = 0xffff << ((address & 2) << 3);
-         break;
-      case 1:
-         value &= 0xff;
-         value |= (value << 8) | (value << 16) | (value << 24);
-         mask = 0xff << ((address & 3) << 3);
-         break;
-      case 4:
-      default:
-         mask = 0xffffffff;
-         break;
-   }
-   cacheData[set][offset] = (value & mask) | (cacheData[set][offset] & ~mask);
-}
-
-#define mem_read cache_read
-#define mem_write cache_write
-
-#else
-static void cache_init(void) {}
-#endif
-
-
-#ifdef SIMPLE_CACHE
-
-//Write through direct mapped 4KB cache
-#define CACHE_MISS 0x1ff
-static unsigned int cacheData[1024];
-static unsigned int cacheAddr[1024]; //9-bit addresses
-static int cacheTry, cacheMiss, cacheInit;
-
-static int cache_read(State *s, int size, unsigned int address)
-{
-   int offset;
-   unsigned int value, value2, address2=address;
-
-   if(cacheInit == 0)
-   {
-      cacheInit = 1;
-      for(offset = 0; offset < 1024; ++offset)
-         cacheAddr[offset] = CACHE_MISS;
-   }
-
-   offset = address >> 20;
-   if(offset != 0x100 && offset != 0x101)
-      return mem_read(s, size, address);
-
-   ++cacheTry;
-   offset = (address >> 2) & 0x3ff;
-   if(cacheAddr[offset] != (address >> 12) || cacheAddr[offset] == CACHE_MISS)
-   {
-      ++cacheMiss;
-      cacheAddr[offset] = address >> 12;
-      cacheData[offset] = mem_read(s, 4, address & ~3);
-   }
-   value = cacheData[offset];
-   if(s->big_endian)
-      address ^= 3;
-   switch(size) 
-   {
-      case 2: 
-         value = (value >> ((address & 2) << 3)) & 0xffff;
-         break;
-      case 1:
-         value = (value >> ((address & 3) << 3)) & 0xff;
-         break;
-   }
-
-   //Debug testing
-   value2 = mem_read(s, size, address2);
-   if(value != value2)
-      printf("miss match\n");
-   //if((cacheTry & 0xffff) == 0) printf("\n***cache(%d,%d)\n ", cacheMiss, cacheTry);
-   return value;
-}
+#define UART_BUFFER_SIZE (1024*1024)
 
-static void cache_write(State *s, int size, int unsigned address, unsigned int value)
+//The UART on the terminal when not in batch mode
+static void console_putch(int ch)
 {
-   int offset;
-
-   mem_write(s, size, address, value);
-
-   offset = address >> 20;
-   if(offset != 0x100 && offset != 0x101)
-      return;
-
-   offset = (address >> 2) & 0x3ff;
-   if(size != 4)
-   {
-      cacheAddr[offset] = CACHE_MISS;
-      return;
-   }
-   cacheAddr[offset] = address >> 12;
-   cacheData[offset] = value;
+   putch(ch);
+   fflush(stdout);
 }
 
-#define mem_read cache_read
-#define mem_write cache_write
-#endif  //SIMPLE_CACHE
-/************* End optional cache implementation *************/
-
-
-void mult_big(unsigned int a, 
-              unsigned int b,
-              unsigned int *hi, 
-              unsigned int *lo)
+static void console_idle(unsigned int ms)
 {
-   unsigned int ahi, alo, bhi, blo;
-   unsigned int c0, c1, c2;
-   unsigned int c1_a, c1_b;
-
-   ahi = a >> 16;
-   alo = a & 0xffff;
-   bhi = b >> 16;
-   blo = b & 0xffff;
-
-   c0 = alo * blo;
-   c1_a = ahi * blo;
-   c1_b = alo * bhi;
-   c2 = ahi * bhi;
-
-   c2 += (c1_a >> 16) + (c1_b >> 16);
-   c1 = (c1_a & 0xffff) + (c1_b & 0xffff) + (c0 >> 16);
-   c2 += (c1 >> 16);
-   c0 = (c1 << 16) + (c0 & 0xffff);
-   *hi = c2;
-   *lo = c0;
-}
-
-void mult_big_signed(int a, 
-                     int b,
-                     unsigned int *hi, 
-                     unsigned int *lo)
-{
-   unsigned int ahi, alo, bhi, blo;
-   unsigned int c0, c1, c2;
-   int c1_a, c1_b;
-
-   ahi = a >> 16;
-   alo = a & 0xffff;
-   bhi = b >> 16;
-   blo = b & 0xffff;
-
-   c0 = alo * blo;
-   c1_a = ahi * blo;
-   c1_b = alo * bhi;
-   c2 = ahi * bhi;
-
-   c2 += (c1_a >> 16) + (c1_b >> 16);
-   c1 = (c1_a & 0xffff) + (c1_b & 0xffff) + (c0 >> 16);
-   c2 += (c1 >> 16);
-   c0 = (c1 << 16) + (c0 & 0xffff);
-   *hi = c2;
-   *lo = c0;
-}
-
-//execute one cycle of a Plasma CPU
-void cycle(State *s, int show_mode)
-{
-   unsigned int opcode;
-   unsigned int op, rs, rt, rd, re, func, imm, target;
-   int imm_shift, branch=0, lbranch=2, skip2=0;
-   int *r=s->r;
-   unsigned int *u=(unsigned int*)s->r;
-   unsigned int ptr, epc, rSave;
-
-   opcode = mem_read(s, 4, s->pc);
-   op = (opcode >> 26) & 0x3f;
-   rs = (opcode >> 21) & 0x1f;
-   rt = (opcode >> 16) & 0x1f;
-   rd = (opcode >> 11) & 0x1f;
-   re = (opcode >> 6) & 0x1f;
-   func = opcode & 0x3f;
-   imm = opcode & 0xffff;
-   imm_shift = (((int)(short)imm) << 2) - 4;
-   target = (opcode << 6) >> 4;
-   ptr = (short)imm + r[rs];
-   r[0] = 0;
-   if(show_mode) 
-   {
-      printf("%8.8x %8.8x ", s->pc, opcode);
-      if(op == 0) 
-         printf("%8s ", special_string[func]);
-      else if(op == 1) 
-         printf("%8s ", regimm_string[rt]);
-      else 
-         printf("%8s ", opcode_string[op]);
-      printf("$%2.2d $%2.2d $%2.2d $%2.2d ", rs, rt, rd, re);
-      printf("%4.4x", imm);
-      if(show_mode == 1)
-         printf(" r[%2.2d]=%8.8x r[%2.2d]=%8.8x", rs, r[rs], rt, r[rt]);
-      printf("\n");
-   }
-   if(show_mode > 5) 
-      return;
-   epc = s->pc + 4;
-   if(s->pc_next != s->pc + 4)
-      epc |= 2;  //branch delay slot
-   s->pc = s->pc_next;
-   s->pc_next = s->pc_next + 4;
-   if(s->skip) 
-   {
-      s->skip = 0;
-      return;
-   }
-   rSave = r[rt];
-   switch(op) 
-   {
-      case 0x00:/*SPECIAL*/
-         switch(func) 
-         {
-            case 0x00:/*SLL*/  r[rd]=r[rt]<<re;          break;
-            case 0x02:/*SRL*/  r[rd]=u[rt]>>re;          break;
-            case 0x03:/*SRA*/  r[rd]=r[rt]>>re;          break;
-            case 0x04:/*SLLV*/ r[rd]=r[rt]<<r[rs];       break;
-            case 0x06:/*SRLV*/ r[rd]=u[rt]>>r[rs];       break;
-            case 0x07:/*SRAV*/ r[rd]=r[rt]>>r[rs];       break;
-            case 0x08:/*JR*/   s->pc_next=r[rs];         break;
-            case 0x09:/*JALR*/ r[rd]=s->pc_next; s->pc_next=r[rs]; break;
-            case 0x0a:/*MOVZ*/ if(!r[rt]) r[rd]=r[rs];   break;  /*IV*/
-            case 0x0b:/*MOVN*/ if(r[rt]) r[rd]=r[rs];    break;  /*IV*/
-            case 0x0c:/*SYSCALL*/ epc|=1; s->exceptionId=1; break;
-            case 0x0d:/*BREAK*/   epc|=1; s->exceptionId=1; break;
-            case 0x0f:/*SYNC*/ s->wakeup=1;              break;
-            case 0x10:/*MFHI*/ r[rd]=s->hi;              break;
-            case 0x11:/*FTHI*/ s->hi=r[rs];              break;
-            case 0x12:/*MFLO*/ r[rd]=s->lo;              break;
-            case 0x13:/*MTLO*/ s->lo=r[rs];              break;
-            case 0x18:/*MULT*/ mult_big_signed(r[rs],r[rt],&s->hi,&s->lo); break;
-            case 0x19:/*MULTU*/ mult_big(r[rs],r[rt],&s->hi,&s->lo); break;
-            case 0x1a:/*DIV*/  s->lo=r[rs]/r[rt]; s->hi=r[rs]%r[rt]; break;
-            case 0x1b:/*DIVU*/ s->lo=u[rs]/u[rt]; s->hi=u[rs]%u[rt]; break;
-            case 0x20:/*ADD*/  r[rd]=r[rs]+r[rt];        break;
-            case 0x21:/*ADDU*/ r[rd]=r[rs]+r[rt];        break;
-            case 0x22:/*SUB*/  r[rd]=r[rs]-r[rt];        break;
-            case 0x23:/*SUBU*/ r[rd]=r[rs]-r[rt];        break;
-            case 0x24:/*AND*/  r[rd]=r[rs]&r[rt];        break;
-            case 0x25:/*OR*/   r[rd]=r[rs]|r[rt];        break;
-            case 0x26:/*XOR*/  r[rd]=r[rs]^r[rt];        break;
-            case 0x27:/*NOR*/  r[rd]=~(r[rs]|r[rt]);     break;
-            case 0x2a:/*SLT*/  r[rd]=r[rs]<r[rt];        break;
-            case 0x2b:/*SLTU*/ r[rd]=u[rs]<u[rt];        break;
-            case 0x2d:/*DADDU*/r[rd]=r[rs]+u[rt];        break;
-            case 0x31:/*TGEU*/ break;
-            case 0x32:/*TLT*/  break;
-            case 0x33:/*TLTU*/ break;
-            case 0x34:/*TEQ*/  break;
-            case 0x36:/*TNE*/  break;
-            default: printf("ERROR0(*0x%x~0x%x)\n", s->pc, opcode);
-               s->wakeup=1;
-         }
-         break;
-      case 0x01:/*REGIMM*/
-         switch(rt) {
-            case 0x10:/*BLTZAL*/ r[31]=s->pc_next;
-            case 0x00:/*BLTZ*/   branch=r[rs]<0;    break;
-            case 0x11:/*BGEZAL*/ r[31]=s->pc_next;
-            case 0x01:/*BGEZ*/   branch=r[rs]>=0;   break;
-            case 0x12:/*BLTZALL*/r[31]=s->pc_next;
-            case 0x02:/*BLTZL*/  lbranch=r[rs]<0;   break;
-            case 0x13:/*BGEZALL*/r[31]=s->pc_next;
-            case 0x03:/*BGEZL*/  lbranch=r[rs]>=0;  break;
-            default: printf("ERROR1\n"); s->wakeup=1;
-          }
-         break;
-      case 0x03:/*JAL*/    r[31]=s->pc_next;
-      case 0x02:/*J*/      s->pc_next=(s->pc&0xf0000000)|target; break;
-      case 0x04:/*BEQ*/    branch=r[rs]==r[rt];     break;
-      case 0x05:/*BNE*/    branch=r[rs]!=r[rt];     break;
-      case 0x06:/*BLEZ*/   branch=r[rs]<=0;         break;
-      case 0x07:/*BGTZ*/   branch=r[rs]>0;          break;
-      case 0x08:/*ADDI*/   r[rt]=r[rs]+(short)imm;  break;
-      case 0x09:/*ADDIU*/  u[rt]=u[rs]+(short)imm;  break;
-      case 0x0a:/*SLTI*/   r[rt]=r[rs]<(short)imm;  break;
-      case 0x0b:/*SLTIU*/  u[rt]=u[rs]<(unsigned int)(short)imm; break;
-      case 0x0c:/*ANDI*/   r[rt]=r[rs]&imm;         break;
-      case 0x0d:/*ORI*/    r[rt]=r[rs]|imm;         break;
-      case 0x0e:/*XORI*/   r[rt]=r[rs]^imm;         break;
-      case 0x0f:/*LUI*/    r[rt]=(imm<<16);         break;
-      case 0x10:/*COP0*/
-         if((opcode & (1<<23)) == 0)  //move from CP0
-         {
-            if(rd == 12)
-               r[rt]=s->status;
-            else
-               r[rt]=s->epc;
-         }
-         else                         //move to CP0
-         {
-            s->status=r[rt]&1;
-            if(s->processId && (r[rt]&2))
-            {
-               s->userMode|=r[rt]&2;
-               //printf("CpuStatus=%d %d %d\n", r[rt], s->status, s->userMode);
-               //s->wakeup = 1;
-               //printf("pc=0x%x\n", epc);
-            }
-         }
-         break;
-//      case 0x11:/*COP1*/ break;
-//      case 0x12:/*COP2*/ break;
-//      case 0x13:/*COP3*/ break;
-      case 0x14:/*BEQL*/   lbranch=r[rs]==r[rt];    break;
-      case 0x15:/*BNEL*/   lbranch=r[rs]!=r[rt];    break;
-      case 0x16:/*BLEZL*/  lbranch=r[rs]<=0;        break;
-      case 0x17:/*BGTZL*/  lbranch=r[rs]>0;         break;
-//      case 0x1c:/*MAD*/  break;   /*IV*/
-      case 0x20:/*LB*/   r[rt]=(signed char)mem_read(s,1,ptr);  break;
-      case 0x21:/*LH*/   r[rt]=(signed short)mem_read(s,2,ptr); break;
-      case 0x22:/*LWL*/  
-                         //target=8*(ptr&3);
-                         //r[rt]=(r[rt]&~(0xffffffff<<target))|
-                         //      (mem_read(s,4,ptr&~3)<<target); break;
-      case 0x23:/*LW*/   r[rt]=mem_read(s,4,ptr);   break;
-      case 0x24:/*LBU*/  r[rt]=(unsigned char)mem_read(s,1,ptr); break;
-      case 0x25:/*LHU*/  r[rt]=(unsigned short)mem_read(s,2,ptr); break;
-      case 0x26:/*LWR*/  
-                         //target=32-8*(ptr&3);
-                         //r[rt]=(r[rt]&~((unsigned int)0xffffffff>>target))|
-                         //((unsigned int)mem_read(s,4,ptr&~3)>>target); 
-                         break;
-      case 0x28:/*SB*/   mem_write(s,1,ptr,r[rt]);  break;
-      case 0x29:/*SH*/   mem_write(s,2,ptr,r[rt]);  break;
-      case 0x2a:/*SWL*/  
-                         //mem_write(s,1,ptr,r[rt]>>24);  
-                         //mem_write(s,1,ptr+1,r[rt]>>16);
-                         //mem_write(s,1,ptr+2,r[rt]>>8);
-                         //mem_write(s,1,ptr+3,r[rt]); break;
-      case 0x2b:/*SW*/   mem_write(s,4,ptr,r[rt]);  break;
-      case 0x2e:/*SWR*/  break; //fixme
-      case 0x2f:/*CACHE*/break;
-      case 0x30:/*LL*/   r[rt]=mem_read(s,4,ptr);   break;
-//      case 0x31:/*LWC1*/ break;
-//      case 0x32:/*LWC2*/ break;
-//      case 0x33:/*LWC3*/ break;
-//      case 0x35:/*LDC1*/ break;
-//      case 0x36:/*LDC2*/ break;
-//      case 0x37:/*LDC3*/ break;
-//      case 0x38:/*SC*/     *(int*)ptr=r[rt]; r[rt]=1; break;
-      case 0x38:/*SC*/     mem_write(s,4,ptr,r[rt]); r[rt]=1; break;
-//      case 0x39:/*SWC1*/ break;
-//      case 0x3a:/*SWC2*/ break;
-//      case 0x3b:/*SWC3*/ break;
-//      case 0x3d:/*SDC1*/ break;
-//      case 0x3e:/*SDC2*/ break;
-//      case 0x3f:/*SDC3*/ break;
-      default: printf("ERROR2 address=0x%x opcode=0x%x\n", s->pc, opcode); 
-         s->wakeup=1;
-   }
-   s->pc_next += (branch || lbranch == 1) ? imm_shift : 0;
-   s->pc_next &= ~3;
-   s->skip = (lbranch == 0) | skip2;
-
-   if(s->exceptionId)
-   {
-      r[rt] = rSave;
-      s->epc = epc; 
-      s->pc_next = 0x3c;
-      s->skip = 1; 
-      s->exceptionId = 0;
-      s->userMode = 0;
-      //s->wakeup = 1;
-      return;
-   }
+   Sleep(ms);
 }
 
-void show_state(State *s)
-{
-   int i,j;
-   printf("pid=%d userMode=%d, epc=0x%x\n", s->processId, s->userMode, s->epc);
-   for(i = 0; i < 4; ++i) 
-   {
-      printf("%2.2d ", i * 8);
-      for(j = 0; j < 8; ++j) 
-      {
-         printf("%8.8x ", s->r[i*8+j]);
-      }
-      printf("\n");
-   }
-   //printf("%8.8lx %8.8lx %8.8lx %8.8lx\n", s->pc, s->pc_next, s->hi, s->lo);
-   j = s->pc;
-   for(i = -4; i <= 8; ++i) 
-   {
-      printf("%c", i==0 ? '*' : ' ');
-      s->pc = j + i * 4;
-      cycle(s, 10);
-   }
-   s->pc = j;
-}
+static const Console console = {kbhit, getch, console_putch, console_idle};
 
 void do_debug(State *s)
 {
@@ -848,7 +113,7 @@ void do_debug(State *s)
       if(ch != 'n')
       {
          if(watch) 
-            printf("0x%8.8x=0x%8.8x\n", watch, mem_read(s, 4, watch));
+            printf("0x%8.8x=0x%8.8x\n", watch, plasma_read(s, watch, 4));
          printf("1=Debug 2=Trace 3=Step 4=BreakPt 5=Go 6=Memory ");
          printf("7=Watch 8=Jump 9=Quit> ");
       }
@@ -877,13 +142,7 @@ void do_debug(State *s)
          break;
       case '5': case 'g':
          s->wakeup = 0;
-         cycle(s, 0);
-         while(s->wakeup == 0) 
-         {
-            if(s->pc == j) 
-               break;
-            cycle(s, 0);
-         }
+         run(s, j);
          show_state(s);
          break;
       case 'G':
@@ -902,7 +161,7 @@ void do_debug(State *s)
          scanf("%x", &j);
          for(i = 0; i < 8; ++i) 
          {
-            printf("%8.8x ", mem_read(s, 4, j+i*4));
+            printf("%8.8x ", plasma_read(s, j+i*4, 4));
          }
          printf("\n");
          break;
@@ -924,76 +183,686 @@ void do_debug(State *s)
 }
 /************************************************************/
 
-int main(int argc,char *argv[])
+/************* Fork server *************/
+/* -F socket loads and initializes once (up to -x when given), then serves
+   run requests on a Unix socket, or on stdin/stdout with -F -.  Each
+   request runs in a forked child that shares the warmed-up memory
+   copy-on-write, so a run costs a fork instead of a load and a warm-up.
+   fork() copies only the calling thread, so the options with writer
+   threads or device files (-T, -O, -V, -A, -e, -E) are refused.
+   A request is a list of lines ending with "run":
+      reg N value        set register N (hex value); pc value sets the pc
+      word address value store a 32-bit word (hex)
+      mem address bytes  store hex bytes from address
+      uart bytes         append hex bytes to the UART input
+      uartfile path      append a file to the UART input
+   The UART input starts with what the warm-up left of -i, read without
+   moving the file position that the parent and other children share.
+      budget count       stop after count more instructions
+      time seconds       stop after seconds of host time
+   and the reply is:
+      stop reason / exit code / pc / instructions / cycles
+      uart length, the UART output bytes, then "end".
+   "quit" on stdin ends the server. */
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+static const char *stopNames[] = {"running", "break", "halt", "error",
+   "budget", "time", "address"};
+
+static int hex_nibble(int ch)
+{
+   if(ch >= '0' && ch <= '9')
+      return ch - '0';
+   ch = tolower(ch);
+   return ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : -1;
+}
+
+//Decode hex digits into a growing buffer, returns the new size
+static size_t hex_append(unsigned char **buf, size_t size, const char *hex)
+{
+   int high, low;
+
+   *buf = (unsigned char*)realloc(*buf, size + strlen(hex) / 2 + 1);
+   for(; (high = hex_nibble(hex[0])) >= 0 && (low = hex_nibble(hex[1])) >= 0; hex += 2)
+      (*buf)[size++] = (unsigned char)(high << 4 | low);
+   return size;
+}
+
+//Store bytes into target memory like the CPU does, dropping decoded code
+static void server_store(State *s, unsigned int address, const unsigned char *data,
+                         size_t size)
+{
+   for(; size--; ++address)
+      plasma_write(s, address, *data++, 1);
+}
+
+//Child: apply one request, run it and write the reply
+static void server_run(State *s, FILE *in, FILE *out, double timeLimit)
+{
+   char *line = NULL, *arg;
+   size_t length = 0, uartSize = 0, outSize = 0, size;
+   unsigned char *uart = NULL, *data = NULL;
+   char *output = NULL;
+   unsigned long long budget = 0;
+   unsigned int address, value;
+   int reg, result;
+   long position;
+   ssize_t bytes;
+   struct stat info;
+   FILE *file;
+
+   if(s->uartIn && s->uartIn != stdin && (position = ftell(s->uartIn)) >= 0 &&
+      fstat(fileno(s->uartIn), &info) == 0 && info.st_size > position)
+   {
+      uart = (unsigned char*)malloc(info.st_size - position);
+      bytes = pread(fileno(s->uartIn), uart, info.st_size - position, position);
+      uartSize = bytes > 0 ? (size_t)bytes : 0;
+   }
+   while(getline(&line, &length, in) > 0)
+   {
+      line[strcspn(line, "\r\n")] = 0;
+      arg = strchr(line, ' ');
+      arg = arg ? arg + 1 : line + strlen(line);
+      if(strcmp(line, "run") == 0)
+         break;
+      if(strncmp(line, "reg ", 4) == 0 && sscanf(arg, "%d %x", &reg, &value) == 2 &&
+         reg > 0 && reg < 32)
+         s->r[reg] = value;
+      else if(strncmp(line, "pc ", 3) == 0)
+      {
+         s->pc = strtoul(arg, NULL, 16);
+         s->pc_next = s->pc + 4;
+         s->skip = 0;
+      }
+      else if(strncmp(line, "word ", 5) == 0 && sscanf(arg, "%x %x", &address, &value) == 2)
+         plasma_write(s, address, value, 4);
+      else if(strncmp(line, "mem ", 4) == 0 && sscanf(arg, "%x", &address) == 1 &&
+              strchr(arg, ' '))
+      {
+         size = hex_append(&data, 0, strchr(arg, ' ') + 1);
+         server_store(s, address, data, size);
+      }
+      else if(strncmp(line, "uart ", 5) == 0)
+         uartSize = hex_append(&uart, uartSize, arg);
+      else if(strncmp(line, "uartfile ", 9) == 0 && (file = fopen(arg, "rb")))
+      {
+         fseek(file, 0, SEEK_END);
+         size = ftell(file);
+         rewind(file);
+         uart = (unsigned char*)realloc(uart, uartSize + size + 1);
+         uartSize += fread(uart + uartSize, 1, size, file);
+         fclose(file);
+      }
+      else if(strncmp(line, "budget ", 7) == 0)
+         budget = strtoull(arg, NULL, 0);
+      else if(strncmp(line, "time ", 5) == 0)
+         timeLimit = atof(arg);
+   }
+
+   s->uartIn = uartSize ? fmemopen(uart, uartSize, "rb") : NULL;
+   s->uartOut = open_memstream(&output, &outSize);
+   if(budget)
+      s->budget = s->instructions + budget;
+   s->stopReason = STOP_NONE;
+   s->deadline = 0;
+   s->wakeup = 0;
+   result = run_batch(s, timeLimit);
+   fclose(s->uartOut);
+   fprintf(out, "stop %s\nexit %d\npc %8.8x\ninstructions %llu\ncycles %llu\nuart %lu\n",
+      stopNames[s->stopReason], result, s->pc, s->instructions, s->cycles,
+      (unsigned long)outSize);
+   fwrite(output, 1, outSize, out);
+   fprintf(out, "\nend\n");
+   fflush(out);
+   free(output);
+   free(uart);
+   free(data);
+   free(line);
+}
+
+//Read one request into memory so the parent's stdin stays in order;
+//returns 0 at "quit" or end of input
+static int server_read(FILE *in, char **request, size_t *size)
 {
-   State state, *s=&state;
-   FILE *in;
-   int bytes, index;
-   printf("Plasma emulator\n");
-   memset(s, 0, sizeof(State));
-   s->big_endian = 1;
-   s->mem = (unsigned char*)malloc(MEM_SIZE);
-   memset(s->mem, 0, MEM_SIZE);
-   if(argc <= 1) 
+   char *line = NULL;
+   size_t length = 0, used = 0;
+   ssize_t bytes;
+
+   while((bytes = getline(&line, &length, in)) > 0)
    {
-      printf("   Usage:  mlite file.exe\n");
-      printf("           mlite file.exe B   {for big_endian}\n");
-      printf("           mlite file.exe L   {for little_endian}\n");
-      printf("           mlite file.exe BD  {disassemble big_endian}\n");
-      printf("           mlite file.exe LD  {disassemble little_endian}\n");
+      if(strncmp(line, "quit", 4) == 0)
+         break;
+      *request = (char*)realloc(*request, used + bytes + 1);
+      memcpy(*request + used, line, bytes);
+      used += bytes;
+      if(strncmp(line, "run", 3) == 0)
+      {
+         *size = used;
+         free(line);
+         return 1;
+      }
+   }
+   free(line);
+   return 0;
+}
 
+//Returns the process exit code
+static int fork_server(State *s, const char *name, double timeLimit)
+{
+   struct sockaddr_un addr;
+   char *request = NULL;
+   size_t size = 0;
+   int listener, conn;
+   pid_t pid;
+   FILE *in, *out;
+
+   s->quiet = 1;
+   fflush(stdout);
+   if(strcmp(name, "-") == 0)
+   {
+      //One request at a time; the child answers on stdout
+      while(server_read(stdin, &request, &size))
+      {
+         pid = fork();
+         if(pid == 0)
+         {
+            in = fmemopen(request, size, "r");
+            server_run(s, in, stdout, timeLimit);
+            _exit(0);
+         }
+         if(pid > 0)
+            waitpid(pid, NULL, 0);
+      }
+      free(request);
       return 0;
    }
-   in = fopen(argv[1], "rb");
-   if(in == NULL) 
+
+   listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", name);
+   unlink(name);
+   if(listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(listener, 64))
+   {
+      fprintf(stderr, "Can't listen on %s\n", name);
+      return 1;
+   }
+   signal(SIGCHLD, SIG_IGN);          //children are reaped by the kernel
+   fprintf(stderr, "mlite: serving on %s\n", name);
+   for(;;)
+   {
+      conn = accept(listener, NULL, NULL);
+      if(conn < 0)
+         continue;
+      pid = fork();
+      if(pid == 0)
+      {
+         close(listener);
+         in = fdopen(conn, "r");
+         out = fdopen(dup(conn), "w");
+         server_run(s, in, out, timeLimit);
+         fclose(out);
+         _exit(0);
+      }
+      close(conn);
+   }
+   return 0;
+}
+#else
+static int fork_server(State *s, const char *name, double timeLimit)
+{
+   (void)s; (void)name; (void)timeLimit;
+   fprintf(stderr, "The fork server needs a POSIX host\n");
+   return 1;
+}
+#endif
+/************* End fork server *************/
+
+static void usage(void)
+{
+   printf("   Usage:  mlite [options] file.exe [mode]\n");
+   printf("           mlite file.exe\n");
+   printf("           mlite file.exe B   {for big_endian}\n");
+   printf("           mlite file.exe L   {for little_endian}\n");
+   printf("           mlite file.exe BD  {disassemble big_endian}\n");
+   printf("           mlite file.exe LD  {disassemble little_endian}\n");
+   printf("           mlite file.exe BT  {big_endian, basic-block engine}\n");
+   printf("           mlite file.exe BJ  {big_endian, JIT for hot blocks}\n");
+   printf("   Options:\n");
+   printf("           -b          batch run without the debugger\n");
+   printf("           -a address  load the image at address and start there\n");
+   printf("           -n count    batch: stop after count instructions\n");
+   printf("           -t seconds  batch: stop after seconds of host time\n");
+   printf("           -i file     batch: UART input ('-' for stdin)\n");
+   printf("           -o file     batch: UART output (default stdout)\n");
+   printf("           -c          cycle timing model of the Plasma pipeline\n");
+   printf("           -l          batch: run polling loops instead of fast-forwarding them\n");
+   printf("           -u baud     UART line rate (8N1): bytes take time, writes wait\n");
+   printf("           -w clocks   timing: wait states per external RAM access\n");
+   printf("           -I spec     instruction cache model: size,line,ways[,lru|random][,penalty]\n");
+   printf("           -D spec     data cache model: size,line,ways[,lru|random][,wb|wt][,penalty]\n");
+   printf("                       (sizes in bytes or with k; cycle engine, timing with -c)\n");
+   printf("           -C file     cache model: misses per function and data object\n");
+   printf("           -X project  C models of the custom.aluN opcodes of HDL/CUSTOM/project\n");
+   printf("                       (tsi, mandelbrot), ',N=clocks' sets a latency\n");
+   printf("           -K project  C models of the COPROC_n of HDL/CUSTOM/project,\n");
+   printf("                       ',N=latency[/interval]' sets the timing of COPROC_N\n");
+   printf("           -O file     RGB OLED frames as PPM, file a printf() pattern (oled%%03d.ppm),\n");
+   printf("                       ',ms' adds one every ms of emulated time\n");
+   printf("           -V file     VGA frames as PPM, as -O; COPROC_4 streams with -K\n");
+   printf("           -e file     FIFO_IN from a file of big-endian words, '-' for stdin,\n");
+   printf("                       ',depth[,clocks]' sets its size and arrival rate (1024,1)\n");
+   printf("           -E file     FIFO_OUT to a file, as -e\n");
+   printf("           -A file     PWM audio of ctrl_pwm.vhd as a WAV file, ',Hz' sets the\n");
+   printf("                       sample rate (44053); reports underruns\n");
+   printf("           -B file     button and switch events: 'ms btn CUDLR' or 'ms sw value'\n");
+   printf("                       per line, +ms after the previous one; reports responses\n");
+   printf("           -p file     profile per function and line, write file and file.csv\n");
+   printf("           -f file     folded call stacks for flame graphs, call paths in -p\n");
+   printf("           -T file     binary trace of every instruction (cycle engine)\n");
+   printf("           -r first    render the trace file from instruction first\n");
+   printf("                       (-n count limits it, mode V adds memory and registers)\n");
+   printf("           -s file     symbols from an .axf or .map (default file.axf, file.map)\n");
+   printf("           -x address  batch: stop when the pc reaches a hex address or function\n");
+   printf("           -S file     batch: snapshot the machine when the run stops\n");
+   printf("           -R file     start from a snapshot instead of reset\n");
+   printf("           -F socket   batch: serve runs from forked copies, '-' for stdin\n");
+   printf("                       (not with -T, -O, -V, -A, -e or -E)\n");
+   printf("           -m cores    batch: cores sharing external RAM, one host thread each\n");
+   printf("           -Q count    multi-core: instructions per core between syncs (10000)\n");
+   printf("           -P addr:len multi-core: hex range of external RAM private to each core\n");
+   printf("   Batch exit codes: 0=BREAK, final loop or -x 1=error 2=budget 3=time\n");
+}
+
+int main(int argc,char *argv[])
+{
+   State *s;
+   Soc *soc;
+   FILE *in, *info;
+   int bytes, index, arg, frames;
+   unsigned char *image;
+   char *mode = "", *inName = NULL, *outName = NULL;
+   char *profileName = NULL, *foldName = NULL, *symbolName = NULL, *traceName = NULL;
+   char *vgaName = NULL, *fifoName[2] = {NULL, NULL}, *inputName = NULL;
+   char *audioName = NULL;
+   char *saveName = NULL, *restoreName = NULL, *stopName = NULL, *serverName = NULL;
+   char *cacheName = NULL;
+   char symbolPath[1024], *ext;
+   unsigned int base = PLASMA_BASE_AUTO;
+   int result = 0, render = 0, cores = 1;
+   unsigned int privateBase = 0, privateSize = 0;
+   unsigned long long quantum = 10000;
+   unsigned long long renderFirst = 0, traceBytes, vgaInterval = 0, vgaRows;
+   long traceSize;
+   long long uartInOffset = -1;
+   double timeLimit = 0, timeStart;
+
+   s = plasma_create();
+   if(s == NULL)
+   {
+      printf("Out of memory\n");
+      return 1;
+   }
+   for(arg = 1; arg < argc && argv[arg][0] == '-' && argv[arg][1]; ++arg)
+   {
+      if(strchr("antiouwpfsTrSRxFmQPIDCXKOVeEBA", argv[arg][1]) && arg + 1 >= argc)
+         break;
+      switch(argv[arg][1])
+      {
+      case 'b': s->batch = 1; break;
+      case 'a': base = strtoul(argv[++arg], NULL, 16); break;
+      case 'n': s->budget = strtoull(argv[++arg], NULL, 0); break;
+      case 't': timeLimit = atof(argv[++arg]); break;
+      case 'i': inName = argv[++arg]; break;
+      case 'c': s->timing = 1; break;
+      case 'l': s->spinWait = 0; break;
+      case 'u': s->uartBaud = atoi(argv[++arg]); break;
+      case 'w': plasma_set_wait(s, atoi(argv[++arg])); s->timing = 1; break;
+      case 'o': outName = argv[++arg]; break;
+      case 'p': profileName = argv[++arg]; break;
+      case 'f': foldName = argv[++arg]; break;
+      case 'T': traceName = argv[++arg]; break;
+      case 'r': renderFirst = strtoull(argv[++arg], NULL, 0); render = 1; break;
+      case 's': symbolName = argv[++arg]; break;
+      case 'S': saveName = argv[++arg]; break;
+      case 'R': restoreName = argv[++arg]; break;
+      case 'x': stopName = argv[++arg]; break;
+      case 'F': serverName = argv[++arg]; s->batch = 1; break;
+      case 'm': cores = atoi(argv[++arg]); s->batch = 1; break;
+      case 'Q': quantum = strtoull(argv[++arg], NULL, 0); break;
+      case 'I':
+      case 'D':
+         if(plasma_set_cache(s, argv[arg][1] == 'D', argv[arg + 1]))
+         {
+            fprintf(stderr, "Bad cache %s\n", argv[arg + 1]);
+            return 1;
+         }
+         ++arg;
+         break;
+      case 'C': cacheName = argv[++arg]; break;
+      case 'X':
+         if(plasma_custom_project(s, argv[++arg]) < 0)
+         {
+            fprintf(stderr, "Unknown custom instructions %s\n", argv[arg]);
+            return 1;
+         }
+         break;
+      case 'K':
+         if(plasma_coproc_project(s, argv[++arg]) < 0)
+         {
+            fprintf(stderr, "Unknown coprocessors %s\n", argv[arg]);
+            return 1;
+         }
+         break;
+      case 'O':
+         ext = strrchr(argv[++arg], ',');
+         if(ext)
+            *ext++ = 0;
+         s->oled = oled_open(argv[arg], ext ? (unsigned long long)(atof(ext) * CLOCK_HZ / 1000) : 0);
+         if(s->oled == NULL)
+         {
+            fprintf(stderr, "Bad OLED frame pattern %s\n", argv[arg]);
+            return 1;
+         }
+         break;
+      case 'A':
+         audioName = argv[++arg];
+         break;
+      case 'B':
+         inputName = argv[++arg];
+         break;
+      case 'e':
+         fifoName[0] = argv[++arg];
+         break;
+      case 'E':
+         fifoName[1] = argv[++arg];
+         break;
+      case 'V':
+         vgaName = argv[++arg];
+         ext = strrchr(vgaName, ',');
+         if(ext)
+         {
+            *ext++ = 0;
+            vgaInterval = (unsigned long long)(atof(ext) * CLOCK_HZ / 1000);
+         }
+         break;
+      case 'P': 
+         privateBase = strtoul(argv[++arg], &ext, 16);
+         privateSize = *ext == ':' ? strtoul(ext + 1, NULL, 16) : 0;
+         break;
+      default:
+         usage();
+         return 1;
+      }
+   }
+   if(arg >= argc) 
+   {
+      usage();
+      return 0;
+   }
+   if(arg + 1 < argc)
+      mode = argv[arg + 1];
+   if(render)
+      return trace_render(argv[arg], renderFirst, s->budget, mode[0] == 'V');
+   if(serverName && (traceName || s->oled || vgaName || audioName || fifoName[0] ||
+      fifoName[1]))
+   {
+      //fork() copies only this thread, so a child has no trace or frame
+      //writer, and the children would share the device files
+      fprintf(stderr, "-T, -O, -V, -A, -e and -E can't be used with -F\n");
+      return 1;
+   }
+
+   //Keep stdout for the UART in batch mode
+   info = s->batch ? stderr : stdout;
+   fprintf(info, "Plasma emulator\n");
+   if(mode[0] == 'L')
+      s->big_endian = 0;
+   bytes = plasma_load(s, argv[arg], base);
+   if(bytes < 0) 
    { 
-      printf("Can't open file %s!\n",argv[1]); 
+      printf("Can't open file %s!\n",argv[arg]); 
+      if(s->batch)
+         return 1;
       getch(); 
       return(0); 
    }
-   bytes = fread(s->mem, 1, MEM_SIZE, in);
-   fclose(in);
-   memcpy(s->mem + 1024*1024, s->mem, 1024*1024);  //internal 8KB SRAM
-   printf("Read %d bytes.\n", bytes);
-   cache_init();
-   if(argc == 3 && argv[2][0] == 'B') 
+   base = s->pc;
+   fprintf(info, "Read %d bytes.\n", bytes);
+   if(mode[0] == 'B') 
    {
-      printf("Big Endian\n");
+      fprintf(info, "Big Endian\n");
       s->big_endian = 1;
    }
-   if(argc == 3 && argv[2][0] == 'L') 
+   if(mode[0] == 'L') 
    {
-      printf("Big Endian\n");
+      fprintf(info, "Big Endian\n");
       s->big_endian = 0;
    }
    s->processId = 0;
-   if(argc == 3 && argv[2][0] == 'S') 
+   if(mode[0] == 'S') 
    {  /*make big endian*/
       printf("Big Endian\n");
+      image = s->mem + mem_offset(base);
       for(index = 0; index < bytes+3; index += 4) 
       {
-         *(unsigned int*)&s->mem[index] = htonl(*(unsigned int*)&s->mem[index]);
+         *(unsigned int*)&image[index] = htonl(*(unsigned int*)&image[index]);
       }
       in = fopen("big.exe", "wb");
-      fwrite(s->mem, bytes, 1, in);
+      fwrite(image, bytes, 1, in);
       fclose(in);
       return(0);
    }
-   if(argc == 3 && argv[2][1] == 'D') 
+   if(mode[0] && mode[1] == 'D') 
    {  /*dump image*/
       for(index = 0; index < bytes; index += 4) {
-         s->pc = index;
+         s->pc = base + index;
          cycle(s, 10);
       }
-      free(s->mem);
+      plasma_destroy(s);
       return(0);
    }
-   s->pc = 0x0;
-   index = mem_read(s, 4, 0);
-   if((index & 0xffffff00) == 0x3c1c1000)
-      s->pc = 0x10000000;
-   do_debug(s);
-   free(s->mem);
-   return(0);
+   s->pc = base;
+   s->pc_next = base + 4;
+   if(restoreName)
+   {
+      timeStart = host_time();
+      if(snapshot_restore(s, restoreName, &uartInOffset))
+      {
+         fprintf(stderr, "Can't restore snapshot %s\n", restoreName);
+         return 1;
+      }
+      fprintf(info, "Restored %s at pc=0x%8.8x in %.3f ms\n", restoreName, s->pc,
+         (host_time() - timeStart) * 1e3);
+   }
+   if(vgaName && vga_open(s, vgaName, vgaInterval))
+   {
+      fprintf(stderr, "Bad VGA frame pattern %s\n", vgaName);
+      return 1;
+   }
+   for(index = 0; index < 2; ++index)
+   {
+      if(fifoName[index] && plasma_set_fifo(s, index, fifoName[index]))
+      {
+         fprintf(stderr, "Can't open FIFO file %s\n", fifoName[index]);
+         return 1;
+      }
+   }
+   if(inputName && (index = plasma_set_input(s, inputName)) != 0)
+   {
+      if(index < 0)
+         fprintf(stderr, "Can't open input script %s\n", inputName);
+      else
+         fprintf(stderr, "%s:%d: bad input event\n", inputName, index);
+      return 1;
+   }
+   if(audioName)
+   {
+      ext = strrchr(audioName, ',');
+      if(ext)
+         *ext++ = 0;
+      if(pwm_open(s, audioName, ext ? atoi(ext) : 0))
+      {
+         fprintf(stderr, "Can't create %s\n", audioName);
+         return 1;
+      }
+   }
+   else if(saveName)
+      pwm_open(s, NULL, 0);              //the snapshot keeps the samples for a later -A
+   if(stopName)
+   {
+      s->stopAt = strtoul(stopName, &ext, 16);
+      if(*ext)
+         s->stopAt = 0;               //a function name
+   }
+   if(profileName || foldName || cacheName || s->stopAt == 0)
+   {
+      if(profileName)
+         s->profile = (ProfileCount*)calloc(MEM_SIZE / 4, sizeof(ProfileCount));
+      if(foldName)
+         s->calls = calls_init(s->pc);
+      if(symbolName)
+         s->symbols = symbols_load(symbolName);
+      else
+      {
+         //file.bin -> file.axf, else file.map
+         snprintf(symbolPath, sizeof(symbolPath) - 4, "%s", argv[arg]);
+         ext = strrchr(symbolPath, '.');
+         if(ext == NULL || strchr(ext, '/'))
+            ext = symbolPath + strlen(symbolPath);
+         strcpy(ext, ".axf");
+         s->symbols = symbols_load(symbolPath);
+         if(s->symbols == NULL)
+         {
+            strcpy(ext, ".map");
+            s->symbols = symbols_load(symbolPath);
+         }
+      }
+      if(s->symbols)
+         fprintf(info, "Symbols: %d functions, %d data objects, %d line rows\n",
+            s->symbols->symCount, s->symbols->objCount, s->symbols->rowCount);
+      if(s->stopAt == 0 && (s->stopAt = symbol_address(s->symbols, stopName)) == 0)
+      {
+         fprintf(stderr, "Unknown stop address %s\n", stopName);
+         return 1;
+      }
+   }
+   if(strchr(mode, 'T'))
+   {
+      fprintf(info, "Basic-block engine\n");
+      s->engine = ENGINE_BLOCK;
+   }
+   if(strchr(mode, 'J'))
+   {
+#ifdef ENABLE_JIT
+      fprintf(info, "JIT engine\n");
+      s->engine = ENGINE_JIT;
+#else
+      fprintf(info, "JIT not available, using the basic-block engine\n");
+      s->engine = ENGINE_BLOCK;
+#endif
+   }
+   if(traceName)
+   {
+      s->trace = trace_open(traceName);
+      if(s->trace == NULL)
+      {
+         fprintf(stderr, "Can't write trace %s\n", traceName);
+         return 1;
+      }
+      if(s->engine != ENGINE_CYCLE)
+         fprintf(info, "Trace: using the cycle engine\n");
+      s->engine = ENGINE_CYCLE;
+   }
+   if((s->icache || s->dcache) && s->engine != ENGINE_CYCLE)
+   {
+      fprintf(info, "Cache model: using the cycle engine\n");
+      s->engine = ENGINE_CYCLE;
+   }
+   if(s->batch)
+   {
+      if(inName)
+         s->uartIn = strcmp(inName, "-") ? fopen(inName, "rb") : stdin;
+      s->uartOut = outName ? fopen(outName, "wb") : stdout;
+      if((inName && s->uartIn == NULL) || s->uartOut == NULL)
+      {
+         fprintf(stderr, "Can't open UART file\n");
+         return 1;
+      }
+      setvbuf(s->uartOut, NULL, _IOFBF, UART_BUFFER_SIZE);
+      if(s->uartIn && s->uartIn != stdin && uartInOffset > 0)
+         fseek(s->uartIn, (long)uartInOffset, SEEK_SET);
+      if(cores > 1)
+      {
+         soc = soc_create(s, cores, privateBase, privateSize);
+         result = soc ? soc_run(soc, quantum, timeLimit) : 1;
+         soc_destroy(soc);
+      }
+      else if(serverName == NULL || stopName)
+         result = run_batch(s, timeLimit);  //with -F, the warm-up to -x
+      if(serverName)
+      {
+         s->stopAt = 0xffffffff;
+         s->budget = ~0ULL;
+         result = fork_server(s, serverName, timeLimit);
+      }
+      if(saveName && snapshot_save(s, saveName))
+      {
+         fprintf(stderr, "Can't write snapshot %s\n", saveName);
+         result = 1;
+      }
+      if(s->uartIn && s->uartIn != stdin)
+         fclose(s->uartIn);
+      if(s->uartOut != stdout)
+         fclose(s->uartOut);
+   }
+   else
+   {
+      s->console = &console;
+      do_debug(s);
+   }
+   if(s->profile)
+      profile_report(s, profileName);
+   if(s->icache || s->dcache)
+      cache_report(s, info, cacheName);
+   if(s->coproc[0].model || s->coproc[1].model || s->coproc[2].model || s->coproc[3].model)
+      coproc_report(s, info);
+   if(s->fifo[0] || s->fifo[1])
+      fifo_report(s, info);
+   if(s->input)
+      input_report(s, info);
+   if(s->pwm && audioName)
+      pwm_report(s, info);
+   if(s->calls)
+      calls_report(s, foldName, profileName);
+   if(s->trace)
+   {
+      traceBytes = trace_close(s->trace);
+      s->trace = NULL;
+      in = fopen(traceName, "rb");
+      fseek(in, 0, SEEK_END);
+      traceSize = ftell(in);
+      fclose(in);
+      fprintf(info, "mlite: trace %llu bytes raw, %ld bytes written\n", traceBytes, traceSize);
+   }
+   if(s->oled)
+   {
+      fprintf(info, "mlite: %d OLED frames written\n", oled_close(s->oled));
+      s->oled = NULL;
+   }
+   if(s->vgaOut)
+   {
+      frames = vga_close(s, &vgaRows);
+      fprintf(info, "mlite: %d VGA frames written, %llu rows converted\n", frames, vgaRows);
+   }
+   plasma_destroy(s);
+   return result;
 }
 
@@ -0,0 +1,812 @@
+/*-------------------------------------------------------------------
+-- TITLE: Plasma CPU parameter sweeps
+-- DATE CREATED: 10/17/26
+-- FILENAME: msweep.c
+-- PROJECT: Plasma CPU core
+-- COPYRIGHT: Software placed into the public domain.
+--    Software 'as is' without warranty.
+-- DESCRIPTION:
+--   Runs one firmware image over a list of cases, each on its own
+--   plasmasim instance, on a pool of host threads.  The results of
+--   every case go into one CSV or JSON table.  msweep_tsi.txt is an
+--   example: msweep ../../OBJ/tsi/tsi.bin msweep_tsi.txt
+--------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "plasmasim.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+/* The case file has one case per line, '#' starts a comment:
+      name setting setting...
+   with the settings
+      image=file            run another image (default: the command line one)
+      uart=file             UART input
+      uart_rgb=file[,WxH]   UART input of the pixels of a PGM/PPM, see uart_rgb()
+      word=address:value    store a 32-bit word after loading
+      byte=address:value    store a byte
+      mem=address:hexbytes  store bytes
+      reg=N:value           set register N
+      budget=count          stop after count instructions
+      time=seconds          stop after seconds of host time
+      custom=project        C models of the custom.aluN opcodes, as mlite -X
+      coproc=project        C models of the COPROC_n, as mlite -K
+      fifo_in=file          FIFO_IN source, file[,depth[,clocks]] as mlite -e
+      fifo_out=file         FIFO_OUT sink, as mlite -E
+      input=file            button and switch events, as mlite -B
+      audio=file[,Hz]       PWM audio as a WAV file, as mlite -A
+   In the files fifo_out and audio write, %s stands for the case name
+   and %d for its number in the sweep; cases that would write the same
+   file are refused.  An address is hex or a function or data object
+   from the .axf/.map, optionally +offset; values are C numbers (100,
+   0x64).  Alternatives separated by '|' make a matrix:
+   "uart_rgb=moon.pgm,96x63|m31.ppm coproc=tsi|tsi,2=8/4" is four cases. */
+
+#define SETTINGS_MAX 32
+#define LINE_SIZE    4096
+
+typedef struct
+{
+   char kind;                 //'w' word, 'b' byte, 'm' bytes, 'r' register
+   unsigned int address;      //or register number
+   unsigned int value;
+   unsigned char *bytes;
+   int size;
+} Patch;
+
+typedef struct
+{
+   char *name;
+   int number;                //1.. in the order of the case file
+   char *params;              //the settings of this case after expansion
+   char *image;               //NULL: the default image
+   char *uartName;
+   int uartRgb;               //uartName is a picture, see uart_rgb()
+   char *custom;              //plasma_custom_project() spec or NULL
+   char *coproc;              //plasma_coproc_project() spec or NULL
+   char *fifo[2];             //plasma_set_fifo() specs or NULL
+   char *input;               //plasma_set_input() script or NULL
+   char *audio;               //pwm_open() file[,Hz] or NULL
+   Patch *patch;
+   int patchCount;
+   unsigned long long budget;
+   double timeLimit;
+   //Results
+   int ok;                    //the image and UART input could be opened
+   int stopReason, exitCode;
+   unsigned int pc;
+   unsigned long long instructions, cycles;
+   char *uart;
+   size_t uartSize;
+   double seconds;
+} Case;
+
+typedef struct
+{
+   Case *list;
+   int count, next;
+   const char *image;         //defaults from the command line
+   int big_endian, engine, timing, waitExternal;
+   unsigned long long budget;
+   double timeLimit;
+#ifndef WIN32
+   pthread_mutex_t lock;
+#endif
+} Sweep;
+
+static const char *stopNames[] = {"running", "break", "halt", "error",
+   "budget", "time", "address"};
+
+static int hex_nibble(int ch)
+{
+   if(ch >= '0' && ch <= '9')
+      return ch - '0';
+   ch = tolower(ch);
+   return ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : -1;
+}
+
+//Hex address or symbol[+offset]; returns 0 with *ok cleared when unknown
+static unsigned int parse_address(const Symbols *sym, const char *text, int *ok)
+{
+   char name[256], *end;
+   unsigned int address, offset = 0;
+   const char *plus = strchr(text, '+');
+   int length = plus ? (int)(plus - text) : (int)strlen(text);
+
+   if(length >= (int)sizeof(name))
+      length = sizeof(name) - 1;
+   memcpy(name, text, length);
+   name[length] = 0;
+   if(plus)
+      offset = strtoul(plus + 1, NULL, 0);
+   if(sym && (address = symbol_address(sym, name)) != 0)
+      return address + offset;
+   address = strtoul(name, &end, 16);
+   if(*end || end == name)
+      *ok = 0;
+   return address + offset;
+}
+
+//Next number of a PNM header or plain raster, skipping comments; -1 at the end
+static int pnm_number(FILE *in)
+{
+   int ch, value;
+
+   while((ch = getc(in)) != EOF)
+   {
+      if(ch == '#')
+      {
+         while((ch = getc(in)) != EOF && ch != '\n')
+            ;
+      }
+      else if(isdigit(ch))
+      {
+         for(value = 0; ch != EOF && isdigit(ch); ch = getc(in))
+            value = value * 10 + ch - '0';
+         return value;                   //one whitespace read past, as the format wants
+      }
+   }
+   return -1;
+}
+
+/* UART input of the R,G,B bytes of the top-left WxH pixels of a PGM or
+   PPM picture (P2, P3, P5, P6), row by row as C/tsi/push_image.m sends
+   them; grey pixels give three equal bytes.  spec is "file[,WxH]", the
+   whole picture by default.  Returns NULL for a file that can't be read
+   or is smaller than WxH */
+static FILE *uart_rgb(const char *spec)
+{
+   const char *comma = strchr(spec, ',');
+   size_t length = comma ? (size_t)(comma - spec) : strlen(spec);
+   char name[1024];
+   unsigned char rgb[3];
+   int kind, width, height, maxValue, cropWidth, cropHeight, channels, x, y, index, value;
+   FILE *in, *out = NULL;
+
+   if(length >= sizeof(name))
+      return NULL;
+   memcpy(name, spec, length);
+   name[length] = 0;
+   in = fopen(name, "rb");
+   if(in == NULL)
+      return NULL;
+   kind = getc(in) == 'P' ? getc(in) - '0' : 0;
+   width = pnm_number(in);
+   height = pnm_number(in);
+   maxValue = kind == 2 || kind == 3 || kind == 5 || kind == 6 ? pnm_number(in) : 0;
+   cropWidth = width;
+   cropHeight = height;
+   if(comma && sscanf(comma + 1, "%dx%d", &cropWidth, &cropHeight) != 2)
+      maxValue = 0;
+   if(maxValue >= 1 && maxValue <= 255 && cropWidth >= 1 && cropHeight >= 1 &&
+      cropWidth <= width && cropHeight <= height)
+      out = tmpfile();
+   channels = kind == 3 || kind == 6 ? 3 : 1;
+   for(y = 0; y < cropHeight && out; ++y)
+   {
+      for(x = 0; x < width && out; ++x)
+      {
+         for(index = 0; index < channels; ++index)
+         {
+            value = kind <= 3 ? pnm_number(in) : getc(in);
+            if(value < 0)
+               break;
+            rgb[index] = (unsigned char)(value * 255 / maxValue);
+         }
+         if(index < channels)
+         {
+            fclose(out);                 //short raster
+            out = NULL;
+         }
+         else if(x < cropWidth && channels == 3)
+            fwrite(rgb, 1, 3, out);
+         else if(x < cropWidth)
+         {
+            for(index = 0; index < 3; ++index)
+               putc(rgb[0], out);
+         }
+      }
+   }
+   fclose(in);
+   if(out)
+      rewind(out);
+   return out;
+}
+
+//Fill in one case from its settings; returns 0 and reports on a bad one
+static int case_setting(Case *c, const Symbols *sym, char *setting)
+{
+   char *value = strchr(setting, '='), *colon;
+   Patch *p;
+   int ok = 1, high, low;
+
+   if(value == NULL)
+      return 0;
+   *value++ = 0;
+   colon = strchr(value, ':');
+   if(strcmp(setting, "image") == 0)
+      c->image = strdup(value);
+   else if(strcmp(setting, "uart") == 0 || strcmp(setting, "uart_rgb") == 0)
+   {
+      c->uartName = strdup(value);
+      c->uartRgb = setting[4] == '_';
+   }
+   else if(strcmp(setting, "custom") == 0)
+      c->custom = strdup(value);
+   else if(strcmp(setting, "coproc") == 0)
+      c->coproc = strdup(value);
+   else if(strcmp(setting, "fifo_in") == 0)
+      c->fifo[0] = strdup(value);
+   else if(strcmp(setting, "fifo_out") == 0)
+      c->fifo[1] = strdup(value);
+   else if(strcmp(setting, "input") == 0)
+      c->input = strdup(value);
+   else if(strcmp(setting, "audio") == 0)
+      c->audio = strdup(value);
+   else if(strcmp(setting, "budget") == 0)
+      c->budget = strtoull(value, NULL, 0);
+   else if(strcmp(setting, "time") == 0)
+      c->timeLimit = atof(value);
+   else if(colon && (strcmp(setting, "word") == 0 || strcmp(setting, "byte") == 0 ||
+           strcmp(setting, "mem") == 0 || strcmp(setting, "reg") == 0))
+   {
+      *colon++ = 0;
+      c->patch = (Patch*)realloc(c->patch, (c->patchCount + 1) * sizeof(Patch));
+      p = &c->patch[c->patchCount++];
+      memset(p, 0, sizeof(Patch));
+      p->kind = setting[0];
+      if(p->kind == 'r')
+      {
+         p->address = strtoul(value, NULL, 0);
+         ok = p->address > 0 && p->address < 32;
+      }
+      else
+         p->address = parse_address(sym, value, &ok);
+      if(p->kind == 'm')
+      {
+         p->bytes = (unsigned char*)malloc(strlen(colon) / 2 + 1);
+         for(; (high = hex_nibble(colon[0])) >= 0 && (low = hex_nibble(colon[1])) >= 0;
+             colon += 2)
+            p->bytes[p->size++] = (unsigned char)(high << 4 | low);
+      }
+      else
+         p->value = strtoul(colon, NULL, 0);
+   }
+   else
+      ok = 0;
+   if(ok == 0)
+      fprintf(stderr, "msweep: case %s: bad setting %s=%s\n", c->name, setting, value);
+   return ok;
+}
+
+//Output spec with %s replaced by the case name and %d by its number
+static char *case_output(const Case *c, char *spec)
+{
+   char *path, *out, *in;
+   size_t length;
+
+   if(spec == NULL)
+      return NULL;
+   length = strlen(spec) + 1;
+   for(in = spec; (in = strchr(in, '%')) != NULL; ++in)
+      length += strlen(c->name) + 12;
+   path = out = (char*)malloc(length);
+   for(in = spec; *in; ++in)
+   {
+      if(in[0] == '%' && in[1] == 's')
+         out += sprintf(out, "%s", c->name);
+      else if(in[0] == '%' && in[1] == 'd')
+         out += sprintf(out, "%d", c->number);
+      else
+      {
+         *out++ = *in;
+         continue;
+      }
+      ++in;
+   }
+   *out = 0;
+   free(spec);
+   return path;
+}
+
+//The file parts of two "file[,...]" output specs are the same
+static int same_file(const char *a, const char *b)
+{
+   size_t length;
+
+   if(a == NULL || b == NULL)
+      return 0;
+   length = strcspn(a, ",");
+   return length == strcspn(b, ",") && strncmp(a, b, length) == 0;
+}
+
+//Cases a and b, or the outputs of one case when a == b, write the same file
+static int case_clash(const Case *a, const Case *b)
+{
+   return same_file(a->audio, b->fifo[1]) || (a != b &&
+      (same_file(a->audio, b->audio) || same_file(a->fifo[1], b->fifo[1]) ||
+       same_file(a->fifo[1], b->audio)));
+}
+
+/* Expand the '|' alternatives of settings[index..] into cases; chosen
+   holds the values picked so far.  Returns 0 on a bad setting. */
+static int case_expand(Sweep *sw, const Symbols *sym, const char *name,
+                       char **settings, int count, int index, char **chosen)
+{
+   char value[LINE_SIZE], *key, *alt, *next, *params, *setting;
+   Case *c;
+   int length, i, ok = 1;
+
+   if(index == count)
+   {
+      sw->list = (Case*)realloc(sw->list, (sw->count + 1) * sizeof(Case));
+      c = &sw->list[sw->count++];
+      memset(c, 0, sizeof(Case));
+      c->name = strdup(name);
+      c->number = sw->count;
+      for(length = 1, i = 0; i < count; ++i)
+         length += strlen(chosen[i]) + 1;
+      params = c->params = (char*)calloc(length, 1);
+      for(i = 0; i < count && ok; ++i)
+      {
+         if(i)
+            strcat(params, " ");
+         strcat(params, chosen[i]);
+         setting = strdup(chosen[i]);
+         ok = case_setting(c, sym, setting);
+         free(setting);
+      }
+      c->fifo[1] = case_output(c, c->fifo[1]);
+      c->audio = case_output(c, c->audio);
+      return ok;
+   }
+
+   //key=a|b|c: one branch per alternative
+   snprintf(value, sizeof(value), "%s", settings[index]);
+   key = strchr(value, '=');
+   if(key == NULL)
+   {
+      chosen[index] = settings[index];
+      return case_expand(sw, sym, name, settings, count, index + 1, chosen);
+   }
+   *key++ = 0;
+   for(alt = key; alt && ok; alt = next)
+   {
+      next = strchr(alt, '|');
+      if(next)
+         *next++ = 0;
+      chosen[index] = (char*)malloc(strlen(value) + strlen(alt) + 2);
+      sprintf(chosen[index], "%s=%s", value, alt);
+      ok = case_expand(sw, sym, name, settings, count, index + 1, chosen);
+      free(chosen[index]);
+   }
+   return ok;
+}
+
+static int cases_load(Sweep *sw, const Symbols *sym, const char *name)
+{
+   char line[LINE_SIZE], *token, *caseName, *settings[SETTINGS_MAX];
+   char *chosen[SETTINGS_MAX];
+   int count, lineNumber = 0, index, other;
+   FILE *in = fopen(name, "r");
+
+   if(in == NULL)
+   {
+      fprintf(stderr, "Can't open case file %s\n", name);
+      return 0;
+   }
+   while(fgets(line, sizeof(line), in))
+   {
+      ++lineNumber;
+      if((token = strchr(line, '#')))
+         *token = 0;
+      caseName = strtok(line, " \t\r\n");
+      if(caseName == NULL)
+         continue;
+      for(count = 0; count < SETTINGS_MAX && (token = strtok(NULL, " \t\r\n")); )
+         settings[count++] = token;
+      if(case_expand(sw, sym, caseName, settings, count, 0, chosen) == 0)
+      {
+         fprintf(stderr, "%s:%d: bad case\n", name, lineNumber);
+         fclose(in);
+         return 0;
+      }
+   }
+   fclose(in);
+   //The cases run at once, so each output file needs its own case
+   for(index = 0; index < sw->count; ++index)
+   {
+      for(other = 0; other <= index; ++other)
+      {
+         if(case_clash(&sw->list[index], &sw->list[other]) && other == index)
+         {
+            fprintf(stderr, "%s: case %d (%s) writes audio and FIFO_OUT to one file\n",
+               name, index + 1, sw->list[index].name);
+            return 0;
+         }
+         if(case_clash(&sw->list[index], &sw->list[other]))
+         {
+            fprintf(stderr, "%s: cases %d (%s) and %d (%s) write the same file, "
+               "use %%s or %%d in its name\n", name, other + 1, sw->list[other].name,
+               index + 1, sw->list[index].name);
+            return 0;
+         }
+      }
+   }
+   return 1;
+}
+
+//Worker: one fresh instance per case
+static void case_run(Sweep *sw, Case *c)
+{
+   State *s = plasma_create();
+   FILE *uartIn = NULL;
+   Patch *p;
+   char *comma;
+   double start = host_time();
+   int index, bytes;
+
+   if(s == NULL)
+      return;
+   s->big_endian = sw->big_endian;
+   s->engine = sw->engine;
+   s->timing = sw->timing;
+   if(sw->waitExternal)
+      plasma_set_wait(s, sw->waitExternal);
+   if(c->custom && plasma_custom_project(s, c->custom) < 0)
+   {
+      fprintf(stderr, "msweep: case %s: unknown custom instructions %s\n", c->name, c->custom);
+      plasma_destroy(s);
+      return;
+   }
+   if(c->coproc && plasma_coproc_project(s, c->coproc) < 0)
+   {
+      fprintf(stderr, "msweep: case %s: unknown coprocessors %s\n", c->name, c->coproc);
+      plasma_destroy(s);
+      return;
+   }
+   for(index = 0; index < 2; ++index)
+   {
+      if(c->fifo[index] && plasma_set_fifo(s, index, c->fifo[index]) < 0)
+      {
+         fprintf(stderr, "msweep: case %s: can't open FIFO file %s\n", c->name, c->fifo[index]);
+         plasma_destroy(s);
+         return;
+      }
+   }
+   if(c->input && plasma_set_input(s, c->input) != 0)
+   {
+      fprintf(stderr, "msweep: case %s: bad input script %s\n", c->name, c->input);
+      plasma_destroy(s);
+      return;
+   }
+   if(c->audio)
+   {
+      comma = strrchr(c->audio, ',');
+      if(comma)
+         *comma = 0;
+      index = pwm_open(s, c->audio, comma ? atoi(comma + 1) : 0);
+      if(comma)
+         *comma = ',';
+      if(index < 0)
+      {
+         fprintf(stderr, "msweep: case %s: can't create %s\n", c->name, c->audio);
+         plasma_destroy(s);
+         return;
+      }
+   }
+   bytes = plasma_load(s, c->image ? c->image : sw->image, PLASMA_BASE_AUTO);
+   if(c->uartName)
+      uartIn = c->uartRgb ? uart_rgb(c->uartName) : fopen(c->uartName, "rb");
+   if(bytes < 0 || (c->uartName && uartIn == NULL))
+   {
+      if(uartIn)
+         fclose(uartIn);
+      plasma_destroy(s);
+      return;
+   }
+   for(p = c->patch; p < c->patch + c->patchCount; ++p)
+   {
+      if(p->kind == 'w')
+         plasma_write(s, p->address, p->value, 4);
+      else if(p->kind == 'b')
+         plasma_write(s, p->address, p->value, 1);
+      else if(p->kind == 'r')
+         s->r[p->address] = p->value;
+      else
+      {
+         for(index = 0; index < p->size; ++index)
+            plasma_write(s, p->address + index, p->bytes[index], 1);
+      }
+   }
+   s->batch = 1;
+   s->quiet = 1;
+   s->budget = c->budget ? c->budget : sw->budget;
+   s->uartIn = uartIn;
+#ifndef WIN32
+   s->uartOut = open_memstream(&c->uart, &c->uartSize);
+#else
+   s->uartOut = tmpfile();
+#endif
+   c->exitCode = run_batch(s, c->timeLimit > 0 ? c->timeLimit : sw->timeLimit);
+#ifdef WIN32
+   c->uartSize = ftell(s->uartOut);
+   c->uart = (char*)malloc(c->uartSize + 1);
+   rewind(s->uartOut);
+   c->uartSize = fread(c->uart, 1, c->uartSize, s->uartOut);
+#endif
+   fclose(s->uartOut);
+   s->uartOut = NULL;
+   if(uartIn)
+      fclose(uartIn);
+   c->ok = 1;
+   c->stopReason = s->stopReason;
+   c->pc = s->pc;
+   c->instructions = s->instructions;
+   c->cycles = s->cycles;
+   c->seconds = host_time() - start;
+   plasma_destroy(s);
+}
+
+static void *sweep_worker(void *arg)
+{
+   Sweep *sw = (Sweep*)arg;
+   int index;
+
+   for(;;)
+   {
+#ifndef WIN32
+      pthread_mutex_lock(&sw->lock);
+#endif
+      index = sw->next++;
+#ifndef WIN32
+      pthread_mutex_unlock(&sw->lock);
+#endif
+      if(index >= sw->count)
+         return NULL;
+      case_run(sw, &sw->list[index]);
+      fprintf(stderr, "msweep: %s %s: %s\n", sw->list[index].name, sw->list[index].params,
+         sw->list[index].ok ? stopNames[sw->list[index].stopReason] : "can't open");
+   }
+}
+
+//CSV field: quoted, with quotes doubled
+static void csv_string(FILE *out, const char *text, size_t size)
+{
+   putc('"', out);
+   for(; size--; ++text)
+   {
+      if(*text == '"')
+         putc('"', out);
+      putc(*text, out);
+   }
+   putc('"', out);
+}
+
+//CSV field of raw bytes such as the UART output: two hex digits per byte
+static void csv_hex(FILE *out, const char *data, size_t size)
+{
+   for(; size--; ++data)
+      fprintf(out, "%2.2x", (unsigned char)*data);
+}
+
+static void json_string(FILE *out, const char *text, size_t size)
+{
+   unsigned char ch;
+
+   putc('"', out);
+   for(; size--; ++text)
+   {
+      ch = (unsigned char)*text;
+      if(ch == '"' || ch == '\\')
+         fprintf(out, "\\%c", ch);
+      else if(ch == '\n')
+         fputs("\\n", out);
+      else if(ch < 0x20 || ch >= 0x7f)
+         fprintf(out, "\\u%4.4x", ch);
+      else
+         putc(ch, out);
+   }
+   putc('"', out);
+}
+
+static void results_write(Sweep *sw, FILE *out, int json)
+{
+   Case *c;
+   int index;
+
+   if(json)
+      fprintf(out, "[\n");
+   else
+      fprintf(out, "name,params,stop,exit,pc,instructions,cycles,seconds,uart_bytes,uart_hex\n");
+   for(index = 0; index < sw->count; ++index)
+   {
+      c = &sw->list[index];
+      if(json)
+      {
+         fprintf(out, "  {\"name\": ");
+         json_string(out, c->name, strlen(c->name));
+         fprintf(out, ", \"params\": ");
+         json_string(out, c->params, strlen(c->params));
+         fprintf(out, ", \"stop\": \"%s\", \"exit\": %d, \"pc\": \"%8.8x\", "
+            "\"instructions\": %llu, \"cycles\": %llu, \"seconds\": %.3f, \"uart\": ",
+            c->ok ? stopNames[c->stopReason] : "open", c->ok ? c->exitCode : 1,
+            c->pc, c->instructions, c->cycles, c->seconds);
+         json_string(out, c->uart ? c->uart : "", c->uartSize);
+         fprintf(out, "}%s\n", index + 1 < sw->count ? "," : "");
+      }
+      else
+      {
+         csv_string(out, c->name, strlen(c->name));
+         putc(',', out);
+         csv_string(out, c->params, strlen(c->params));
+         fprintf(out, ",%s,%d,%8.8x,%llu,%llu,%.3f,%lu,",
+            c->ok ? stopNames[c->stopReason] : "open", c->ok ? c->exitCode : 1,
+            c->pc, c->instructions, c->cycles, c->seconds, (unsigned long)c->uartSize);
+         csv_hex(out, c->uart, c->uartSize);
+         putc('\n', out);
+      }
+   }
+   if(json)
+      fprintf(out, "]\n");
+}
+
+static void usage(void)
+{
+   printf("   Usage:  msweep [options] file.bin cases.txt [mode]\n");
+   printf("           mode as for mlite: B, L, BT (basic blocks), BJ (JIT)\n");
+   printf("   Options:\n");
+   printf("           -j threads  worker threads (default: host cores)\n");
+   printf("           -n count    stop each case after count instructions\n");
+   printf("           -t seconds  stop each case after seconds of host time\n");
+   printf("           -o file     results, JSON when file ends in .json (default stdout CSV)\n");
+   printf("           -c          cycle timing model of the Plasma pipeline\n");
+   printf("           -w clocks   timing: wait states per external RAM access\n");
+   printf("           -s file     symbols for case addresses (default file.axf, file.map)\n");
+   printf("   See the top of msweep.c for the case file format.\n");
+}
+
+int main(int argc, char *argv[])
+{
+   Sweep sweep, *sw = &sweep;
+   Symbols *sym;
+   FILE *out = stdout;
+   char *mode = "", *outName = NULL, *symbolName = NULL, symbolPath[1024], *ext;
+   int arg, index, threads = 0, json = 0;
+   unsigned long long instructions = 0;
+   double start, elapsed;
+#ifndef WIN32
+   pthread_t *thread;
+#endif
+
+   memset(sw, 0, sizeof(Sweep));
+   sw->big_endian = 1;
+   sw->budget = ~0ULL;
+   for(arg = 1; arg < argc && argv[arg][0] == '-' && argv[arg][1]; ++arg)
+   {
+      if(strchr("jntows", argv[arg][1]) && arg + 1 >= argc)
+         break;
+      switch(argv[arg][1])
+      {
+      case 'j': threads = atoi(argv[++arg]); break;
+      case 'n': sw->budget = strtoull(argv[++arg], NULL, 0); break;
+      case 't': sw->timeLimit = atof(argv[++arg]); break;
+      case 'o': outName = argv[++arg]; break;
+      case 'c': sw->timing = 1; break;
+      case 'w': sw->waitExternal = atoi(argv[++arg]); sw->timing = 1; break;
+      case 's': symbolName = argv[++arg]; break;
+      default:
+         usage();
+         return 1;
+      }
+   }
+   if(arg + 1 >= argc)
+   {
+      usage();
+      return 0;
+   }
+   sw->image = argv[arg];
+   if(arg + 2 < argc)
+      mode = argv[arg + 2];
+   if(mode[0] == 'L')
+      sw->big_endian = 0;
+   if(strchr(mode, 'T'))
+      sw->engine = ENGINE_BLOCK;
+   if(strchr(mode, 'J'))
+   {
+#ifdef ENABLE_JIT
+      sw->engine = ENGINE_JIT;
+#else
+      sw->engine = ENGINE_BLOCK;
+#endif
+   }
+
+   if(symbolName)
+      sym = symbols_load(symbolName);
+   else
+   {
+      //file.bin -> file.axf, else file.map
+      snprintf(symbolPath, sizeof(symbolPath) - 4, "%s", sw->image);
+      ext = strrchr(symbolPath, '.');
+      if(ext == NULL || strchr(ext, '/'))
+         ext = symbolPath + strlen(symbolPath);
+      strcpy(ext, ".axf");
+      sym = symbols_load(symbolPath);
+      if(sym == NULL)
+      {
+         strcpy(ext, ".map");
+         sym = symbols_load(symbolPath);
+      }
+   }
+   index = cases_load(sw, sym, argv[arg + 1]);
+   symbols_free(sym);
+   if(index == 0)
+      return 1;
+
+#ifndef WIN32
+   if(threads <= 0)
+      threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+   if(threads <= 0)
+      threads = 1;
+   if(threads > sw->count)
+      threads = sw->count;
+   fprintf(stderr, "msweep: %d cases on %d threads\n", sw->count, threads);
+   start = host_time();
+#ifndef WIN32
+   pthread_mutex_init(&sw->lock, NULL);
+   thread = (pthread_t*)calloc(threads, sizeof(pthread_t));
+   for(index = 0; index < threads; ++index)
+      pthread_create(&thread[index], NULL, sweep_worker, sw);
+   for(index = 0; index < threads; ++index)
+      pthread_join(thread[index], NULL);
+   free(thread);
+   pthread_mutex_destroy(&sw->lock);
+#else
+   sweep_worker(sw);
+#endif
+   elapsed = host_time() - start;
+
+   if(outName)
+   {
+      out = fopen(outName, "w");
+      if(out == NULL)
+      {
+         fprintf(stderr, "Can't write %s\n", outName);
+         return 1;
+      }
+      ext = strrchr(outName, '.');
+      json = ext && strcmp(ext, ".json") == 0;
+   }
+   results_write(sw, out, json);
+   if(out != stdout)
+      fclose(out);
+
+   for(index = 0; index < sw->count; ++index)
+   {
+      instructions += sw->list[index].instructions;
+      free(sw->list[index].name);
+      free(sw->list[index].params);
+      free(sw->list[index].image);
+      free(sw->list[index].uartName);
+      free(sw->list[index].custom);
+      free(sw->list[index].coproc);
+      free(sw->list[index].fifo[0]);
+      free(sw->list[index].fifo[1]);
+      free(sw->list[index].input);
+      free(sw->list[index].audio);
+      free(sw->list[index].uart);
+      while(sw->list[index].patchCount--)
+         free(sw->list[index].patch[sw->list[index].patchCount].bytes);
+      free(sw->list[index].patch);
+   }
+   free(sw->list);
+   fprintf(stderr, "msweep: %llu instructions in %.3f s, %.2f MIPS\n", instructions,
+      elapsed, elapsed > 0 ? instructions / elapsed * 1e-6 : 0.0);
+   return 0;
+}
@@ -0,0 +1,6920 @@
+/*-------------------------------------------------------------------
+-- TITLE: Plasma CPU simulator library
+-- AUTHOR: Steve Rhoads (rhoadss@yahoo.com)
+-- DATE CREATED: 1/31/01
+-- FILENAME: plasmasim.c
+-- PROJECT: Plasma CPU core
+-- COPYRIGHT: Software placed into the public domain by the author.
+--    Software 'as is' without warranty.  Author liable for nothing.
+-- DESCRIPTION:
+--   Plasma CPU simulator in C code, split out of mlite.c.
+--   All machine state lives in State, see plasmasim.h.
+--   Assumes running on a little endian PC.
+--------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include "plasmasim.h"
+
+//Host byte swaps for the endian-specialized memory accessors
+#if defined(__GNUC__)
+#define bswap16(A) __builtin_bswap16(A)
+#define bswap32(A) __builtin_bswap32(A)
+#else
+#define bswap16(A) ntohs(A)
+#define bswap32(A) ntohl(A)
+#endif
+#if defined(_MSC_VER) && !defined(inline)
+#define inline __inline
+#endif
+
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+double host_time(void)
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+#else
+#include <time.h>
+
+double host_time(void)
+{
+   return (double)clock() / CLOCKS_PER_SEC;
+}
+#endif
+
+static char *opcode_string[]={
+   "SPECIAL","REGIMM","J","JAL","BEQ","BNE","BLEZ","BGTZ",
+   "ADDI","ADDIU","SLTI","SLTIU","ANDI","ORI","XORI","LUI",
+   "COP0","COP1","COP2","COP3","BEQL","BNEL","BLEZL","BGTZL",
+   "?","?","?","?","?","?","?","?",
+   "LB","LH","LWL","LW","LBU","LHU","LWR","?",
+   "SB","SH","SWL","SW","?","?","SWR","CACHE",
+   "LL","LWC1","LWC2","LWC3","?","LDC1","LDC2","LDC3"
+   "SC","SWC1","SWC2","SWC3","?","SDC1","SDC2","SDC3"
+};
+
+static char *special_string[]={
+   "SLL","?","SRL","SRA","SLLV","?","SRLV","SRAV",
+   "JR","JALR","MOVZ","MOVN","SYSCALL","BREAK","?","SYNC",
+   "MFHI","MTHI","MFLO","MTLO","?","?","?","?",
+   "MULT","MULTU","DIV","DIVU","?","?","?","?",
+   "ADD","ADDU","SUB","SUBU","AND","OR","XOR","NOR",
+   "?","?","SLT","SLTU","?","DADDU","?","?",
+   "TGE","TGEU","TLT","TLTU","TEQ","?","TNE","?",
+   "?","?","?","?","?","?","?","?"
+};
+
+static char *regimm_string[]={
+   "BLTZ","BGEZ","BLTZL","BGEZL","?","?","?","?",
+   "TGEI","TGEIU","TLTI","TLTIU","TEQI","?","TNEI","?",
+   "BLTZAL","BEQZAL","BLTZALL","BGEZALL","?","?","?","?",
+   "?","?","?","?","?","?","?","?"
+};
+
+/************* Page-table memory map *************/
+//Pages of directory entries that map nothing
+static Page pageNone[PAGE_DIR];
+
+#define PAGE(s, address) \
+   (&(s)->pageDir[(address) >> 22][((address) >> PAGE_SHIFT) & (PAGE_DIR - 1)])
+#define IO_LATCH(s, address) \
+   ((s)->ioLatch[((address) >> 28) - 2][((address) & PAGE_MASK) >> 2])
+
+//Offset into s->mem for an address inside one of the RAM windows
+unsigned int mem_offset(unsigned int address)
+{
+   unsigned int offset = address & (RAM_WINDOW - 1);
+
+   if((address >> 28) == (RAM_EXTERNAL >> 28))
+      offset += RAM_WINDOW;
+   return offset;
+}
+
+//Map size bytes at address to host memory, or to device handlers when host is NULL
+static void page_map(State *s, unsigned int address, unsigned int size,
+                     unsigned char *host, DeviceRead read, DeviceWrite write)
+{
+   Page *page;
+   unsigned int index;
+
+   for(index = 0; index < size; index += PAGE_SIZE)
+   {
+      if(s->pageDir[(address + index) >> 22] == pageNone)
+         s->pageDir[(address + index) >> 22] = (Page*)calloc(PAGE_DIR, sizeof(Page));
+      page = PAGE(s, address + index);
+      page->host = host ? host + index : NULL;
+      page->read = read;
+      page->write = write;
+   }
+}
+
+//Registers without a model read back the last value written
+static unsigned int io_read(State *s, unsigned int address, int size)
+{
+   (void)size;
+   return IO_LATCH(s, address);
+}
+
+static void io_write(State *s, unsigned int address, unsigned int value, int size)
+{
+   (void)size;
+   IO_LATCH(s, address) = value;
+}
+
+static int soc_count(const Soc *soc);
+static unsigned int periph_read(State *s, unsigned int address, int size);
+static void periph_write(State *s, unsigned int address, unsigned int value, int size);
+static unsigned int fifo_read(State *s, unsigned int address, int size);
+static void fifo_write(State *s, unsigned int address, unsigned int value, int size);
+
+static void event_run(State *s);
+static void snapshot_resume(State *s);
+
+//Clocks of one 8N1 byte on the UART line
+static unsigned long long uart_clocks(const State *s)
+{
+   return (unsigned long long)CLOCK_HZ * 10 / s->uartBaud;
+}
+
+//IRQ_STATUS at s->cycles, which mem_read_endian() moves to the clock of the
+//reading instruction; without uartBaud the UART is never busy
+static unsigned int irq_status(State *s)
+{
+   unsigned int value;
+
+   if(s->cycles >= s->uartTxDone)
+      s->irqStatus |= IRQ_UART_WRITE_AVAILABLE;
+   if(s->cycles < s->uartRxReady)
+      ;                                   //uartBaud: the byte is still on the line
+   else if(s->batch)
+   {
+      if(s->uartIn && (value = getc(s->uartIn)) != (unsigned int)EOF)
+      {
+         ungetc(value, s->uartIn);
+         s->irqStatus |= IRQ_UART_READ_AVAILABLE;
+      }
+   }
+   else if(s->console && s->console->kbhit())
+      s->irqStatus |= IRQ_UART_READ_AVAILABLE;
+   s->irqStatus &= ~(IRQ_COUNTER18 | IRQ_COUNTER18_NOT | IRQ_GPIO31 | IRQ_GPIO31_NOT);
+   s->irqStatus |= (s->cycles & (1 << 18)) ? IRQ_COUNTER18 : IRQ_COUNTER18_NOT;
+   s->irqStatus |= (IO_LATCH(s, GPIOA_IN) >> 31) ? IRQ_GPIO31 : IRQ_GPIO31_NOT;
+   return s->irqStatus;
+}
+
+static unsigned int misc_read(State *s, unsigned int address, int size)
+{
+   unsigned int value;
+
+   if(s->peek && (address == UART_READ || address == IRQ_MASK + 4))
+   {
+      s->peekFailed = 1;                  //consumes input or idles the host
+      return 0;
+   }
+   switch(address)
+   {
+      case UART_READ: 
+         if(s->batch)
+         {
+            if(s->uartIn && (value = getc(s->uartIn)) != (unsigned int)EOF)
+               IO_LATCH(s, address) = value;
+         }
+         else if(s->console && s->console->kbhit())
+            IO_LATCH(s, address) = s->console->getch();
+         s->irqStatus &= ~IRQ_UART_READ_AVAILABLE; //clear bit
+         if(s->uartBaud)
+         {
+            s->uartRxReady = s->cycles + uart_clocks(s);
+            plasma_post(s, s->uartRxReady, NULL, 0);
+         }
+         break;
+      case IRQ_MASK + 4:
+         if(s->batch == 0 && s->console)
+            s->console->idle(10);
+         return 0;
+      case IRQ_STATUS: 
+         if(s->cycles >= s->nextEvent && s->peek == 0)
+            event_run(s);
+         return irq_status(s);
+      case MMU_PROCESS_ID:
+         return s->processId;
+      case MMU_FAULT_ADDR:
+         return s->faultAddr;
+      case COUNTER_REG:
+         return (unsigned int)s->cycles;
+      case CORE_ID_REG:
+         return s->coreId;
+      case CORE_COUNT_REG:
+         return soc_count(s->soc);
+   }
+   return io_read(s, address, size);
+}
+
+static void misc_write(State *s, unsigned int address, unsigned int value, int size)
+{
+   unsigned char *ptr;
+
+   switch(address)
+   {
+      case UART_WRITE: 
+         if(s->uartBaud)
+         {
+            if(s->cycles < s->uartTxDone)
+               s->cycles = s->uartTxDone;  //mem_pause while uart_write_busy
+            s->uartTxDone = s->cycles + uart_clocks(s);
+            s->irqStatus &= ~IRQ_UART_WRITE_AVAILABLE;
+            plasma_post(s, s->uartTxDone, NULL, 0);
+         }
+         if(s->uartOut)
+         {
+            putc(value, s->uartOut);
+            return;
+         }
+         if(s->console)
+         {
+            s->console->putch(value);
+            return;
+         }
+         putchar(value); 
+         fflush(stdout);
+         return;
+      case IRQ_STATUS: 
+         s->irqStatus = value; 
+         s->nextEvent = 0;
+         return;
+      case IRQ_MASK:
+         IO_LATCH(s, address) = value;
+         s->nextEvent = 0;                //the interrupt line may be up now
+         return;
+      case CONFIG_REG:
+         return;
+      case MMU_PROCESS_ID:
+         //printf("processId=%d\n", value);
+         s->processId = value;
+         return;
+   }
+
+   if(MMU_TLB <= address && address <= MMU_TLB+MMU_ENTRIES * 8)
+   {
+      //printf("TLB 0x%x 0x%x\n", address - MMU_TLB, value);
+      ptr = (unsigned char*)s->mmuEntry + address - MMU_TLB;
+      *(int*)ptr = value;
+      s->irqStatus &= ~IRQ_MMU;
+      return;
+   }
+   io_write(s, address, value, size);
+}
+
+//RAM is mapped so that snapshot_restore() can map file pages over it
+static unsigned char *host_alloc(unsigned int size)
+{
+#ifndef WIN32
+   void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   return ptr == MAP_FAILED ? NULL : (unsigned char*)ptr;
+#else
+   return (unsigned char*)calloc(size, 1);
+#endif
+}
+
+//Back to zero, dropping whatever was mapped there
+static void host_zero(unsigned char *ptr, unsigned int size)
+{
+#ifndef WIN32
+   if(mmap(ptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+      -1, 0) != MAP_FAILED)
+      return;
+#endif
+   memset(ptr, 0, size);
+}
+
+static void host_free(unsigned char *ptr, unsigned int size)
+{
+#ifndef WIN32
+   munmap(ptr, size);
+#else
+   (void)size;
+   free(ptr);
+#endif
+}
+
+static void memory_init(State *s)
+{
+   int index;
+
+   for(index = 0; index < PAGE_DIR; ++index)
+      s->pageDir[index] = pageNone;
+   s->mem = host_alloc(MEM_SIZE);
+   s->vga = host_alloc(VGA_SIZE);
+   page_map(s, RAM_INTERNAL, RAM_WINDOW, s->mem, NULL, NULL);
+   page_map(s, RAM_EXTERNAL, RAM_WINDOW, s->mem + RAM_WINDOW, NULL, NULL);
+   page_map(s, MISC_BASE, PAGE_SIZE, NULL, misc_read, misc_write);
+   page_map(s, FIFO_BASE, PAGE_SIZE, NULL, fifo_read, fifo_write);
+   page_map(s, PERIPH_BASE, PAGE_SIZE, NULL, periph_read, periph_write);
+   page_map(s, VGA_BASE, VGA_SIZE, s->vga, NULL, NULL);
+}
+
+static void memory_free(State *s)
+{
+   int index;
+
+   for(index = 0; index < PAGE_DIR; ++index)
+   {
+      if(s->pageDir[index] != pageNone)
+         free(s->pageDir[index]);
+   }
+   host_free(s->vga, VGA_SIZE);
+   host_free(s->mem, MEM_SIZE);
+}
+
+/* Unmapped addresses read as zero and ignore writes.  The _endian
+   accessors are inlined with a constant big so that each engine instance
+   gets its own copy without the byte order test */
+static inline int mem_read_endian(State *s, int size, unsigned int address, int big)
+{
+   const Page *page = PAGE(s, address);
+   unsigned int value=0;
+   unsigned char *ptr;
+
+   if(page->host == NULL)
+   {
+      if(s->peek && page->read != misc_read && page->read != periph_read &&
+         page->read != fifo_read && page->read != io_read)
+      {
+         s->peekFailed = 1;                  //device of the front end
+         return 0;
+      }
+      if(page->read == NULL)
+         return 0;
+      s->cycles += s->at;                    //the clock of this instruction in a block
+      value = page->read(s, address, size);
+      s->cycles -= s->at;
+      s->at = 0;
+      return value;
+   }
+   ptr = page->host + (address & PAGE_MASK);
+   s->cycles += page->wait;
+
+   switch(size) 
+   {
+      case 4: 
+         if(address & 3)
+            printf("Unaligned access PC=0x%x address=0x%x\n", (int)s->pc, (int)address);
+         assert((address & 3) == 0);
+         value = *(unsigned int*)ptr;
+         if(big) 
+            value = bswap32(value);
+         break;
+      case 2:
+         assert((address & 1) == 0);
+         value = *(unsigned short*)ptr;
+         if(big) 
+            value = bswap16((unsigned short)value);
+         break;
+      case 1:
+         value = *(unsigned char*)ptr;
+         break;
+      default: 
+         printf("ERROR");
+   }
+   return(value);
+}
+
+static inline void mem_write_endian(State *s, int size, unsigned int address, 
+                                    unsigned int value, int big)
+{
+   const Page *page = PAGE(s, address);
+   unsigned char *ptr;
+
+   if(page->host == NULL)
+   {
+      if(page->write)
+      {
+         s->cycles += s->at;
+         page->write(s, address, value, size);
+         s->cycles -= s->at;
+      }
+      s->at = 0;
+      return;
+   }
+   ptr = page->host + (address & PAGE_MASK);
+   s->cycles += page->wait;
+   if(page->write)
+      page->write(s, address, value, size);  //RAM shared by SoC cores: log it
+
+   switch(size) 
+   {
+      case 4: 
+         assert((address & 3) == 0);
+         if(big) 
+            value = bswap32(value);
+         *(unsigned int*)ptr = value;
+         break;
+      case 2:
+         assert((address & 1) == 0);
+         if(big) 
+            value = bswap16((unsigned short)value);
+         *(unsigned short*)ptr = (unsigned short)value; 
+         break;
+      case 1:
+         *(char*)ptr = (unsigned char)value; 
+         break;
+      default: 
+         printf("ERROR");
+   }
+}
+
+#ifndef SIMPLE_CACHE
+static int mem_read(State *s, int size, unsigned int address)
+{
+   if(s->big_endian)
+      return mem_read_endian(s, size, address, 1);
+   return mem_read_endian(s, size, address, 0);
+}
+
+static void mem_write(State *s, int size, int unsigned address, unsigned int value)
+{
+   if(s->big_endian)
+      mem_write_endian(s, size, address, value, 1);
+   else
+      mem_write_endian(s, size, address, value, 0);
+}
+#endif
+/************* End page-table memory map *************/
+
+/************* Device events and interrupts *************/
+/* Devices post timed events with plasma_post(); the engines only compare
+   s->cycles with s->nextEvent, the earliest of those events, the next
+   toggle of COUNTER_REG bit 18 and 0 while an enabled interrupt is
+   pending.  The interrupt line is (IRQ_STATUS & IRQ_MASK) != 0 as in
+   plasma.vhd; mlite_cpu.vhd takes it when CP0 status bit 0 is set and
+   the instruction is not in a delay slot. */
+
+//Run the events due by s->cycles and find the next clock to look again
+static void event_run(State *s)
+{
+   Event e;
+
+   while(s->eventCount && s->event[0].when <= s->cycles)
+   {
+      e = s->event[0];
+      memmove(s->event, s->event + 1, --s->eventCount * sizeof(Event));
+      if(e.handler)
+         e.handler(s, e.arg);
+   }
+   s->nextEvent = (s->cycles | ((1 << 18) - 1)) + 1;
+   if(s->eventCount && s->event[0].when < s->nextEvent)
+      s->nextEvent = s->event[0].when;
+   if((s->status & 1) && (irq_status(s) & IO_LATCH(s, IRQ_MASK)))
+      s->nextEvent = 0;
+}
+
+/* Once s->cycles reaches s->nextEvent, before the instruction at s->pc:
+   run the due events, then replace the instruction by the jump to
+   INTERRUPT_VECTOR like control.vhd does.  EPC
+   is its address + 4 (the handler backs up one opcode, see boot.asm),
+   writing EPC disables interrupts and the next instruction is nullified.
+   Returns 1 when the interrupt was taken */
+static int interrupt_check(State *s)
+{
+   event_run(s);
+   if(s->nextEvent || s->pc_next != s->pc + 4 || s->skip)
+      return 0;
+   s->epc = s->pc + 4;
+   s->pc = s->pc + 4;
+   s->pc_next = INTERRUPT_VECTOR;
+   s->skip = 1;
+   s->status = 0;
+   s->userMode = 0;
+   ++s->instructions;
+   ++s->cycles;
+   ++s->interrupts;
+   event_run(s);
+   return 1;
+}
+
+//A run that is stuck in a halt loop can still be woken by an interrupt
+static int interrupt_enabled(State *s)
+{
+   return (s->status & 1) && IO_LATCH(s, IRQ_MASK);
+}
+
+/* Call handler(s, arg) at clock when, or re-evaluate the interrupt line
+   then with a NULL handler.  Returns 0, or -1 when EVENTS are pending */
+int plasma_post(State *s, unsigned long long when, EventHandler handler, int arg)
+{
+   int index;
+
+   if(s->eventCount == EVENTS)
+      return -1;
+   for(index = s->eventCount; index && s->event[index - 1].when > when; --index)
+      s->event[index] = s->event[index - 1];
+   s->event[index].when = when;
+   s->event[index].handler = handler;
+   s->event[index].arg = arg;
+   ++s->eventCount;
+   if(when < s->nextEvent)
+      s->nextEvent = when;
+   return 0;
+}
+/************* End device events and interrupts *************/
+
+#ifdef ENABLE_CACHE
+/************* Optional MMU and cache implementation *************/
+/* TAG = VirtualAddress | ProcessId | WriteableBit */
+unsigned int mmu_lookup(State *s, unsigned int processId, 
+                         unsigned int address, int write)
+{
+   int i;
+   unsigned int compare, tag;
+
+   if(processId == 0 || s->userMode == 0)
+      return address;
+   //if(address < 0x30000000)
+   //   return address;
+   compare = (address & ~MMU_MASK) | (processId << 1);
+   for(i = 0; i < MMU_ENTRIES; ++i)
+   {
+      tag = s->mmuEntry[i].virtualAddress;
+      if((tag & ~1) == compare && (write == 0 || (tag & 1)))
+         return s->mmuEntry[i].physicalAddress | (address & MMU_MASK);
+   }
+   //printf("\nMMUTlbMiss 0x%x PC=0x%x w=%d pid=%d user=%d\n", 
+   //   address, s->pc, write, processId, s->userMode);
+   //printf("m");
+   s->exceptionId = 1;
+   s->faultAddr = address & ~MMU_MASK;
+   s->irqStatus |= IRQ_MMU;
+   return address;
+}
+
+
+//Cache geometry and the Cache struct are in plasmasim.h
+static void cache_init(State *s)
+{
+   int set, i;
+   for(set = 0; set < CACHE_SET_ASSOC; ++set)
+   {
+      for(i = 0; i < CACHE_SIZE/CACHE_LINE_SIZE; ++i)
+         s->cache.addr[set][i] = 0xffff0000;
+   }
+}
+
+/* Write-back cache memory tagged by virtual address and processId */
+/* TAG = virtualAddress | processId | dirtyBit */
+static int cache_load(State *s, unsigned int address, int write)
+{
+   int set, i, pid, miss, offsetAddr, offsetData, offsetMem;
+   unsigned int addrTagMatch, addrPrevMatch=0;
+   unsigned int addrPrev;
+   unsigned int addressPhysical, tag;
+
+   ++s->cache.count;
+   addrTagMatch = address & ~(CACHE_SIZE-1);
+   offsetAddr = (address & (CACHE_SIZE-1)) >> CACHE_LINE_SIZE_LN2;
+
+   /* Find match */
+   miss = 1;
+   for(set = 0; set < CACHE_SET_ASSOC; ++set)
+   {
+      addrPrevMatch = s->cache.addr[set][offsetAddr] & ~(CACHE_SIZE-1);
+      if(addrPrevMatch == addrTagMatch)
+      {
+         miss = 0;
+         break;
+      }
+   }
+
+   /* Cache miss? */
+   if(miss)
+   {
+      ++s->cache.miss;
+      set = s->cache.setNext;
+      s->cache.setNext = (s->cache.setNext + 1) & (CACHE_SET_ASSOC-1);
+   }
+   //else if(write || (address >> 28) != 0x1)
+   //{
+   //   tag = s->cache.addr[set][offsetAddr];
+   //   pid = (tag & (CACHE_SIZE-1)) >> 1; 
+   //   if(pid != s->processId)
+   //      miss = 1;
+   //}
+
+   if(miss)
+   {
+      offsetData = address & (CACHE_SIZE-1) & ~(CACHE_LINE_SIZE-1);
+
+      /* Cache line dirty? */
+      if(s->cache.addr[set][offsetAddr] & 1)
+      {
+         /* Write back cache line */
+         tag = s->cache.addr[set][offsetAddr];
+         addrPrev = tag & ~(CACHE_SIZE-1);
+         addrPrev |= address & (CACHE_SIZE-1);
+         pid = (tag & (CACHE_SIZE-1)) >> 1; 
+         addressPhysical = mmu_lookup(s, pid, addrPrev, 1);   //virtual->physical
+         if(s->exceptionId)
+            return 0;
+         offsetMem = addressPhysical & ~(CACHE_LINE_SIZE-1);
+         for(i = 0; i < CACHE_LINE_SIZE; i += 4)
+            mem_write(s, 4, offsetMem + i, s->cache.data[set][(offsetData + i) >> 2]);
+         ++s->cache.writeBack;
+      }
+
+      /* Read cache line */
+      addressPhysical = mmu_lookup(s, s->processId, address, write); //virtual->physical
+      if(s->exceptionId)
+         return 0;
+      offsetMem = addressPhysical & ~(CACHE_LINE_SIZE-1);
+      s->cache.addr[set][offsetAddr] = addrTagMatch;
+      for(i = 0; i < CACHE_LINE_SIZE; i += 4)
+         s->cache.data[set][(offsetData + i) >> 2] = mem_read(s, 4, offsetMem + i);
+   }
+   s->cache.addr[set][offsetAddr] |= write;
+   return set;
+}
+
+static int cache_read(State *s, int size, unsigned int address)
+{
+   int set, offset;
+   int value;
+
+   if((address & 0xfe000000) != 0x10000000)
+      return mem_read(s, size, address);
+
+   set = cache_load(s, address, 0);
+   if(s->exceptionId)
+      return 0;
+   offset = (address & (CACHE_SIZE-1)) >> 2;
+   value = s->cache.data[set][offset];
+   if(s->big_endian)
+      address ^= 3;
+   switch(size) 
+   {
+      case 2: 
+         value = (value >> ((address & 2) << 3)) & 0xffff;
+         break;
+      case 1:
+         value = (value >> ((address & 3) << 3)) & 0xff;
+         break;
+   }
+   return value;
+}
+
+static void cache_write(State *s, int size, int unsigned address, unsigned int value)
+{
+   int set, offset;
+   unsigned int mask;
+
+   if((address >> 28) != 0x1) // && (s->processId == 0 || s->userMode == 0))
+   {
+      mem_write(s, size, address, value);
+      return;
+   }
+
+   set = cache_load(s, address, 1);
+   if(s->exceptionId)
+      return;
+   offset = (address & (CACHE_SIZE-1)) >> 2;
+   if(s->big_endian)
+      address ^= 3;
+   switch(size) 
+   {
+      case 2:
+         value &= 0xffff;
+         value |= value << 16;
+         mask = 0xffff << ((address & 2) << 3);
+         break;
+      case 1:
+         value &= 0xff;
+         value |= (value << 8) | (value << 16) | (value << 24);
+         mask = 0xff << ((address & 3) << 3);
+         break;
+      case 4:
+      default:
+         mask = 0xffffffff;
+         break;
+   }
+   s->cache.data[set][offset] = (value & mask) | (s->cache.data[set][offset] & ~mask);
+}
+
+#define mem_read cache_read
+#define mem_write cache_write
+#define mem_read_endian(s, size, address, big) cache_read(s, size, address)
+#define mem_write_endian(s, size, address, value, big) cache_write(s, size, address, value)
+
+#elif !defined(SIMPLE_CACHE)
+static void cache_init(State *s) { (void)s; }
+#endif
+
+
+#ifdef SIMPLE_CACHE
+
+//Write through direct mapped 4KB cache, see Cache in plasmasim.h
+#define CACHE_MISS 0x1ff
+
+static void cache_init(State *s)
+{
+   int offset;
+
+   for(offset = 0; offset < 1024; ++offset)
+      s->cache.addr[offset] = CACHE_MISS;
+}
+
+static inline int cache_read_endian(State *s, int size, unsigned int address, int big)
+{
+   int offset;
+   unsigned int value, value2, address2=address;
+   unsigned long long cycles;
+
+   offset = address >> 20;
+   if(offset != 0x100 && offset != 0x101)
+      return mem_read_endian(s, size, address, big);
+
+   ++s->cache.tries;
+   offset = (address >> 2) & 0x3ff;
+   if(s->cache.addr[offset] != (address >> 12) || s->cache.addr[offset] == CACHE_MISS)
+   {
+      ++s->cache.miss;
+      s->cache.addr[offset] = address >> 12;
+      s->cache.data[offset] = mem_read_endian(s, 4, address & ~3, big);
+   }
+   value = s->cache.data[offset];
+   if(big)
+      address ^= 3;
+   switch(size) 
+   {
+      case 2: 
+         value = (value >> ((address & 2) << 3)) & 0xffff;
+         break;
+      case 1:
+         value = (value >> ((address & 3) << 3)) & 0xff;
+         break;
+   }
+
+   //Debug testing, not charged to the timing model
+   cycles = s->cycles;
+   value2 = mem_read_endian(s, size, address2, big);
+   s->cycles = cycles;
+   if(value != value2)
+      printf("miss match\n");
+   //if((s->cache.tries & 0xffff) == 0) printf("\n***cache(%d,%d)\n ", s->cache.miss, s->cache.tries);
+   return value;
+}
+
+static inline void cache_write_endian(State *s, int size, unsigned int address, 
+                                      unsigned int value, int big)
+{
+   int offset;
+
+   mem_write_endian(s, size, address, value, big);
+
+   offset = address >> 20;
+   if(offset != 0x100 && offset != 0x101)
+      return;
+
+   offset = (address >> 2) & 0x3ff;
+   if(size != 4)
+   {
+      s->cache.addr[offset] = CACHE_MISS;
+      return;
+   }
+   s->cache.addr[offset] = address >> 12;
+   s->cache.data[offset] = value;
+}
+
+static int cache_read(State *s, int size, unsigned int address)
+{
+   if(s->big_endian)
+      return cache_read_endian(s, size, address, 1);
+   return cache_read_endian(s, size, address, 0);
+}
+
+static void cache_write(State *s, int size, int unsigned address, unsigned int value)
+{
+   if(s->big_endian)
+      cache_write_endian(s, size, address, value, 1);
+   else
+      cache_write_endian(s, size, address, value, 0);
+}
+
+#define mem_read cache_read
+#define mem_write cache_write
+#define mem_read_endian cache_read_endian
+#define mem_write_endian cache_write_endian
+#endif  //SIMPLE_CACHE
+/************* End optional cache implementation *************/
+
+
+/************* Runtime cache model *************/
+/* Instruction and data caches of any geometry in front of external RAM,
+   for sizing a cache for mem_ctrl.vhd.  Only the tags are modelled: the
+   data stays in s->mem, so the model changes what a run costs, never
+   what it computes.  Internal RAM and devices are not cached.  With the
+   timing model a line fill or write-back costs the penalty instead of
+   the wait states per access; write-through stores still pay them.
+   Needs the cycle engine, which calls cache_fetch() for every
+   instruction; the data side hooks the load and store handlers. */
+
+#define CACHE_VALID  1
+#define CACHE_DIRTY  2
+
+static unsigned int cache_random(CacheSim *c)
+{
+   c->seed ^= c->seed << 13;
+   c->seed ^= c->seed >> 17;
+   c->seed ^= c->seed << 5;
+   return c->seed;
+}
+
+/* Returns 1 when the access fills a line.  *evicted gets the address of
+   a dirty line written back to make room, else 0.  Write-through caches
+   don't allocate on a store miss. */
+static int cache_lookup(CacheSim *c, unsigned int address, int write, unsigned int *evicted)
+{
+   unsigned int line = address & ~(c->line - 1);
+   int set = ((address >> c->lineShift) & (c->sets - 1)) * c->ways;
+   unsigned int *tag = &c->tag[set];
+   unsigned long long *used = &c->used[set];
+   int way, victim = 0, empty = -1;
+
+   ++c->access;
+   c->writes += write;
+   *evicted = 0;
+   for(way = 0; way < c->ways; ++way)
+   {
+      if((tag[way] & ~(CACHE_VALID | CACHE_DIRTY)) == line && (tag[way] & CACHE_VALID))
+      {
+         used[way] = ++c->clock;
+         if(write && c->writeBack)
+            tag[way] |= CACHE_DIRTY;
+         return 0;
+      }
+      if((tag[way] & CACHE_VALID) == 0 && empty < 0)
+         empty = way;
+      if(used[way] < used[victim])
+         victim = way;
+   }
+   if(write && c->writeBack == 0)
+      return 0;
+   ++c->miss;
+   if(empty >= 0)
+      victim = empty;
+   else if(c->replace == CACHE_RANDOM)
+      victim = cache_random(c) % c->ways;
+   if(tag[victim] & CACHE_DIRTY)
+   {
+      *evicted = tag[victim] & ~(CACHE_VALID | CACHE_DIRTY);
+      ++c->writeBacks;
+   }
+   tag[victim] = line | CACHE_VALID | (write ? CACHE_DIRTY : 0);
+   used[victim] = ++c->clock;
+   return 1;
+}
+
+//Clocks per fill or write-back: by default a burst of the line's words
+static int cache_penalty(const State *s, const CacheSim *c)
+{
+   return c->penalty >= 0 ? c->penalty : (c->line >> 2) * (s->waitExternal + 1);
+}
+
+static void cache_fetch(State *s, unsigned int pc)
+{
+   CacheCount *count;
+   unsigned int evicted;
+
+   s->cachePc = pc;
+   if(s->icache == NULL || (pc >> 20) != (RAM_EXTERNAL >> 20))
+      return;
+   count = &s->cacheByPc[mem_offset(pc) >> 2];
+   ++count->iAccess;
+   if(cache_lookup(s->icache, pc, 0, &evicted))
+   {
+      ++count->iMiss;
+      if(s->timing)
+         s->cycles += cache_penalty(s, s->icache);
+   }
+}
+
+//Charged to the instruction at s->cachePc and to the data word
+static void cache_data(State *s, unsigned int address, int write)
+{
+   CacheSim *c = s->dcache;
+   CacheCount *pc, *data;
+   unsigned int evicted;
+
+   if((address >> 20) != (RAM_EXTERNAL >> 20))
+      return;
+   pc = &s->cacheByPc[mem_offset(s->cachePc) >> 2];
+   data = &s->cacheByData[mem_offset(address) >> 2];
+   ++pc->dAccess;
+   ++data->dAccess;
+   if(cache_lookup(c, address, write, &evicted))
+   {
+      ++pc->dMiss;
+      ++data->dMiss;
+      if(s->timing)
+         s->cycles += cache_penalty(s, c);
+   }
+   if(evicted)
+   {
+      ++pc->writeBack;
+      ++s->cacheByData[mem_offset(evicted) >> 2].writeBack;
+      if(s->timing)
+         s->cycles += cache_penalty(s, c);
+   }
+   if(write && c->writeBack == 0 && s->timing)
+      s->cycles += s->waitExternal;
+}
+
+#define CACHE_DATA(s, address, write) if((s)->dcache) cache_data(s, address, write)
+
+static void cache_sim_free(CacheSim *c)
+{
+   if(c == NULL)
+      return;
+   free(c->tag);
+   free(c->used);
+   free(c);
+}
+
+//A model with the geometry of g and cold lines; 0 or -1 out of memory
+static int cache_attach(State *s, int data, const CacheSim *g)
+{
+   CacheSim *c = (CacheSim*)calloc(1, sizeof(CacheSim));
+   int lines = g->size / g->line;
+
+   if(c == NULL)
+      return -1;
+   c->size = g->size;
+   c->line = g->line;
+   c->ways = g->ways;
+   c->replace = g->replace;
+   c->writeBack = g->writeBack;
+   c->penalty = g->penalty;
+   c->sets = lines / g->ways;
+   for(c->lineShift = 0; (1 << c->lineShift) < c->line; ++c->lineShift)
+      ;
+   c->seed = 0x2545f491;
+   c->tag = (unsigned int*)calloc(lines, sizeof(unsigned int));
+   c->used = (unsigned long long*)calloc(lines, sizeof(unsigned long long));
+   if(s->cacheByPc == NULL)
+   {
+      s->cacheByPc = (CacheCount*)calloc(MEM_SIZE / 4, sizeof(CacheCount));
+      s->cacheByData = (CacheCount*)calloc(MEM_SIZE / 4, sizeof(CacheCount));
+   }
+   if(c->tag == NULL || c->used == NULL || s->cacheByPc == NULL || s->cacheByData == NULL)
+   {
+      cache_sim_free(c);
+      return -1;
+   }
+   if(data)
+   {
+      cache_sim_free(s->dcache);
+      s->dcache = c;
+   }
+   else
+   {
+      cache_sim_free(s->icache);
+      s->icache = c;
+   }
+   return 0;
+}
+
+static void cache_free(State *s)
+{
+   cache_sim_free(s->icache);
+   cache_sim_free(s->dcache);
+   free(s->cacheByPc);
+   free(s->cacheByData);
+}
+/************* End runtime cache model *************/
+
+
+void mult_big(unsigned int a, 
+              unsigned int b,
+              unsigned int *hi, 
+              unsigned int *lo)
+{
+   unsigned int ahi, alo, bhi, blo;
+   unsigned int c0, c1, c2;
+   unsigned int c1_a, c1_b;
+
+   ahi = a >> 16;
+   alo = a & 0xffff;
+   bhi = b >> 16;
+   blo = b & 0xffff;
+
+   c0 = alo * blo;
+   c1_a = ahi * blo;
+   c1_b = alo * bhi;
+   c2 = ahi * bhi;
+
+   c2 += (c1_a >> 16) + (c1_b >> 16);
+   c1 = (c1_a & 0xffff) + (c1_b & 0xffff) + (c0 >> 16);
+   c2 += (c1 >> 16);
+   c0 = (c1 << 16) + (c0 & 0xffff);
+   *hi = c2;
+   *lo = c0;
+}
+
+void mult_big_signed(int a, 
+                     int b,
+                     unsigned int *hi, 
+                     unsigned int *lo)
+{
+   unsigned int ahi, alo, bhi, blo;
+   unsigned int c0, c1, c2;
+   int c1_a, c1_b;
+
+   ahi = a >> 16;
+   alo = a & 0xffff;
+   bhi = b >> 16;
+   blo = b & 0xffff;
+
+   c0 = alo * blo;
+   c1_a = ahi * blo;
+   c1_b = alo * bhi;
+   c2 = ahi * bhi;
+
+   c2 += (c1_a >> 16) + (c1_b >> 16);
+   c1 = (c1_a & 0xffff) + (c1_b & 0xffff) + (c0 >> 16);
+   c2 += (c1 >> 16);
+   c0 = (c1 << 16) + (c0 & 0xffff);
+   *hi = c2;
+   *lo = c0;
+}
+
+//Clocks before MFHI/MFLO can read a MULT/MULTU result, as in mult.vhd:
+//one bit of b per clock, four at a time over zero nibbles
+static int mult_cycles(int a, int b, int isSigned)
+{
+   unsigned int bb = b;
+   int count = 32, sign = 0, sign2 = 0, clocks = 0;
+
+   if(isSigned)
+   {
+      sign = (a ^ b) < 0;
+      if(b < 0)
+         bb = -b;
+   }
+   while(count > 0)
+   {
+      if(bb & 1)
+      {
+         sign2 |= sign;
+         sign = 0;
+         bb >>= 1;
+         --count;
+      }
+      else if((bb & 15) == 0 && sign2 == 0 && count >= 4)
+      {
+         bb >>= 4;
+         count -= 4;
+      }
+      else
+      {
+         bb >>= 1;
+         --count;
+      }
+      ++clocks;
+   }
+   return clocks;
+}
+
+#define DIV_CYCLES 32
+
+/************* Predecoded instruction cache *************/
+/* Each word of s->mem is decoded once into a Decoded record holding the
+   handler and the pre-extracted operands.  Stores into a page that holds
+   decoded entries invalidate the word written. */
+
+typedef int (*OpHandler)(State *s, const Decoded *d);
+
+struct Decoded_s {
+   OpHandler handler;            //NULL when not decoded yet
+   unsigned int opcode;
+   unsigned char rs, rt, rd, re;
+   unsigned char flags;          //OPF_*
+   unsigned char cost;           //clocks in the timing model, see decode()
+   short at;                     //in a block: clocks charged after this one, negated
+   int imm;                      //extended immediate, branch offset or target
+};
+
+#define OPF_BRANCH    1          //branch or jump followed by a delay slot
+#define OPF_SLOW      2          //exception or error: only run by cycle()
+#define OPF_IN_BLOCK  4          //copied into a basic block
+
+//Handler results
+#define BRANCH_TAKEN        1    //pc_next += imm
+#define BRANCH_LIKELY_SKIP  2    //branch likely not taken: skip delay slot
+#define EXCEPTION_SYSCALL   4    //SYSCALL/BREAK: epc |= 1
+
+//Stores into a page holding decoded code drop the stale entry
+static void code_invalidate(State *s, unsigned int address)
+{
+   unsigned int offset = mem_offset(address);
+   Decoded *d;
+
+   if((address >> 20) != (RAM_INTERNAL >> 20) && (address >> 20) != (RAM_EXTERNAL >> 20))
+      return;                                     //device or unmapped
+   if(s->codePage[offset >> 12])
+   {
+      d = &s->decoded[offset >> 2];
+      if(d->flags & OPF_IN_BLOCK)
+         s->blockStale = 1;
+      d->handler = NULL;
+      d->flags = 0;
+   }
+}
+
+/* Timing model: MFHI/MFLO pause until the mult/div unit is done.  The
+   current clock is s->cycles + d->at, as blocks charge all their clocks
+   before running */
+static void mult_wait(State *s, const Decoded *d)
+{
+   unsigned long long now = s->cycles + d->at;
+
+   if(now < s->multDone)
+      s->cycles += s->multDone - now;
+}
+
+#define OP_HANDLER(name, body) \
+   static int name(State *s, const Decoded *d) \
+   { int *r=s->r; unsigned int *u=(unsigned int*)s->r; (void)r; (void)u; body; return 0; }
+
+/*SPECIAL*/
+OP_HANDLER(op_sll,   r[d->rd]=r[d->rt]<<d->re)
+OP_HANDLER(op_srl,   r[d->rd]=u[d->rt]>>d->re)
+OP_HANDLER(op_sra,   r[d->rd]=r[d->rt]>>d->re)
+OP_HANDLER(op_sllv,  r[d->rd]=r[d->rt]<<(r[d->rs]&31))
+OP_HANDLER(op_srlv,  r[d->rd]=u[d->rt]>>(r[d->rs]&31))
+OP_HANDLER(op_srav,  r[d->rd]=r[d->rt]>>(r[d->rs]&31))
+OP_HANDLER(op_jr,    s->pc_next=r[d->rs])
+OP_HANDLER(op_jalr,  r[d->rd]=s->pc_next; s->pc_next=r[d->rs])
+OP_HANDLER(op_movz,  if(!r[d->rt]) r[d->rd]=r[d->rs])
+OP_HANDLER(op_movn,  if(r[d->rt]) r[d->rd]=r[d->rs])
+OP_HANDLER(op_syscall, s->exceptionId=1; return EXCEPTION_SYSCALL)
+OP_HANDLER(op_break,
+   if(s->batch) { s->stopReason=STOP_BREAK; s->wakeup=1; return 0; }
+   s->exceptionId=1; return EXCEPTION_SYSCALL)
+OP_HANDLER(op_sync,  s->wakeup=1)
+OP_HANDLER(op_mfhi,  mult_wait(s, d); r[d->rd]=s->hi)
+OP_HANDLER(op_mthi,  s->hi=r[d->rs])
+OP_HANDLER(op_mflo,  mult_wait(s, d); r[d->rd]=s->lo)
+OP_HANDLER(op_mtlo,  s->lo=r[d->rs])
+OP_HANDLER(op_mult,  if(s->timing) s->multDone=s->cycles+d->at+mult_cycles(r[d->rs],r[d->rt],1);
+   mult_big_signed(r[d->rs],r[d->rt],&s->hi,&s->lo))
+OP_HANDLER(op_multu, if(s->timing) s->multDone=s->cycles+d->at+mult_cycles(r[d->rs],r[d->rt],0);
+   mult_big(r[d->rs],r[d->rt],&s->hi,&s->lo))
+OP_HANDLER(op_div,
+   if(s->timing) s->multDone=s->cycles+d->at+DIV_CYCLES;
+   if(r[d->rt] == 0) { s->lo=0; s->hi=r[d->rs]; }           //as mult.vhd
+   else if(r[d->rt] == -1) { s->lo=-u[d->rs]; s->hi=0; }
+   else { s->lo=r[d->rs]/r[d->rt]; s->hi=r[d->rs]%r[d->rt]; })
+OP_HANDLER(op_divu,
+   if(s->timing) s->multDone=s->cycles+d->at+DIV_CYCLES;
+   if(u[d->rt] == 0) { s->lo=0; s->hi=u[d->rs]; }
+   else { s->lo=u[d->rs]/u[d->rt]; s->hi=u[d->rs]%u[d->rt]; })
+OP_HANDLER(op_add,   r[d->rd]=r[d->rs]+r[d->rt])
+OP_HANDLER(op_sub,   r[d->rd]=r[d->rs]-r[d->rt])
+OP_HANDLER(op_and,   r[d->rd]=r[d->rs]&r[d->rt])
+OP_HANDLER(op_or,    r[d->rd]=r[d->rs]|r[d->rt])
+OP_HANDLER(op_xor,   r[d->rd]=r[d->rs]^r[d->rt])
+OP_HANDLER(op_nor,   r[d->rd]=~(r[d->rs]|r[d->rt]))
+OP_HANDLER(op_slt,   r[d->rd]=r[d->rs]<r[d->rt])
+OP_HANDLER(op_sltu,  r[d->rd]=u[d->rs]<u[d->rt])
+OP_HANDLER(op_nop,   )
+OP_HANDLER(op_custom, r[d->rd]=s->custom[d->imm](s,u[d->rs],u[d->rt]))
+OP_HANDLER(op_error0, printf("ERROR0(*0x%x~0x%x)\n", s->pc, d->opcode); s->wakeup=1;
+   if(s->batch) s->stopReason=STOP_ERROR)
+
+/*REGIMM*/
+OP_HANDLER(op_bltz,   if(r[d->rs]<0) return BRANCH_TAKEN)
+OP_HANDLER(op_bgez,   if(r[d->rs]>=0) return BRANCH_TAKEN)
+OP_HANDLER(op_bltzal, r[31]=s->pc_next; if(r[d->rs]<0) return BRANCH_TAKEN)
+OP_HANDLER(op_bgezal, r[31]=s->pc_next; if(r[d->rs]>=0) return BRANCH_TAKEN)
+OP_HANDLER(op_bltzl,  return r[d->rs]<0 ? BRANCH_TAKEN : BRANCH_LIKELY_SKIP)
+OP_HANDLER(op_bgezl,  return r[d->rs]>=0 ? BRANCH_TAKEN : BRANCH_LIKELY_SKIP)
+OP_HANDLER(op_bltzall, r[31]=s->pc_next;
+   return r[d->rs]<0 ? BRANCH_TAKEN : BRANCH_LIKELY_SKIP)
+OP_HANDLER(op_bgezall, r[31]=s->pc_next;
+   return r[d->rs]>=0 ? BRANCH_TAKEN : BRANCH_LIKELY_SKIP)
+OP_HANDLER(op_error1, printf("ERROR1\n"); s->wakeup=1;
+   if(s->batch) s->stopReason=STOP_ERROR)
+
+/*Main opcodes*/
+OP_HANDLER(op_j,     s->pc_next=(s->pc&0xf0000000)|d->imm)
+OP_HANDLER(op_jal,   r[31]=s->pc_next; s->pc_next=(s->pc&0xf0000000)|d->imm)
+OP_HANDLER(op_beq,   if(r[d->rs]==r[d->rt]) return BRANCH_TAKEN)
+OP_HANDLER(op_bne,   if(r[d->rs]!=r[d->rt]) return BRANCH_TAKEN)
+OP_HANDLER(op_blez,  if(r[d->rs]<=0) return BRANCH_TAKEN)
+OP_HANDLER(op_bgtz,  if(r[d->rs]>0) return BRANCH_TAKEN)
+OP_HANDLER(op_addi,  r[d->rt]=r[d->rs]+d->imm)
+OP_HANDLER(op_slti,  r[d->rt]=r[d->rs]<d->imm)
+OP_HANDLER(op_sltiu, u[d->rt]=u[d->rs]<(unsigned int)d->imm)
+OP_HANDLER(op_andi,  r[d->rt]=r[d->rs]&d->imm)
+OP_HANDLER(op_ori,   r[d->rt]=r[d->rs]|d->imm)
+OP_HANDLER(op_xori,  r[d->rt]=r[d->rs]^d->imm)
+OP_HANDLER(op_lui,   r[d->rt]=d->imm)
+OP_HANDLER(op_cop0,
+   if((d->opcode & (1<<23)) == 0)  //move from CP0
+   {
+      if(d->rd == 12)
+         r[d->rt]=s->status;
+      else
+         r[d->rt]=s->epc;
+   }
+   else                            //move to CP0
+   {
+      s->status=r[d->rt]&1;
+      if(s->processId && (r[d->rt]&2))
+         s->userMode|=r[d->rt]&2;
+      s->nextEvent=0;                 //interrupts may be enabled now
+   })
+OP_HANDLER(op_beql,  return r[d->rs]==r[d->rt] ? BRANCH_TAKEN : BRANCH_LIKELY_SKIP)
+OP_HANDLER(op_bnel,  return r[d->rs]!=r[d->rt] ? BRANCH_TAKEN : BRANCH_LIKELY_SKIP)
+OP_HANDLER(op_blezl, return r[d->rs]<=0 ? BRANCH_TAKEN : BRANCH_LIKELY_SKIP)
+OP_HANDLER(op_bgtzl, return r[d->rs]>0 ? BRANCH_TAKEN : BRANCH_LIKELY_SKIP)
+
+/*Loads and stores, one instance per byte order: E names it, BIG is constant.
+  s->at gives devices the clock of the instruction, see mem_read_endian()*/
+#define OP_MEMORY(E, BIG) \
+OP_HANDLER(op_lb_##E,  s->at=d->at; CACHE_DATA(s,r[d->rs]+d->imm,0); \
+   r[d->rt]=(signed char)mem_read_endian(s,1,r[d->rs]+d->imm,BIG)) \
+OP_HANDLER(op_lh_##E,  s->at=d->at; CACHE_DATA(s,r[d->rs]+d->imm,0); \
+   r[d->rt]=(signed short)mem_read_endian(s,2,r[d->rs]+d->imm,BIG)) \
+OP_HANDLER(op_lw_##E,  s->at=d->at; CACHE_DATA(s,r[d->rs]+d->imm,0); \
+   r[d->rt]=mem_read_endian(s,4,r[d->rs]+d->imm,BIG)) \
+OP_HANDLER(op_lbu_##E, s->at=d->at; CACHE_DATA(s,r[d->rs]+d->imm,0); \
+   r[d->rt]=(unsigned char)mem_read_endian(s,1,r[d->rs]+d->imm,BIG)) \
+OP_HANDLER(op_lhu_##E, s->at=d->at; CACHE_DATA(s,r[d->rs]+d->imm,0); \
+   r[d->rt]=(unsigned short)mem_read_endian(s,2,r[d->rs]+d->imm,BIG)) \
+OP_HANDLER(op_sb_##E,  s->at=d->at; CACHE_DATA(s,r[d->rs]+d->imm,1); \
+   mem_write_endian(s,1,r[d->rs]+d->imm,r[d->rt],BIG); \
+   code_invalidate(s,r[d->rs]+d->imm)) \
+OP_HANDLER(op_sh_##E,  s->at=d->at; CACHE_DATA(s,r[d->rs]+d->imm,1); \
+   mem_write_endian(s,2,r[d->rs]+d->imm,r[d->rt],BIG); \
+   code_invalidate(s,r[d->rs]+d->imm)) \
+OP_HANDLER(op_sw_##E,  s->at=d->at; CACHE_DATA(s,r[d->rs]+d->imm,1); \
+   mem_write_endian(s,4,r[d->rs]+d->imm,r[d->rt],BIG); \
+   code_invalidate(s,r[d->rs]+d->imm)) \
+OP_HANDLER(op_sc_##E,  s->at=d->at; CACHE_DATA(s,r[d->rs]+d->imm,1); \
+   mem_write_endian(s,4,r[d->rs]+d->imm,r[d->rt],BIG); \
+   code_invalidate(s,r[d->rs]+d->imm); r[d->rt]=1)
+
+OP_MEMORY(le, 0)
+OP_MEMORY(be, 1)
+
+typedef struct {
+   OpHandler lb, lh, lw, lbu, lhu, sb, sh, sw, sc;
+} MemoryOps;
+
+//Indexed by s->big_endian
+static const MemoryOps memoryOps[2] = {
+   {op_lb_le, op_lh_le, op_lw_le, op_lbu_le, op_lhu_le, op_sb_le, op_sh_le, op_sw_le, op_sc_le},
+   {op_lb_be, op_lh_be, op_lw_be, op_lbu_be, op_lhu_be, op_sb_be, op_sh_be, op_sw_be, op_sc_be}
+};
+
+OP_HANDLER(op_error2, printf("ERROR2 address=0x%x opcode=0x%x\n", s->pc, d->opcode);
+   s->wakeup=1; if(s->batch) s->stopReason=STOP_ERROR)
+
+static OpHandler decode_special(unsigned int func)
+{
+   switch(func)
+   {
+      case 0x00:/*SLL*/  return op_sll;
+      case 0x02:/*SRL*/  return op_srl;
+      case 0x03:/*SRA*/  return op_sra;
+      case 0x04:/*SLLV*/ return op_sllv;
+      case 0x06:/*SRLV*/ return op_srlv;
+      case 0x07:/*SRAV*/ return op_srav;
+      case 0x08:/*JR*/   return op_jr;
+      case 0x09:/*JALR*/ return op_jalr;
+      case 0x0a:/*MOVZ*/ return op_movz;
+      case 0x0b:/*MOVN*/ return op_movn;
+      case 0x0c:/*SYSCALL*/ return op_syscall;
+      case 0x0d:/*BREAK*/   return op_break;
+      case 0x0f:/*SYNC*/ return op_sync;
+      case 0x10:/*MFHI*/ return op_mfhi;
+      case 0x11:/*MTHI*/ return op_mthi;
+      case 0x12:/*MFLO*/ return op_mflo;
+      case 0x13:/*MTLO*/ return op_mtlo;
+      case 0x18:/*MULT*/ return op_mult;
+      case 0x19:/*MULTU*/ return op_multu;
+      case 0x1a:/*DIV*/  return op_div;
+      case 0x1b:/*DIVU*/ return op_divu;
+      case 0x20:/*ADD*/  return op_add;
+      case 0x21:/*ADDU*/ return op_add;
+      case 0x22:/*SUB*/  return op_sub;
+      case 0x23:/*SUBU*/ return op_sub;
+      case 0x24:/*AND*/  return op_and;
+      case 0x25:/*OR*/   return op_or;
+      case 0x26:/*XOR*/  return op_xor;
+      case 0x27:/*NOR*/  return op_nor;
+      case 0x2a:/*SLT*/  return op_slt;
+      case 0x2b:/*SLTU*/ return op_sltu;
+      case 0x2d:/*DADDU*/return op_add;
+      case 0x31:/*TGEU*/ 
+      case 0x32:/*TLT*/
+      case 0x33:/*TLTU*/
+      case 0x34:/*TEQ*/
+      case 0x36:/*TNE*/  return op_nop;
+   }
+   return op_error0;
+}
+
+static OpHandler decode_regimm(unsigned int rt)
+{
+   switch(rt)
+   {
+      case 0x00:/*BLTZ*/   return op_bltz;
+      case 0x01:/*BGEZ*/   return op_bgez;
+      case 0x02:/*BLTZL*/  return op_bltzl;
+      case 0x03:/*BGEZL*/  return op_bgezl;
+      case 0x10:/*BLTZAL*/ return op_bltzal;
+      case 0x11:/*BGEZAL*/ return op_bgezal;
+      case 0x12:/*BLTZALL*/return op_bltzall;
+      case 0x13:/*BGEZALL*/return op_bgezall;
+   }
+   return op_error1;
+}
+
+static void decode(Decoded *d, unsigned int opcode, int big)
+{
+   const MemoryOps *m = &memoryOps[big != 0];
+   unsigned int op = (opcode >> 26) & 0x3f;
+   unsigned int imm = opcode & 0xffff;
+
+   d->opcode = opcode;
+   d->rs = (opcode >> 21) & 0x1f;
+   d->rt = (opcode >> 16) & 0x1f;
+   d->rd = (opcode >> 11) & 0x1f;
+   d->re = (opcode >> 6) & 0x1f;
+   d->imm = (short)imm;
+   switch(op)
+   {
+      case 0x00:/*SPECIAL*/ d->handler = decode_special(opcode & 0x3f); break;
+      case 0x01:/*REGIMM*/  d->handler = decode_regimm(d->rt);         break;
+      case 0x02:/*J*/       d->handler = op_j;   break;
+      case 0x03:/*JAL*/     d->handler = op_jal; break;
+      case 0x04:/*BEQ*/     d->handler = op_beq;  break;
+      case 0x05:/*BNE*/     d->handler = op_bne;  break;
+      case 0x06:/*BLEZ*/    d->handler = op_blez; break;
+      case 0x07:/*BGTZ*/    d->handler = op_bgtz; break;
+      case 0x08:/*ADDI*/    d->handler = op_addi; break;
+      case 0x09:/*ADDIU*/   d->handler = op_addi; break;
+      case 0x0a:/*SLTI*/    d->handler = op_slti; break;
+      case 0x0b:/*SLTIU*/   d->handler = op_sltiu; break;
+      case 0x0c:/*ANDI*/    d->handler = op_andi; break;
+      case 0x0d:/*ORI*/     d->handler = op_ori;  break;
+      case 0x0e:/*XORI*/    d->handler = op_xori; break;
+      case 0x0f:/*LUI*/     d->handler = op_lui;  break;
+      case 0x10:/*COP0*/    d->handler = op_cop0; break;
+      case 0x14:/*BEQL*/    d->handler = op_beql;  break;
+      case 0x15:/*BNEL*/    d->handler = op_bnel;  break;
+      case 0x16:/*BLEZL*/   d->handler = op_blezl; break;
+      case 0x17:/*BGTZL*/   d->handler = op_bgtzl; break;
+      case 0x20:/*LB*/      d->handler = m->lb;  break;
+      case 0x21:/*LH*/      d->handler = m->lh;  break;
+      case 0x22:/*LWL*/     d->handler = m->lw;  break;
+      case 0x23:/*LW*/      d->handler = m->lw;  break;
+      case 0x24:/*LBU*/     d->handler = m->lbu; break;
+      case 0x25:/*LHU*/     d->handler = m->lhu; break;
+      case 0x26:/*LWR*/     d->handler = op_nop; break;
+      case 0x28:/*SB*/      d->handler = m->sb;  break;
+      case 0x29:/*SH*/      d->handler = m->sh;  break;
+      case 0x2a:/*SWL*/     d->handler = m->sw;  break;
+      case 0x2b:/*SW*/      d->handler = m->sw;  break;
+      case 0x2e:/*SWR*/     d->handler = op_nop; break; //fixme
+      case 0x2f:/*CACHE*/   d->handler = op_nop; break;
+      case 0x30:/*LL*/      d->handler = m->lw;  break;
+      case 0x38:/*SC*/      d->handler = m->sc;  break;
+      default:              d->handler = op_error2;
+   }
+
+   d->flags = 0;
+   if(d->handler == op_syscall || d->handler == op_break || d->handler == op_error0 ||
+      d->handler == op_error1 || d->handler == op_error2)
+      d->flags = OPF_SLOW;
+   else if(op == 0x01 || (op >= 0x02 && op <= 0x07) || (op >= 0x14 && op <= 0x17) ||
+           d->handler == op_jr || d->handler == op_jalr)
+      d->flags = OPF_BRANCH;
+
+   /* Clocks with the three stage pipeline of mlite_cpu.vhd: branches other
+      than J/JAL, loads/stores and MFHI/MFLO pause the pipeline once
+      (pipeline.vhd) and loads/stores wait one more clock in mem_ctrl.vhd */
+   d->at = 0;
+   d->cost = 1;
+   if((d->flags & OPF_BRANCH) && op != 0x02 && op != 0x03)
+      d->cost = 2;
+   else if((op >= 0x20 && op <= 0x2e) || op == 0x30 || op == 0x38)
+      d->cost = 3;
+   else if(d->handler == op_mfhi || d->handler == op_mflo)
+      d->cost = 2;
+
+   //Pre-shift the operands the handlers would otherwise recompute
+   if(op == 0x02 || op == 0x03)
+      d->imm = (opcode << 6) >> 4;                 //jump target
+   else if((op >= 0x04 && op <= 0x07) || (op >= 0x14 && op <= 0x17) || op == 0x01)
+      d->imm = (((int)(short)imm) << 2) - 4;       //branch offset
+   else if(op >= 0x0c && op <= 0x0e)
+      d->imm = imm;                                //zero extended
+   else if(op == 0x0f)
+      d->imm = imm << 16;
+}
+
+//SPECIAL functs of custom.alu1..19, see comb_alu_1.vhd; 0 is unused
+static const unsigned char customFunct[CUSTOM_OPS + 1] = {0,
+   0x01, 0x05, 0x0a, 0x1e, 0x1f, 0x29, 0x2c, 0x2e, 0x2f, 0x30,
+   0x35, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e};
+
+//A bound C model replaces what decode() made of the funct (MOVZ for 0x0a)
+static void custom_decode(State *s, Decoded *d)
+{
+   int index;
+
+   for(index = 1; index <= CUSTOM_OPS; ++index)
+   {
+      if((d->opcode & 0x3f) == customFunct[index] && s->custom[index])
+      {
+         d->handler = op_custom;
+         d->flags = 0;
+         d->cost = s->customCost[index];
+         d->imm = index;
+         return;
+      }
+   }
+}
+
+static const Decoded *fetch_decoded(State *s, unsigned int address)
+{
+   unsigned int offset = mem_offset(address);
+   Decoded *d = &s->decoded[offset >> 2];
+   unsigned long long cycles = s->cycles;
+
+   if(d->handler == NULL)
+   {
+      decode(d, mem_read(s, 4, address), s->big_endian);
+      if(s->customCount && (d->opcode >> 26) == 0)
+         custom_decode(s, d);
+      s->cycles = cycles;          //fetch wait states are not modelled
+      s->codePage[offset >> 12] = 1;
+   }
+   return d;
+}
+
+//Register-only ALU operation or nop: no load, store, device access or HI/LO
+static int is_pure_op(const Decoded *d)
+{
+   OpHandler h = d->handler;
+
+   return h == op_nop || h == op_sll || h == op_srl || h == op_sra || h == op_sllv ||
+          h == op_srlv || h == op_srav || h == op_add || h == op_sub || h == op_and ||
+          h == op_or || h == op_xor || h == op_nor || h == op_slt || h == op_sltu ||
+          h == op_addi || h == op_slti || h == op_sltiu || h == op_andi || h == op_ori ||
+          h == op_xori || h == op_lui;
+}
+
+/* J or B to itself with a delay slot without side effects, as after
+   main() returns: uboot.asm ends with "$L1: j $L1" and the first opcode
+   of the next function in the slot */
+static int is_halt_loop(State *s, unsigned int pc)
+{
+   const Decoded *d = fetch_decoded(s, pc);
+
+   if(d->handler == op_j && (((pc + 4) & 0xf0000000) | d->imm) != pc)
+      return 0;
+   if(d->handler == op_beq && (d->rs != d->rt || pc + 8 + d->imm != pc))
+      return 0;
+   if(d->handler != op_j && d->handler != op_beq)
+      return 0;
+   return is_pure_op(fetch_decoded(s, pc + 4));
+}
+
+static void predecode_init(State *s)
+{
+   s->decoded = (Decoded*)calloc(MEM_SIZE / 4, sizeof(Decoded));
+   memset(s->codePage, 0, sizeof(s->codePage));
+}
+/************* End predecoded instruction cache *************/
+
+static void profile_add(State *s, unsigned int pc, unsigned long long count,
+                        unsigned long long cycles)
+{
+   ProfileCount *p = &s->profile[mem_offset(pc) >> 2];
+
+   p->count += count;
+   p->cycles += cycles;
+}
+
+/************* Binary execution trace *************/
+/* -T file records every instruction run by cycle() in a compact binary
+   form; -r first renders it back in the text format of show_mode 1.
+
+   The file is a header, a sequence of compressed blocks and an index of
+   (first instruction, file offset) per block followed by a footer, so
+   the reader seeks straight to the block holding an instruction.  Each
+   raw block starts with a sync record (instruction number, pc, r1-r31,
+   hi, lo) and is decodable on its own.  An instruction record is a tag
+   byte followed by the fields it announces:
+      TRACE_PC_JUMP    pc - (previous pc + 4) in words, zigzag varint
+      TRACE_OPCODE     the opcode, when pc is not in the block's opcode table
+      TRACE_MEMORY     access flags, address - previous address as a
+                       zigzag varint, value as a varint
+      TRACE_REGS       count of register write-backs, each a register
+                       number (32=hi, 33=lo) and new - old as a zigzag varint
+   Blocks pass from the CPU to a writer thread through a ring, which
+   compresses them with a small LZ77 coder. */
+
+#define TRACE_MAGIC      "PLASMTRC"
+#define TRACE_VERSION    1
+#define TRACE_BLOCK      (64 * 1024)   //raw bytes per block
+#define TRACE_RING       8             //blocks queued for the writer
+#define TRACE_RECORD_MAX 64            //longest instruction record
+#define TRACE_SYNC_SIZE  (8 + 4 + 33 * 4)
+#define TRACE_OPCODES    1024          //opcode table entries, power of 2
+#define TRACE_HASH       4096          //LZ77 match table, power of 2
+
+#define TRACE_PC_JUMP    0x01
+#define TRACE_NULLIFIED  0x02          //delay slot of a likely branch not taken
+#define TRACE_OPCODE     0x04
+#define TRACE_MEMORY     0x08
+#define TRACE_REGS       0x70          //count of register write-backs
+#define TRACE_REGS_SHIFT 4
+
+#define TRACE_STORE      0x08          //access flags: low bits hold the size
+#define TRACE_MMIO       0x10
+
+typedef struct
+{
+   unsigned char raw[TRACE_BLOCK];
+   int used;
+   unsigned long long first;           //instruction number of the sync record
+} TraceBlock;
+
+typedef struct
+{
+   unsigned int pc;
+   unsigned int opcode;
+} TraceOpcode;
+
+struct Trace_s {
+   FILE *out;
+   TraceBlock ring[TRACE_RING];
+   int head, tail;                     //block filled by the CPU, next to write
+   int done;
+#ifndef WIN32
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t ready, space;
+#endif
+   unsigned char *packed;              //writer: compressed block
+   unsigned long long *index;          //writer: first instruction, offset
+   int indexCount;
+   unsigned long long bytes;           //raw bytes traced
+
+   //Encoder state, reset by each sync record
+   unsigned int pc;                    //previous pc
+   unsigned int memAddress;
+   TraceOpcode opcodes[TRACE_OPCODES];
+
+   //Instruction in flight between trace_before() and trace_after()
+   unsigned int old[3], hi, lo;
+   unsigned char regs[3];
+   int regCount;
+   unsigned int address, value, flags;
+};
+
+static void trace_put32(unsigned char *p, unsigned int value)
+{
+   p[0] = (unsigned char)value;
+   p[1] = (unsigned char)(value >> 8);
+   p[2] = (unsigned char)(value >> 16);
+   p[3] = (unsigned char)(value >> 24);
+}
+
+static unsigned int trace_get32(const unsigned char *p)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned char *trace_varint(unsigned char *p, unsigned int value)
+{
+   while(value >= 0x80)
+   {
+      *p++ = (unsigned char)(value | 0x80);
+      value >>= 7;
+   }
+   *p++ = (unsigned char)value;
+   return p;
+}
+
+#define ZIGZAG(v)   (((unsigned int)(v) << 1) ^ (unsigned int)((int)(v) >> 31))
+#define UNZIGZAG(v) ((int)((v) >> 1) ^ -(int)((v) & 1))
+
+//LZ77 in the LZ4 layout: token (literal count, match length - 4),
+//literals, 16-bit offset; 15 in a nibble continues in 255-run bytes
+static unsigned char *lz_length(unsigned char *op, int length)
+{
+   for(; length >= 255; length -= 255)
+      *op++ = 255;
+   *op++ = (unsigned char)length;
+   return op;
+}
+
+static int lz_compress(const unsigned char *in, int size, unsigned char *out)
+{
+   int table[TRACE_HASH];
+   const unsigned char *ip = in, *anchor = in, *end = in + size, *ref;
+   unsigned char *op = out, *token;
+   unsigned int word, match, hash;
+   int literals, length, candidate, misses = 0;
+
+   memset(table, 0, sizeof(table));
+   while(ip + 8 <= end)
+   {
+      memcpy(&word, ip, 4);
+      hash = (word * 2654435761u) >> (32 - 12);
+      candidate = table[hash] - 1;
+      table[hash] = (int)(ip - in) + 1;
+      ref = in + candidate;
+      if(candidate >= 0)
+         memcpy(&match, ref, 4);
+      if(candidate < 0 || ip - ref > 0xffff || match != word)
+      {
+         ip += 1 + (misses++ >> 4);  //skip faster through data that does not match
+         continue;
+      }
+      misses = 0;
+      for(length = 4; ip + length < end && ref[length] == ip[length]; ++length)
+         ;
+      literals = (int)(ip - anchor);
+      token = op++;
+      *token = (unsigned char)((literals < 15 ? literals : 15) << 4 |
+         (length - 4 < 15 ? length - 4 : 15));
+      if(literals >= 15)
+         op = lz_length(op, literals - 15);
+      memcpy(op, anchor, literals);
+      op += literals;
+      *op++ = (unsigned char)(ip - ref);
+      *op++ = (unsigned char)((ip - ref) >> 8);
+      if(length - 4 >= 15)
+         op = lz_length(op, length - 4 - 15);
+      ip += length;
+      anchor = ip;
+   }
+   literals = (int)(end - anchor);
+   *op++ = (unsigned char)((literals < 15 ? literals : 15) << 4);
+   if(literals >= 15)
+      op = lz_length(op, literals - 15);
+   memcpy(op, anchor, literals);
+   return (int)(op + literals - out);
+}
+
+//Returns the decompressed size or -1 if the data is corrupt
+static int lz_decompress(const unsigned char *in, int size, unsigned char *out, int capacity)
+{
+   const unsigned char *ip = in, *end = in + size;
+   unsigned char *op = out, *limit = out + capacity;
+   int literals, length, offset;
+
+   while(ip < end)
+   {
+      literals = *ip >> 4;
+      length = (*ip++ & 15) + 4;
+      if(literals == 15)
+      {
+         do
+         {
+            if(ip >= end)
+               return -1;
+            literals += *ip;
+         } while(*ip++ == 255);
+      }
+      if(literals > end - ip || literals > limit - op)
+         return -1;
+      memcpy(op, ip, literals);
+      op += literals;
+      ip += literals;
+      if(ip >= end)
+         break;
+      if(end - ip < 2)
+         return -1;
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if(length == 19)
+      {
+         do
+         {
+            if(ip >= end)
+               return -1;
+            length += *ip;
+         } while(*ip++ == 255);
+      }
+      if(offset == 0 || offset > op - out || length > limit - op)
+         return -1;
+      for(; length; --length, ++op)
+         *op = op[-offset];          //may overlap
+   }
+   return (int)(op - out);
+}
+
+//Compress and append one block; the writer owns ring[tail]
+static void trace_write(Trace *t, TraceBlock *block)
+{
+   unsigned char header[8];
+   int size = lz_compress(block->raw, block->used, t->packed);
+
+   if((t->indexCount & 1023) == 0)
+      t->index = (unsigned long long*)realloc(t->index,
+         (t->indexCount + 1024) * 2 * sizeof(unsigned long long));
+   t->index[t->indexCount * 2] = block->first;
+   t->index[t->indexCount * 2 + 1] = (unsigned long long)ftell(t->out);
+   ++t->indexCount;
+   trace_put32(header, block->used);
+   trace_put32(header + 4, size);
+   fwrite(header, 1, 8, t->out);
+   fwrite(t->packed, 1, size, t->out);
+   t->bytes += block->used;
+}
+
+#ifndef WIN32
+static void *trace_thread(void *arg)
+{
+   Trace *t = (Trace*)arg;
+
+   pthread_mutex_lock(&t->lock);
+   for(;;)
+   {
+      while(t->tail == t->head && t->done == 0)
+         pthread_cond_wait(&t->ready, &t->lock);
+      if(t->tail == t->head)
+         break;
+      pthread_mutex_unlock(&t->lock);
+      trace_write(t, &t->ring[t->tail % TRACE_RING]);
+      pthread_mutex_lock(&t->lock);
+      ++t->tail;
+      pthread_cond_signal(&t->space);
+   }
+   pthread_mutex_unlock(&t->lock);
+   return NULL;
+}
+#endif
+
+//Start a block with a sync record of the whole register file
+static void trace_sync(State *s, Trace *t)
+{
+   TraceBlock *block = &t->ring[t->head % TRACE_RING];
+   unsigned char *p = block->raw;
+   int index;
+
+   block->first = s->instructions;
+   trace_put32(p, (unsigned int)block->first);
+   trace_put32(p + 4, (unsigned int)(block->first >> 32));
+   trace_put32(p + 8, s->pc);
+   for(index = 1; index < 32; ++index)
+      trace_put32(p + 8 + index * 4, s->r[index]);
+   trace_put32(p + 8 + 32 * 4, s->hi);
+   trace_put32(p + 8 + 33 * 4, s->lo);
+   block->used = TRACE_SYNC_SIZE;
+   t->pc = s->pc - 4;
+   t->memAddress = 0;
+   for(index = 0; index < TRACE_OPCODES; ++index)
+      t->opcodes[index].pc = 1;      //never a pc
+}
+
+//Hand the full block to the writer and start the next one
+static void trace_flush(State *s, Trace *t)
+{
+#ifndef WIN32
+   pthread_mutex_lock(&t->lock);
+   ++t->head;
+   pthread_cond_signal(&t->ready);
+   while(t->head - t->tail >= TRACE_RING)
+      pthread_cond_wait(&t->space, &t->lock);
+   pthread_mutex_unlock(&t->lock);
+#else
+   trace_write(t, &t->ring[t->head % TRACE_RING]);
+   ++t->head;
+   ++t->tail;
+#endif
+   if(s)
+      trace_sync(s, t);
+}
+
+Trace *trace_open(const char *name)
+{
+   Trace *t;
+   unsigned char header[16];
+   FILE *out = fopen(name, "wb");
+
+   if(out == NULL)
+      return NULL;
+   t = (Trace*)calloc(1, sizeof(Trace));
+   t->out = out;
+   t->packed = (unsigned char*)malloc(TRACE_BLOCK + TRACE_BLOCK / 255 + 16);
+   memcpy(header, TRACE_MAGIC, 8);
+   trace_put32(header + 8, TRACE_VERSION);
+   trace_put32(header + 12, 0);
+   fwrite(header, 1, 16, out);
+   t->ring[0].used = -1;             //sync on the first instruction
+#ifndef WIN32
+   pthread_mutex_init(&t->lock, NULL);
+   pthread_cond_init(&t->ready, NULL);
+   pthread_cond_init(&t->space, NULL);
+   pthread_create(&t->thread, NULL, trace_thread, t);
+#endif
+   return t;
+}
+
+//Flush, write the index and the footer; returns the raw byte count
+unsigned long long trace_close(Trace *t)
+{
+   unsigned char footer[16];
+   unsigned long long bytes, offset;
+   int index;
+
+   if(t->ring[t->head % TRACE_RING].used > TRACE_SYNC_SIZE)
+      trace_flush(NULL, t);
+#ifndef WIN32
+   pthread_mutex_lock(&t->lock);
+   t->done = 1;
+   pthread_cond_signal(&t->ready);
+   pthread_mutex_unlock(&t->lock);
+   pthread_join(t->thread, NULL);
+   pthread_mutex_destroy(&t->lock);
+   pthread_cond_destroy(&t->ready);
+   pthread_cond_destroy(&t->space);
+#endif
+   offset = (unsigned long long)ftell(t->out);
+   for(index = 0; index < t->indexCount * 2; ++index)
+   {
+      trace_put32(footer, (unsigned int)t->index[index]);
+      trace_put32(footer + 4, (unsigned int)(t->index[index] >> 32));
+      fwrite(footer, 1, 8, t->out);
+   }
+   trace_put32(footer, (unsigned int)offset);
+   trace_put32(footer + 4, (unsigned int)(offset >> 32));
+   trace_put32(footer + 8, t->indexCount);
+   memcpy(footer + 12, "TIDX", 4);
+   fwrite(footer, 1, 16, t->out);
+   fclose(t->out);
+   bytes = t->bytes;
+   free(t->index);
+   free(t->packed);
+   free(t);
+   return bytes;
+}
+
+//Size of a load or store by opcode, 0 for other instructions
+static int trace_access(unsigned int opcode)
+{
+   static const unsigned char size[16] = {1, 2, 4, 4, 1, 2, 4, 0,
+                                          1, 2, 4, 4, 0, 0, 4, 0};
+   unsigned int op = opcode >> 26;
+
+   if(op >= 0x20 && op < 0x30)
+      return size[op - 0x20];
+   return op == 0x30 || op == 0x38 ? 4 : 0;  //LL, SC
+}
+
+//cycle(): note what the instruction at s->pc may change before it runs
+static void trace_before(State *s, const Decoded *d)
+{
+   Trace *t = s->trace;
+   int used = t->ring[t->head % TRACE_RING].used;
+   int size;
+
+   if(used < 0)
+      trace_sync(s, t);
+   else if(used > TRACE_BLOCK - TRACE_RECORD_MAX)
+      trace_flush(s, t);
+
+   //Registers the instruction can write, without duplicates or r0
+   t->regCount = 0;
+   if(d->rt)
+      t->regs[t->regCount++] = d->rt;
+   if(d->rd && d->rd != d->rt)
+      t->regs[t->regCount++] = d->rd;
+   if(d->rt != 31 && d->rd != 31)
+      t->regs[t->regCount++] = 31;
+   for(size = 0; size < t->regCount; ++size)
+      t->old[size] = s->r[t->regs[size]];
+   t->hi = s->hi;
+   t->lo = s->lo;
+   t->flags = 0;
+   size = trace_access(d->opcode);
+   if(size && s->skip == 0)
+   {
+      t->address = s->r[d->rs] + (short)d->opcode;
+      t->flags = size;
+      if(d->opcode & 0x08000000)
+      {
+         t->flags |= TRACE_STORE;
+         t->value = s->r[d->rt];
+      }
+      if(PAGE(s, t->address)->host == NULL)
+         t->flags |= TRACE_MMIO;
+   }
+}
+
+//cycle(): append the record of the instruction at pc
+static void trace_after(State *s, const Decoded *d, unsigned int pc, int nullified)
+{
+   Trace *t = s->trace;
+   TraceBlock *block = &t->ring[t->head % TRACE_RING];
+   unsigned char *tag, *p;
+   unsigned int value, index;
+   int regs = 0, i;
+
+   p = block->raw + block->used;
+   tag = p++;
+   *tag = nullified ? TRACE_NULLIFIED : 0;
+   if(pc != t->pc + 4)
+   {
+      *tag |= TRACE_PC_JUMP;
+      p = trace_varint(p, ZIGZAG((int)(pc - t->pc - 4) >> 2));
+   }
+   t->pc = pc;
+   index = (pc >> 2) & (TRACE_OPCODES - 1);
+   if(t->opcodes[index].pc != pc || t->opcodes[index].opcode != d->opcode)
+   {
+      *tag |= TRACE_OPCODE;
+      t->opcodes[index].pc = pc;
+      t->opcodes[index].opcode = d->opcode;
+      trace_put32(p, d->opcode);
+      p += 4;
+   }
+   if(t->flags && nullified == 0)
+   {
+      *tag |= TRACE_MEMORY;
+      *p++ = (unsigned char)t->flags;
+      p = trace_varint(p, ZIGZAG(t->address - t->memAddress));
+      t->memAddress = t->address;
+      value = t->flags & TRACE_STORE ? t->value : (unsigned int)s->r[d->rt];
+      p = trace_varint(p, value);
+   }
+   if(nullified == 0)
+   {
+      for(i = 0; i < t->regCount; ++i)
+      {
+         value = s->r[t->regs[i]];
+         if(value != t->old[i])
+         {
+            *p++ = t->regs[i];
+            p = trace_varint(p, ZIGZAG(value - t->old[i]));
+            ++regs;
+         }
+      }
+      if(s->hi != t->hi)
+      {
+         *p++ = 32;
+         p = trace_varint(p, ZIGZAG(s->hi - t->hi));
+         ++regs;
+      }
+      if(s->lo != t->lo)
+      {
+         *p++ = 33;
+         p = trace_varint(p, ZIGZAG(s->lo - t->lo));
+         ++regs;
+      }
+      *tag |= regs << TRACE_REGS_SHIFT;
+   }
+   block->used = (int)(p - block->raw);
+}
+
+//Print one instruction like cycle() does for show_mode 1 and 2
+static void show_instruction(unsigned int pc, unsigned int opcode, const int *r, int show_mode)
+{
+   unsigned int op = (opcode >> 26) & 0x3f, func = opcode & 0x3f;
+   unsigned int rs = (opcode >> 21) & 0x1f, rt = (opcode >> 16) & 0x1f;
+
+   printf("%8.8x %8.8x ", pc, opcode);
+   if(op == 0) 
+      printf("%8s ", special_string[func]);
+   else if(op == 1) 
+      printf("%8s ", regimm_string[rt]);
+   else 
+      printf("%8s ", opcode_string[op]);
+   printf("$%2.2d $%2.2d $%2.2d $%2.2d ", rs, rt, (opcode >> 11) & 0x1f, (opcode >> 6) & 0x1f);
+   printf("%4.4x", opcode & 0xffff);
+   if(show_mode == 1)
+      printf(" r[%2.2d]=%8.8x r[%2.2d]=%8.8x", rs, r[rs], rt, r[rt]);
+   printf("\n");
+}
+
+static unsigned int trace_read_varint(const unsigned char **p, const unsigned char *end)
+{
+   unsigned int value = 0;
+   int shift = 0;
+
+   while(*p < end && shift < 35)
+   {
+      value |= (unsigned int)(**p & 0x7f) << shift;
+      shift += 7;
+      if((*(*p)++ & 0x80) == 0)
+         break;
+   }
+   return value;
+}
+
+//Render count instructions from number first; verbose adds the memory
+//accesses and register write-backs.  Returns the process exit code.
+int trace_render(const char *name, unsigned long long first,
+                        unsigned long long count, int verbose)
+{
+   FILE *in = fopen(name, "rb");
+   unsigned char footer[16], *raw, *packed;
+   unsigned long long *index, number, offset;
+   TraceOpcode opcodes[TRACE_OPCODES];
+   int blocks, block, low, high, size, rawSize, regs, r[34];
+   unsigned int pc, opcode, value, flags, address, tag, reg;
+   const unsigned char *p, *end;
+
+   if(in == NULL || fread(footer, 1, 16, in) != 16 || memcmp(footer, TRACE_MAGIC, 8) ||
+      fseek(in, -16, SEEK_END) || fread(footer, 1, 16, in) != 16 ||
+      memcmp(footer + 12, "TIDX", 4))
+   {
+      fprintf(stderr, "Can't read trace %s\n", name);
+      if(in)
+         fclose(in);
+      return 1;
+   }
+   offset = trace_get32(footer) | (unsigned long long)trace_get32(footer + 4) << 32;
+   blocks = trace_get32(footer + 8);
+   index = (unsigned long long*)malloc((blocks + 1) * 2 * sizeof(unsigned long long));
+   fseek(in, (long)offset, SEEK_SET);
+   for(block = 0; block < blocks * 2 && fread(footer, 1, 8, in) == 8; ++block)
+      index[block] = trace_get32(footer) | (unsigned long long)trace_get32(footer + 4) << 32;
+
+   //Last block starting at or before first
+   for(low = 0, high = blocks - 1; low <= high; )
+   {
+      block = (low + high) / 2;
+      if(index[block * 2] <= first)
+         low = block + 1;
+      else
+         high = block - 1;
+   }
+   raw = (unsigned char*)malloc(TRACE_BLOCK);
+   packed = (unsigned char*)malloc(TRACE_BLOCK + TRACE_BLOCK / 255 + 16);
+   for(block = high > 0 ? high : 0; block < blocks && count; ++block)
+   {
+      fseek(in, (long)index[block * 2 + 1], SEEK_SET);
+      if(fread(footer, 1, 8, in) != 8)
+         break;
+      rawSize = trace_get32(footer);
+      size = trace_get32(footer + 4);
+      if(rawSize > TRACE_BLOCK || size > TRACE_BLOCK + TRACE_BLOCK / 255 + 16 ||
+         (int)fread(packed, 1, size, in) != size ||
+         lz_decompress(packed, size, raw, TRACE_BLOCK) != rawSize || rawSize < TRACE_SYNC_SIZE)
+      {
+         fprintf(stderr, "Corrupt trace block %d\n", block);
+         break;
+      }
+      number = trace_get32(raw) | (unsigned long long)trace_get32(raw + 4) << 32;
+      pc = trace_get32(raw + 8) - 4;
+      r[0] = 0;
+      for(reg = 1; reg < 34; ++reg)
+         r[reg] = trace_get32(raw + 8 + reg * 4);
+      for(reg = 0; reg < TRACE_OPCODES; ++reg)
+         opcodes[reg].pc = 1;
+      address = 0;
+      end = raw + rawSize;
+      for(p = raw + TRACE_SYNC_SIZE; p < end && count; ++number)
+      {
+         tag = *p++;
+         pc += 4;
+         if(tag & TRACE_PC_JUMP)
+         {
+            value = trace_read_varint(&p, end);
+            pc += UNZIGZAG(value) * 4;
+         }
+         reg = (pc >> 2) & (TRACE_OPCODES - 1);
+         if(tag & TRACE_OPCODE)
+         {
+            opcodes[reg].pc = pc;
+            opcodes[reg].opcode = trace_get32(p);
+            p += 4;
+         }
+         opcode = opcodes[reg].opcode;
+         if(number >= first)
+         {
+            show_instruction(pc, opcode, r, 1);
+            --count;
+         }
+         if(tag & TRACE_MEMORY)
+         {
+            flags = *p++;
+            value = trace_read_varint(&p, end);
+            address += UNZIGZAG(value);
+            value = trace_read_varint(&p, end);
+            if(verbose && number >= first)
+               printf("         %s%d %8.8x=%8.8x%s\n", flags & TRACE_STORE ? "store" : "load",
+                  flags & 7, address, value, flags & TRACE_MMIO ? " mmio" : "");
+         }
+         for(regs = (tag & TRACE_REGS) >> TRACE_REGS_SHIFT; regs; --regs)
+         {
+            reg = *p++;
+            if(reg >= 34)
+               break;
+            value = trace_read_varint(&p, end);
+            r[reg] += UNZIGZAG(value);
+            if(verbose && number >= first && reg < 32)
+               printf("         r[%2.2d]=%8.8x\n", reg, r[reg]);
+            else if(verbose && number >= first)
+               printf("         %s=%8.8x\n", reg == 32 ? "hi" : "lo", r[reg]);
+         }
+      }
+   }
+   free(raw);
+   free(packed);
+   free(index);
+   fclose(in);
+   return 0;
+}
+/************* End binary execution trace *************/
+
+/************* Shadow call stack *************/
+CallStack *calls_init(unsigned int entry)
+{
+   CallStack *c = (CallStack*)calloc(1, sizeof(CallStack));
+
+   c->root = c->node = c->all = (CallNode*)calloc(1, sizeof(CallNode));
+   c->root->function = entry;
+   c->root->calls = 1;
+   return c;
+}
+
+void calls_free(CallStack *c)
+{
+   CallNode *node, *next;
+
+   for(node = c->all; node; node = next)
+   {
+      next = node->all;
+      free(node);
+   }
+   free(c);
+}
+
+//Note the call or return of the branch at pc, applied by calls_commit()
+//once its delay slot has run
+static int calls_branch(CallStack *c, const Decoded *d, unsigned int pc,
+                        unsigned int target)
+{
+   OpHandler h = d->handler;
+
+   if(h == op_jal || (h == op_jalr && d->rd) ||
+      ((h == op_bltzal || h == op_bgezal || h == op_bltzall || h == op_bgezall) &&
+       target != pc + 8))
+   {
+      c->kind = CALL_ENTER;
+      c->ret = pc + 8;
+   }
+   else if(h == op_jr)
+      c->kind = CALL_LEAVE;
+   else
+      return 0;
+   c->target = target;
+   return 1;
+}
+
+static void calls_commit(CallStack *c)
+{
+   CallNode *node = c->node;
+
+   if(c->kind == CALL_ENTER && node->depth < CALL_DEPTH_MAX)
+   {
+      for(node = node->child; node && node->function != c->target; node = node->sibling)
+         ;
+      if(node == NULL)
+      {
+         node = (CallNode*)calloc(1, sizeof(CallNode));
+         node->function = c->target;
+         node->depth = c->node->depth + 1;
+         node->parent = c->node;
+         node->sibling = c->node->child;
+         c->node->child = node;
+         node->all = c->all;
+         c->all = node;
+      }
+      node->ret = c->ret;
+      ++node->calls;
+      c->node = node;
+   }
+   else if(c->kind == CALL_LEAVE)
+   {
+      //Unwind to the frame returning there; other JRs are jumps
+      for(; node->parent && node->ret != c->target; node = node->parent)
+         ;
+      if(node->parent)
+         c->node = node->parent;
+   }
+   c->kind = 0;
+}
+
+//cycle(): charge one instruction, then follow a call/return at pc
+static void calls_step(State *s, const Decoded *d, unsigned int pc,
+                       unsigned long long cycles)
+{
+   CallStack *c = s->calls;
+
+   ++c->node->count;
+   c->node->cycles += cycles;
+   if(c->pending && --c->pending == 0)
+      calls_commit(c);
+   if(d && calls_branch(c, d, pc, s->pc_next))
+      c->pending = 1;
+}
+/************* End shadow call stack *************/
+
+//execute one cycle of a Plasma CPU
+void cycle(State *s, int show_mode)
+{
+   const Decoded *d;
+   int *r=s->r;
+   unsigned int epc, rSave, pc = s->pc;
+   unsigned long long cycles = s->cycles;
+   int result;
+
+   if(s->cycles >= s->nextEvent && show_mode <= 5 && interrupt_check(s))
+      return;
+   d = fetch_decoded(s, s->pc);
+   r[0] = 0;
+   if(show_mode) 
+      show_instruction(s->pc, d->opcode, r, show_mode);
+   if(show_mode > 5) 
+      return;
+   if(s->icache || s->dcache)
+      cache_fetch(s, pc);
+   if(s->trace)
+      trace_before(s, d);
+   ++s->instructions;
+   epc = s->pc + 4;
+   if(s->pc_next != s->pc + 4)
+      epc |= 2;  //branch delay slot
+   s->pc = s->pc_next;
+   s->pc_next = s->pc_next + 4;
+   if(s->skip) 
+   {
+      s->skip = 0;
+      ++s->cycles;                 //nullified delay slot runs as a nop
+      if(s->profile)
+         profile_add(s, pc, 1, s->cycles - cycles);
+      if(s->calls)
+         calls_step(s, NULL, pc, s->cycles - cycles);
+      if(s->trace)
+         trace_after(s, d, pc, 1);
+      return;
+   }
+   s->cycles += s->timing ? d->cost : 1;
+   rSave = r[d->rt];
+   result = d->handler(s, d);
+   if(s->profile)
+      profile_add(s, pc, 1, s->cycles - cycles);
+   if(result & BRANCH_TAKEN)
+      s->pc_next += d->imm;
+   s->pc_next &= ~3;
+   if(s->calls)
+      calls_step(s, d, pc, s->cycles - cycles);
+   s->skip = (result & BRANCH_LIKELY_SKIP) != 0;
+   if(result & EXCEPTION_SYSCALL)
+      epc |= 1;
+
+   if(s->exceptionId)
+   {
+      r[d->rt] = rSave;
+      s->epc = epc; 
+      s->pc_next = 0x3c;
+      s->skip = 1; 
+      s->exceptionId = 0;
+      s->userMode = 0;
+   }
+   if(s->trace)
+      trace_after(s, d, pc, 0);
+}
+
+/************* Basic-block threaded-code engine *************/
+/* A block is a copy of the decoded instructions from its start address up
+   to and including the delay slot of the first branch or jump.  The body
+   runs as threaded code without the pc/pc_next/skip/epc bookkeeping of
+   cycle(); the branch and its delay slot are evaluated at the block exit,
+   which chains directly to the successor blocks.  SYSCALL/BREAK and
+   unknown opcodes always go through cycle(). */
+
+#define BLOCK_MAX 64
+
+struct Block_s {
+   unsigned int pc;
+   int count;                    //instructions, delay slot included
+   int cycles;                   //clocks charged per execution
+   int branch;                   //ends with a branch plus delay slot
+   int slow;                     //first instruction must run through cycle()
+   int halt;                     //see is_halt_loop()
+   int spin;                     //polling loop, see spin_forward()
+   unsigned int hits;            //executions, for the JIT threshold
+   unsigned long long runs;      //profiler: executions
+   long long stall;              //profiler: clocks beyond cycles, all runs
+   void (*native)(State *s);     //compiled code or NULL
+   Block *link[2];               //chained successors
+   Block *list;                  //all blocks, for block_flush()
+   Decoded op[1];
+};
+
+//Fold the execution count of a block into the per-word profile;
+//stalls are charged to its first instruction
+static void profile_block(State *s, const Block *b)
+{
+   int index;
+
+   for(index = 0; index < b->count; ++index)
+      profile_add(s, b->pc + index * 4, b->runs,
+                  b->runs * (s->timing ? b->op[index].cost : 1));
+   profile_add(s, b->pc, 0, b->stall);
+}
+
+//Charge a block to the call stack, then follow the branch that ends it
+static void calls_block(State *s, const Block *b, unsigned long long cycles)
+{
+   CallStack *c = s->calls;
+   unsigned int pc = b->pc + (b->count - 2) * 4;
+
+   c->node->count += b->count;
+   c->node->cycles += cycles;
+   if(b->branch && calls_branch(c, &b->op[b->count - 2], pc, s->pc))
+      calls_commit(c);
+}
+
+static void block_flush(State *s)
+{
+   Block *b, *next;
+
+   for(b = s->blockList; b; b = next)
+   {
+      next = b->list;
+      if(s->profile && b->runs)
+         profile_block(s, b);
+      free(b);
+   }
+   s->blockList = NULL;
+   s->blockStale = 0;
+   s->jitUsed = 0;
+   memset(s->blockMap, 0, MEM_SIZE / 4 * sizeof(Block*));
+}
+
+/* Polling loops: a block that branches back to itself, with no stores and
+   no register carried from one iteration to the next, repeats the same
+   iteration until a device read returns something else.  Such a block
+   reads and writes only the registers spin_regs() knows; every register
+   it writes is written before it is read. */
+static int spin_regs(const Decoded *d, unsigned int *read, unsigned int *write)
+{
+   OpHandler h = d->handler;
+
+   *read = *write = 0;
+   if(h == op_sll || h == op_srl || h == op_sra)
+   {
+      *read = 1u << d->rt;
+      *write = 1u << d->rd;
+   }
+   else if(h == op_sllv || h == op_srlv || h == op_srav || h == op_add || h == op_sub ||
+           h == op_and || h == op_or || h == op_xor || h == op_nor || h == op_slt ||
+           h == op_sltu)
+   {
+      *read = 1u << d->rs | 1u << d->rt;
+      *write = 1u << d->rd;
+   }
+   else if(h == op_addi || h == op_slti || h == op_sltiu || h == op_andi || h == op_ori ||
+           h == op_xori || h == op_lb_be || h == op_lh_be || h == op_lw_be ||
+           h == op_lbu_be || h == op_lhu_be || h == op_lb_le || h == op_lh_le ||
+           h == op_lw_le || h == op_lbu_le || h == op_lhu_le)
+   {
+      *read = 1u << d->rs;
+      *write = 1u << d->rt;
+   }
+   else if(h == op_lui)
+      *write = 1u << d->rt;
+   else if(h == op_beq || h == op_bne)
+      *read = 1u << d->rs | 1u << d->rt;
+   else if(h == op_blez || h == op_bgtz || h == op_bltz || h == op_bgez)
+      *read = 1u << d->rs;
+   else if(h != op_nop && h != op_j)
+      return 0;
+   *write &= ~1u;
+   return 1;
+}
+
+static int spin_loop(unsigned int pc, const Decoded *ops, int count)
+{
+   const Decoded *branch = &ops[count - 2];
+   unsigned int read, write, written = 0, all = 0, target;
+   int index;
+
+   target = branch->handler == op_j ? ((pc + count * 4 - 4) & 0xf0000000) | branch->imm :
+            pc + count * 4 + branch->imm;
+   if(target != pc)
+      return 0;
+   for(index = 0; index < count; ++index)
+   {
+      if(spin_regs(&ops[index], &read, &write) == 0)
+         return 0;
+      all |= write;
+   }
+   for(index = 0; index < count; ++index)
+   {
+      spin_regs(&ops[index], &read, &write);
+      if(read & all & ~written)
+         return 0;
+      written |= write;
+   }
+   return 1;
+}
+
+static Block *block_build(State *s, unsigned int pc)
+{
+   Decoded ops[BLOCK_MAX + 1];
+   Decoded *d;
+   Block *b;
+   int count = 0, branch = 0, slow = 0, index, at;
+
+   for(;;)
+   {
+      if(count && (pc + count * 4 == s->blockBreak || is_halt_loop(s, pc + count * 4)))
+         break;
+      d = (Decoded*)fetch_decoded(s, pc + count * 4);
+      if(d->flags & OPF_SLOW)
+      {
+         slow = count == 0;
+         break;
+      }
+      if(d->flags & OPF_BRANCH)
+      {
+         Decoded *slot = (Decoded*)fetch_decoded(s, pc + count * 4 + 4);
+         if(slot->flags & (OPF_BRANCH | OPF_SLOW))
+         {
+            slow = count == 0;
+            break;
+         }
+         ops[count++] = *d;
+         d->flags |= OPF_IN_BLOCK;
+         ops[count++] = *slot;
+         slot->flags |= OPF_IN_BLOCK;
+         branch = 1;
+         break;
+      }
+      ops[count++] = *d;
+      d->flags |= OPF_IN_BLOCK;
+      if(count == BLOCK_MAX)
+         break;
+   }
+   if(slow)
+      count = 0;
+
+   b = (Block*)malloc(sizeof(Block) + count * sizeof(Decoded));
+   b->pc = pc;
+   b->count = count;
+   b->cycles = 0;
+   for(index = 0; index < count; ++index)
+      b->cycles += s->timing ? ops[index].cost : 1;
+   for(index = 0, at = -b->cycles; index < count; ++index)
+   {
+      at += s->timing ? ops[index].cost : 1;
+      ops[index].at = (short)at;
+   }
+   b->branch = branch;
+   b->slow = slow;
+   b->halt = branch && count == 2 && is_halt_loop(s, pc);
+   b->spin = branch && spin_loop(pc, ops, count);
+   b->hits = 0;
+   b->runs = 0;
+   b->stall = 0;
+   b->native = NULL;
+   b->link[0] = b->link[1] = NULL;
+   memcpy(b->op, ops, count * sizeof(Decoded));
+   b->list = s->blockList;
+   s->blockList = b;
+   s->blockMap[mem_offset(pc) >> 2] = b;
+   return b;
+}
+
+static Block *block_lookup(State *s, unsigned int pc)
+{
+   Block *b = s->blockMap[mem_offset(pc) >> 2];
+
+   if(b == NULL || b->pc != pc)
+      b = block_build(s, pc);
+   return b;
+}
+
+//Resolve the branch at d (address pc) and run its delay slot
+static void block_exit(State *s, const Decoded *d, unsigned int pc)
+{
+   int result;
+
+   s->pc = pc + 4;
+   s->pc_next = pc + 8;
+   s->r[0] = 0;
+   result = d->handler(s, d);
+   if(result & BRANCH_TAKEN)
+      s->pc_next += d->imm;
+   s->pc_next &= ~3;
+   if((result & BRANCH_LIKELY_SKIP) == 0)
+   {
+      s->r[0] = 0;
+      ++d;
+      d->handler(s, d);
+   }
+   else if(s->timing)
+      s->cycles -= d[1].cost - 1;  //nullified delay slot runs as a nop
+   s->pc = s->pc_next;
+   s->pc_next = s->pc + 4;
+}
+
+//Execute one block; leaves s->pc/s->pc_next at the successor
+static void block_exec(State *s, const Block *b)
+{
+   const Decoded *d = b->op, *end = b->op + b->count;
+   int *r = s->r;
+
+   if(b->branch)
+      end -= 2;
+   for(; d < end; ++d)
+   {
+      r[0] = 0;
+      d->handler(s, d);
+   }
+   if(b->branch)
+      block_exit(s, d, b->pc + (b->count - 2) * 4);
+   else
+   {
+      s->pc = b->pc + b->count * 4;
+      s->pc_next = s->pc + 4;
+   }
+}
+
+/* Run one iteration of the polling loop b as if it started clocks after
+   now, then put everything back.  Returns 1 when it would branch back to
+   itself, 0 when it would leave or a read had side effects */
+static int spin_probe(State *s, const Block *b, unsigned long long now,
+                      unsigned long long clocks)
+{
+   int r[32], pc = s->pc, pc_next = s->pc_next, irqStatus = s->irqStatus, again;
+   unsigned long long cycles = s->cycles;
+
+   memcpy(r, s->r, sizeof(r));
+   s->peek = 1;
+   s->peekFailed = 0;
+   s->peekLater = 0;
+   s->cycles = now + clocks + b->cycles;
+   block_exec(s, b);
+   if(s->cycles != now + clocks + b->cycles)
+      s->peekFailed = 1;                  //wait states: iterations differ in length
+   again = s->pc == (int)b->pc && s->peekFailed == 0;
+   memcpy(s->r, r, sizeof(r));
+   s->pc = pc;
+   s->pc_next = pc_next;
+   s->irqStatus = irqStatus;
+   s->cycles = cycles;
+   s->peek = 0;
+   return again;
+}
+
+/* Iterations of the polling loop b at s->pc that can be skipped because
+   they would all branch back to it.  Device reads are functions of the
+   clock, so probes gallop ahead at most SPIN_STEP clocks apart, then
+   bisect to the first iteration that leaves.  A loop that leaves for
+   less than SPIN_STEP clocks between probes may be missed: none of the
+   Plasma registers do (COUNTER_REG bits below 16 aside).  Multi-core
+   runs are left alone as another core may store to what b reads. */
+#define SPIN_STEP  (1 << 16)
+#define SPIN_MAX   (1ULL << 30)  //clocks per call, so that deadlines are checked
+
+static unsigned long long spin_forward(State *s, Block *b)
+{
+   unsigned long long now = s->cycles, last = 0, next, step = 1, limit, mid;
+
+   if(s->soc)
+   {
+      b->spin = 0;
+      return 0;
+   }
+   if(s->budget - s->instructions < BLOCK_MAX)
+      return 0;
+   if(!spin_probe(s, b, now, 0))
+   {
+      b->spin = s->peekFailed == 0 || s->peekLater;  //reads with side effects: for good
+      return 0;
+   }
+   limit = (s->budget - s->instructions - BLOCK_MAX) / b->count;
+   if(limit > SPIN_MAX / b->cycles)
+      limit = SPIN_MAX / b->cycles;
+   if(limit > (s->nextEvent - now - 1) / b->cycles - 1)
+      limit = (s->nextEvent - now - 1) / b->cycles - 1;  //the last one runs before it
+   while(last < limit)
+   {
+      next = last + step < limit ? last + step : limit;
+      if(!spin_probe(s, b, now, next * b->cycles))
+      {
+         while(next - last > 1)
+         {
+            mid = last + (next - last) / 2;
+            if(spin_probe(s, b, now, mid * b->cycles))
+               last = mid;
+            else
+               next = mid;
+         }
+         return next;
+      }
+      last = next;
+      if(step * 2 * b->cycles <= SPIN_STEP)
+         step *= 2;
+   }
+   return last;
+}
+
+/************* x86-64 JIT for hot blocks *************/
+/* Blocks executed JIT_THRESHOLD times are translated to native code in a
+   bounded executable buffer.  MIPS registers stay in s->r; rbx holds the
+   State and r12 s->mem.  Loads and stores to internal and external RAM go
+   straight to host memory, everything else (MMIO, stores into pages that
+   hold code) calls jit_read()/jit_write().  Instructions without a native
+   translation call their handler.  The whole buffer is dropped together
+   with the blocks by block_flush(), which also runs when it fills up. */
+
+#ifdef ENABLE_JIT
+#include <stddef.h>
+
+#define JIT_THRESHOLD   32
+#define JIT_CACHE_SIZE  (8*1024*1024)
+#define JIT_OP_BYTES    160           //upper bound for one instruction
+
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+enum { CC_B=2, CC_AE=3, CC_E=4, CC_NE=5, CC_L=12, CC_GE=13, CC_LE=14, CC_G=15 };
+
+#define REG(n)  (int)(offsetof(State, r) + (n) * 4)
+#define FIELD(f) (int)offsetof(State, f)
+
+static __thread unsigned char *jp;   //emit pointer, per compiling thread
+
+static void x1(int b) { *jp++ = (unsigned char)b; }
+static void x4(unsigned int v) { memcpy(jp, &v, 4); jp += 4; }
+static void x8(void *v) { memcpy(jp, &v, 8); jp += 8; }
+
+//mov reg,[rbx+disp] / mov [rbx+disp],reg
+static void x_load(int reg, int disp)  { x1(0x8b); x1(0x83 | reg << 3); x4(disp); }
+static void x_store(int reg, int disp) { x1(0x89); x1(0x83 | reg << 3); x4(disp); }
+static void x_store_imm(int disp, unsigned int imm) { x1(0xc7); x1(0x83); x4(disp); x4(imm); }
+static void x_mov_imm(int reg, unsigned int imm) { x1(0xb8 + reg); x4(imm); }
+//opcode dst,src for add/or/and/sub/xor/cmp/mov/test
+static void x_rr(int opcode, int dst, int src) { x1(opcode); x1(0xc0 | src << 3 | dst); }
+//group 1 with imm32: ext 0=add 1=or 4=and 5=sub 6=xor 7=cmp
+static void x_ri(int ext, int reg, unsigned int imm) { x1(0x81); x1(0xc0 | ext << 3 | reg); x4(imm); }
+//shift group: ext 4=shl 5=shr 7=sar
+static void x_shift(int ext, int reg, int count) { x1(0xc1); x1(0xc0 | ext << 3 | reg); x1(count); }
+static void x_shift_cl(int ext, int reg) { x1(0xd3); x1(0xc0 | ext << 3 | reg); }
+static void x_setcc(int cc, int reg)
+{
+   x1(0x0f); x1(0x90 + cc); x1(0xc0 | reg);
+   x1(0x0f); x1(0xb6); x1(0xc0 | reg << 3 | reg);      //movzx reg,reg8
+}
+static void x_bswap(int reg) { x1(0x0f); x1(0xc8 + reg); }
+static unsigned char *x_jcc(int cc) { x1(0x0f); x1(0x80 + cc); x4(0); return jp - 4; }
+static unsigned char *x_jmp(void) { x1(0xe9); x4(0); return jp - 4; }
+static void x_patch(unsigned char *at) { unsigned int rel = (unsigned int)(jp - at - 4); memcpy(at, &rel, 4); }
+static void x_call(void *fn)
+{
+   x1(0x48); x1(0x89); x1(0xdf);                      //mov rdi,rbx
+   x1(0x48); x1(0xb8); x8(fn);                        //mov rax,fn
+   x1(0xff); x1(0xd0);                                //call rax
+}
+
+static void x_get(int reg, int mipsReg)
+{
+   if(mipsReg == 0)
+      x_rr(0x31, reg, reg);                           //xor reg,reg
+   else
+      x_load(reg, REG(mipsReg));
+}
+
+static void x_put(int reg, int mipsReg)
+{
+   if(mipsReg)
+      x_store(reg, REG(mipsReg));
+}
+
+static unsigned int jit_read(State *s, unsigned int address, int size)
+{
+   return mem_read(s, size, address);
+}
+
+static void jit_write(State *s, unsigned int address, unsigned int value, int size)
+{
+   mem_write(s, size, address, value);
+   code_invalidate(s, address);
+}
+
+/* esi = address; on the fast path ecx = offset into s->mem and the code
+   continues, otherwise jumps to the returned patch location.  RAM wait
+   states of the timing model are only charged on the slow path. */
+static unsigned char *x_translate(State *s)
+{
+   unsigned char *notExternal, *toFast, *slow;
+
+   if(s->waitExternal)
+      return x_jmp();
+
+   x_rr(0x89, EAX, ESI);                             //mov eax,esi
+   x_shift(5, EAX, 20);
+   x_rr(0x89, ECX, ESI);                             //mov ecx,esi
+   x1(0x3d); x4(RAM_EXTERNAL >> 20);                 //cmp eax,0x100
+   notExternal = x_jcc(CC_NE);
+   x_ri(4, ECX, 0xfffff);
+   x_ri(1, ECX, RAM_WINDOW);
+   toFast = x_jmp();
+   x_patch(notExternal);
+   x_rr(0x85, EAX, EAX);                             //test eax,eax
+   slow = x_jcc(CC_NE);
+   x_patch(toFast);
+   return slow;
+}
+
+static void jit_load(State *s, const Decoded *d, int size, int sign)
+{
+   unsigned char *slow, *done;
+
+   x_get(ESI, d->rs);
+   x_ri(0, ESI, d->imm);
+   slow = x_translate(s);
+   //REX.B for the r12 base, SIB index rcx
+   if(size == 4)
+   {
+      x1(0x41); x1(0x8b); x1(0x04); x1(0x0c);        //mov eax,[r12+rcx]
+      if(s->big_endian)
+         x_bswap(EAX);
+   }
+   else if(size == 2)
+   {
+      x1(0x41); x1(0x0f); x1(0xb7); x1(0x04); x1(0x0c);  //movzx eax,word
+      if(s->big_endian)
+      {
+         x1(0x66); x1(0xc1); x1(0xc0); x1(8);        //rol ax,8
+      }
+   }
+   else
+   {
+      x1(0x41); x1(0x0f); x1(0xb6); x1(0x04); x1(0x0c);  //movzx eax,byte
+   }
+   done = x_jmp();
+   x_patch(slow);
+   x_mov_imm(EDX, size);
+   x_store_imm(FIELD(at), (unsigned int)d->at);
+   x_call((void*)jit_read);
+   x_patch(done);
+   if(sign && size == 2)
+   {
+      x1(0x0f); x1(0xbf); x1(0xc0);                  //movsx eax,ax
+   }
+   else if(sign && size == 1)
+   {
+      x1(0x0f); x1(0xbe); x1(0xc0);                  //movsx eax,al
+   }
+   x_put(EAX, d->rt);
+}
+
+static void jit_store(State *s, const Decoded *d, int size)
+{
+   unsigned char *slow, *slowCode, *done;
+
+   x_get(EDX, d->rt);
+   x_get(ESI, d->rs);
+   x_ri(0, ESI, d->imm);
+   slow = s->soc ? x_jmp() : x_translate(s);         //SoC: stores are logged
+   x_rr(0x89, EAX, ECX);                             //mov eax,ecx
+   x_shift(5, EAX, 12);
+   x1(0x80); x1(0xbc); x1(0x03); x4(FIELD(codePage)); x1(0);  //cmp byte [rbx+rax+codePage],0
+   slowCode = x_jcc(CC_NE);
+#ifdef SIMPLE_CACHE
+   //Keep the write-through cache model coherent: drop the line
+   x_rr(0x89, EAX, ESI);
+   x_shift(5, EAX, 2);
+   x_ri(4, EAX, 0x3ff);
+   x1(0x49); x1(0xb8); x8((void*)s->cache.addr);      //mov r8,s->cache.addr
+   x1(0x41); x1(0xc7); x1(0x04); x1(0x80); x4(CACHE_MISS);  //mov [r8+rax*4],CACHE_MISS
+#endif
+   if(size == 4)
+   {
+      if(s->big_endian)
+         x_bswap(EDX);
+      x1(0x41); x1(0x89); x1(0x14); x1(0x0c);        //mov [r12+rcx],edx
+   }
+   else if(size == 2)
+   {
+      if(s->big_endian)
+      {
+         x1(0x66); x1(0xc1); x1(0xc2); x1(8);        //rol dx,8
+      }
+      x1(0x66); x1(0x41); x1(0x89); x1(0x14); x1(0x0c);
+   }
+   else
+   {
+      x1(0x41); x1(0x88); x1(0x14); x1(0x0c);        //mov [r12+rcx],dl
+   }
+   done = x_jmp();
+   x_patch(slow);
+   x_patch(slowCode);
+   x_mov_imm(ECX, size);
+   x_store_imm(FIELD(at), (unsigned int)d->at);
+   x_call((void*)jit_write);
+   x_patch(done);
+}
+
+//Call the interpreter handler for d
+static void jit_fallback(const Decoded *d)
+{
+   x1(0x48); x1(0xbe); x8((void*)d);                  //mov rsi,d
+   x_call((void*)d->handler);
+   x_store_imm(REG(0), 0);
+}
+
+static void jit_alu(int opcode, const Decoded *d)
+{
+   x_get(EAX, d->rs);
+   x_get(ECX, d->rt);
+   x_rr(opcode, EAX, ECX);
+}
+
+static void jit_op(State *s, const Decoded *d)
+{
+   const MemoryOps *m = &memoryOps[s->big_endian != 0];
+   OpHandler h = d->handler;
+   int cc = -1;
+
+   if(h == op_nop)
+      return;
+   if(h == m->lw)  { jit_load(s, d, 4, 0); return; }
+   if(h == m->lb)  { jit_load(s, d, 1, 1); return; }
+   if(h == m->lbu) { jit_load(s, d, 1, 0); return; }
+   if(h == m->lh)  { jit_load(s, d, 2, 1); return; }
+   if(h == m->lhu) { jit_load(s, d, 2, 0); return; }
+   if(h == m->sw)  { jit_store(s, d, 4); return; }
+   if(h == m->sh)  { jit_store(s, d, 2); return; }
+   if(h == m->sb)  { jit_store(s, d, 1); return; }
+   if(h == op_mthi || h == op_mtlo)
+   {
+      x_get(EAX, d->rs);
+      x_store(EAX, h == op_mthi ? FIELD(hi) : FIELD(lo));
+      return;
+   }
+
+   if(h == op_add)       jit_alu(0x01, d);
+   else if(h == op_sub)  jit_alu(0x29, d);
+   else if(h == op_and)  jit_alu(0x21, d);
+   else if(h == op_or)   jit_alu(0x09, d);
+   else if(h == op_xor)  jit_alu(0x31, d);
+   else if(h == op_nor)  { jit_alu(0x09, d); x1(0xf7); x1(0xd0); }
+   else if(h == op_slt)  { jit_alu(0x39, d); cc = CC_L; }
+   else if(h == op_sltu) { jit_alu(0x39, d); cc = CC_B; }
+   else if(h == op_sll || h == op_srl || h == op_sra)
+   {
+      x_get(EAX, d->rt);
+      x_shift(h == op_sll ? 4 : h == op_srl ? 5 : 7, EAX, d->re);
+   }
+   else if(h == op_sllv || h == op_srlv || h == op_srav)
+   {
+      x_get(EAX, d->rt);
+      x_get(ECX, d->rs);
+      x_shift_cl(h == op_sllv ? 4 : h == op_srlv ? 5 : 7, EAX);
+   }
+   else if((h == op_mfhi || h == op_mflo) && s->timing == 0)
+      x_load(EAX, h == op_mfhi ? FIELD(hi) : FIELD(lo));
+   else if(h == op_addi || h == op_andi || h == op_ori || h == op_xori)
+   {
+      x_get(EAX, d->rs);
+      x_ri(h == op_addi ? 0 : h == op_andi ? 4 : h == op_ori ? 1 : 6, EAX, d->imm);
+   }
+   else if(h == op_slti || h == op_sltiu)
+   {
+      x_get(EAX, d->rs);
+      x_ri(7, EAX, d->imm);
+      cc = h == op_slti ? CC_L : CC_B;
+   }
+   else if(h == op_lui)
+      x_mov_imm(EAX, d->imm);
+   else
+   {
+      jit_fallback(d);
+      return;
+   }
+   if(cc >= 0)
+      x_setcc(cc, EAX);
+   if(h == op_add || h == op_sub || h == op_and || h == op_or || h == op_xor ||
+      h == op_nor || h == op_slt || h == op_sltu || h == op_sll || h == op_srl ||
+      h == op_sra || h == op_sllv || h == op_srlv || h == op_srav ||
+      h == op_mfhi || h == op_mflo)
+      x_put(EAX, d->rd);
+   else
+      x_put(EAX, d->rt);
+}
+
+//Branch at pc with its delay slot; ends with s->pc/s->pc_next updated
+static void jit_branch(State *s, const Decoded *d, unsigned int pc)
+{
+   OpHandler h = d->handler;
+   unsigned int target = pc + 8 + d->imm;
+   unsigned char *skip, *notTaken = NULL, *done = NULL;
+   int cc = -1, likely = 0;
+
+   if(h == op_bltzal || h == op_bgezal || h == op_jal)
+      x_store_imm(REG(31), pc + 8);
+   if(h == op_j || h == op_jal)
+      x_store_imm(FIELD(pc_next), ((pc + 4) & 0xf0000000) | d->imm);
+   else if(h == op_jr || h == op_jalr)
+   {
+      if(h == op_jalr && d->rd && d->rd == d->rs)
+         x_mov_imm(EAX, pc + 8);
+      else
+         x_get(EAX, d->rs);
+      if(h == op_jalr && d->rd)
+         x_store_imm(REG(d->rd), pc + 8);
+      x_ri(4, EAX, ~3u);
+      x_store(EAX, FIELD(pc_next));
+   }
+   else if(h == op_beq || h == op_bne || h == op_beql || h == op_bnel)
+   {
+      jit_alu(0x39, d);
+      cc = (h == op_beq || h == op_beql) ? CC_E : CC_NE;
+      likely = h == op_beql || h == op_bnel;
+   }
+   else if(h == op_blez || h == op_bgtz || h == op_bltz || h == op_bgez ||
+           h == op_bltzal || h == op_bgezal || h == op_blezl || h == op_bgtzl ||
+           h == op_bltzl || h == op_bgezl)
+   {
+      x_get(EAX, d->rs);
+      x_rr(0x85, EAX, EAX);
+      cc = (h == op_blez || h == op_blezl) ? CC_LE :
+           (h == op_bgtz || h == op_bgtzl) ? CC_G :
+           (h == op_bltz || h == op_bltzal || h == op_bltzl) ? CC_L : CC_GE;
+      likely = h == op_blezl || h == op_bgtzl || h == op_bltzl || h == op_bgezl;
+   }
+   else
+   {
+      //Rare forms go through the interpreter exit
+      x1(0x48); x1(0xbe); x8((void*)d);               //mov rsi,d
+      x_mov_imm(EDX, pc);
+      x_call((void*)block_exit);
+      return;
+   }
+
+   if(cc >= 0 && likely == 0)
+   {
+      x_store_imm(FIELD(pc_next), pc + 8);
+      skip = x_jcc(cc ^ 1);
+      x_store_imm(FIELD(pc_next), target);
+      x_patch(skip);
+   }
+   else if(likely)
+   {
+      notTaken = x_jcc(cc ^ 1);
+      x_store_imm(FIELD(pc_next), target);
+   }
+
+   jit_op(s, d + 1);                                  //delay slot
+   x_load(EAX, FIELD(pc_next));
+   x_store(EAX, FIELD(pc));
+   x_ri(0, EAX, 4);
+   x_store(EAX, FIELD(pc_next));
+   if(likely)
+   {
+      done = x_jmp();
+      x_patch(notTaken);
+      if(s->timing && d[1].cost > 1)
+      {
+         //sub qword [rbx+cycles],cost-1: nullified delay slot runs as a nop
+         x1(0x48); x1(0x81); x1(0xab); x4(FIELD(cycles)); x4(d[1].cost - 1);
+      }
+      x_store_imm(FIELD(pc), pc + 8);
+      x_store_imm(FIELD(pc_next), pc + 12);
+      x_patch(done);
+   }
+}
+
+static void jit_compile(State *s, Block *b)
+{
+   int i, body = b->branch ? b->count - 2 : b->count;
+
+   if(s->jitCode == NULL)
+      return;
+   if(s->jitUsed + (b->count + 4) * JIT_OP_BYTES > JIT_CACHE_SIZE)
+   {
+      s->blockStale = 1;     //full: start over at the next block boundary
+      return;
+   }
+   jp = s->jitCode + s->jitUsed;
+   b->native = (void (*)(State*))jp;
+
+   x1(0x53);                                          //push rbx
+   x1(0x41); x1(0x54);                                //push r12
+   x1(0x48); x1(0x83); x1(0xec); x1(8);               //sub rsp,8
+   x1(0x48); x1(0x89); x1(0xfb);                      //mov rbx,rdi
+   x1(0x4c); x1(0x8b); x1(0xa3); x4(FIELD(mem));      //mov r12,[rbx+mem]
+   x_store_imm(REG(0), 0);
+
+   for(i = 0; i < body; ++i)
+      jit_op(s, &b->op[i]);
+   if(b->branch)
+      jit_branch(s, &b->op[body], b->pc + body * 4);
+   else
+   {
+      x_store_imm(FIELD(pc), b->pc + b->count * 4);
+      x_store_imm(FIELD(pc_next), b->pc + b->count * 4 + 4);
+   }
+
+   x1(0x48); x1(0x83); x1(0xc4); x1(8);               //add rsp,8
+   x1(0x41); x1(0x5c);                                //pop r12
+   x1(0x5b);                                          //pop rbx
+   x1(0xc3);                                          //ret
+   s->jitUsed = (unsigned int)(jp - s->jitCode + 15) & ~15u;
+}
+
+static void jit_init(State *s)
+{
+   void *code;
+
+   if(s->jitCode)
+      return;
+   code = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(code == MAP_FAILED)
+   {
+      printf("JIT disabled: no executable memory\n");
+      s->engine = ENGINE_BLOCK;
+      return;
+   }
+   s->jitCode = (unsigned char*)code;
+   s->jitUsed = 0;
+}
+
+static void jit_free(State *s)
+{
+   if(s->jitCode)
+      munmap(s->jitCode, JIT_CACHE_SIZE);
+   s->jitCode = NULL;
+}
+#endif  //ENABLE_JIT
+/************* End JIT *************/
+
+//Batch runs: check the stop conditions before the instruction at s->pc
+static int batch_stop(State *s)
+{
+   if(s->stopReason == STOP_NONE)
+   {
+      if(s->instructions >= s->budget)
+         s->stopReason = STOP_BUDGET;
+      else if(s->pc_next == s->pc + 4 && s->skip == 0 && is_halt_loop(s, s->pc) &&
+              !interrupt_enabled(s))
+         s->stopReason = STOP_HALT;
+      else if(s->deadline && (++s->timeCheck & 0xffff) == 0 && host_time() >= s->deadline)
+         s->stopReason = STOP_TIME;
+   }
+   if(s->stopReason == STOP_NONE)
+      return 0;
+   s->wakeup = 1;
+   return 1;
+}
+
+//Single step until outside any delay slot
+static void step_out(State *s)
+{
+   do
+   {
+      if(s->batch && batch_stop(s))
+         return;
+      cycle(s, 0);
+   } while(s->wakeup == 0 && (s->pc_next != s->pc + 4 || s->skip));
+}
+
+//Run with the block engine until wakeup or the PC reaches breakpoint
+static void run_blocks(State *s, unsigned int breakpoint)
+{
+   Block *b, *next;
+   unsigned long long cycles, skipped;
+
+   if(s->blockMap == NULL)
+      s->blockMap = (Block**)calloc(MEM_SIZE / 4, sizeof(Block*));
+#ifdef ENABLE_JIT
+   if(s->engine == ENGINE_JIT)
+      jit_init(s);
+#endif
+   if(s->blockBreak != breakpoint)
+   {
+      s->blockBreak = breakpoint;
+      block_flush(s);
+   }
+
+   //Enter at an instruction boundary outside any delay slot
+   if(s->batch == 0 || s->pc_next != s->pc + 4 || s->skip)
+      step_out(s);
+
+   b = NULL;
+   while(s->wakeup == 0 && s->pc != breakpoint)
+   {
+      if(s->blockStale)
+      {
+         block_flush(s);
+         b = NULL;
+      }
+      next = NULL;
+      if(b)
+      {
+         if(b->link[0] && b->link[0]->pc == s->pc)
+            next = b->link[0];
+         else if(b->link[1] && b->link[1]->pc == s->pc)
+            next = b->link[1];
+      }
+      if(next == NULL)
+      {
+         next = block_lookup(s, s->pc);
+         if(b && b->link[0] == NULL)
+            b->link[0] = next;
+         else if(b)
+            b->link[1] = next;
+      }
+      b = next;
+      if(s->batch)
+      {
+         //Close to the budget: finish instruction by instruction
+         if(s->instructions + BLOCK_MAX > s->budget)
+         {
+            while(s->wakeup == 0)
+               step_out(s);
+            break;
+         }
+         if(b->halt && !interrupt_enabled(s))
+            s->stopReason = STOP_HALT;
+         else if(s->deadline && (++s->timeCheck & 0xfff) == 0 && host_time() >= s->deadline)
+            s->stopReason = STOP_TIME;
+         if(s->stopReason)
+         {
+            s->wakeup = 1;
+            break;
+         }
+      }
+      if(s->cycles + b->cycles >= s->nextEvent)
+      {
+         step_out(s);                     //cycle() runs the events and interrupts
+         b = NULL;
+         continue;
+      }
+      if(b->slow)
+      {
+         step_out(s);
+         continue;
+      }
+      if(b->spin && s->batch && s->spinWait && (skipped = spin_forward(s, b)) != 0)
+      {
+         s->instructions += skipped * b->count;
+         s->cycles += skipped * b->cycles;
+         s->spinSkipped += skipped * b->count;
+         if(s->profile)
+            b->runs += skipped;
+         if(s->calls)
+         {
+            s->calls->node->count += skipped * b->count;
+            s->calls->node->cycles += skipped * b->cycles;
+         }
+      }
+      s->instructions += b->count;
+      cycles = s->cycles;
+      s->cycles += b->cycles;
+#ifdef ENABLE_JIT
+      if(b->native == NULL && s->engine == ENGINE_JIT && ++b->hits == JIT_THRESHOLD)
+         jit_compile(s, b);
+      if(b->native)
+         b->native(s);
+      else
+#endif
+         block_exec(s, b);
+      if(s->profile)
+      {
+         ++b->runs;
+         b->stall += (long long)(s->cycles - cycles - b->cycles);
+      }
+      if(s->calls)
+         calls_block(s, b, s->cycles - cycles);
+   }
+}
+/************* End basic-block engine *************/
+
+//Run until wakeup or the PC reaches breakpoint
+void run(State *s, unsigned int breakpoint)
+{
+#ifndef ENABLE_CACHE
+   if(s->engine != ENGINE_CYCLE)
+   {
+      run_blocks(s, breakpoint);
+      return;
+   }
+#endif
+   if(s->batch == 0)
+      cycle(s, 0);
+   while(s->wakeup == 0) 
+   {
+      if(s->pc == breakpoint) 
+         break;
+      if(s->batch && batch_stop(s))
+         break;
+      cycle(s, 0);
+   }
+}
+
+//Run without the debugger until BREAK, the final loop or a limit
+//Returns the process exit code
+static const char *stopReasons[] = {"running", "break", "halt", "error",
+   "instruction budget", "time limit", "stop address"};
+static const int stopCodes[] = {1, 0, 0, 1, 2, 3, 0};
+
+int run_batch(State *s, double timeLimit)
+{
+   double start, elapsed;
+
+   start = host_time();
+   if(timeLimit > 0)
+      s->deadline = start + timeLimit;
+   while(s->stopReason == STOP_NONE)
+   {
+      s->wakeup = 0;
+      run(s, s->stopAt);
+      if(s->stopReason == STOP_NONE && s->pc == s->stopAt)
+         s->stopReason = STOP_AT;
+   }
+   elapsed = host_time() - start;
+   if(s->uartOut)
+      fflush(s->uartOut);
+   if(s->quiet)
+      return stopCodes[s->stopReason];
+   fprintf(stderr, "mlite: %s at pc=0x%8.8x\n", stopReasons[s->stopReason], s->pc);
+   fprintf(stderr, "mlite: %llu instructions, %llu cycles, %.3f s, %.2f MIPS\n",
+      s->instructions, s->cycles, elapsed,
+      elapsed > 0 ? s->instructions / elapsed * 1e-6 : 0.0);
+   if(s->spinSkipped)
+      fprintf(stderr, "mlite: %llu of them fast-forwarded in polling loops\n", s->spinSkipped);
+   if(s->interrupts)
+      fprintf(stderr, "mlite: %llu interrupts\n", s->interrupts);
+   if(s->timing && s->instructions)
+      fprintf(stderr, "mlite: timing model CPI %.3f\n", (double)s->cycles / s->instructions);
+   return stopCodes[s->stopReason];
+}
+
+void show_state(State *s)
+{
+   int i,j;
+   printf("pid=%d userMode=%d, epc=0x%x\n", s->processId, s->userMode, s->epc);
+   for(i = 0; i < 4; ++i) 
+   {
+      printf("%2.2d ", i * 8);
+      for(j = 0; j < 8; ++j) 
+      {
+         printf("%8.8x ", s->r[i*8+j]);
+      }
+      printf("\n");
+   }
+   //printf("%8.8lx %8.8lx %8.8lx %8.8lx\n", s->pc, s->pc_next, s->hi, s->lo);
+   j = s->pc;
+   for(i = -4; i <= 8; ++i) 
+   {
+      printf("%c", i==0 ? '*' : ' ');
+      s->pc = j + i * 4;
+      cycle(s, 10);
+   }
+   s->pc = j;
+}
+
+/************* Custom instruction models *************/
+/* C models of the function_N.vhd behind the custom.aluN opcodes of the
+   projects in HDL/CUSTOM, bound by plasma_custom_project().  Each one is
+   a combinational path of comb_alu_1.vhd, so one clock by default.
+   Front ends can bind their own with plasma_set_custom(). */
+
+//tsi: unsigned max and min
+static unsigned int tsi_max(State *s, unsigned int a, unsigned int b)
+{
+   (void)s;
+   return a > b ? a : b;
+}
+
+static unsigned int tsi_min(State *s, unsigned int a, unsigned int b)
+{
+   (void)s;
+   return a < b ? a : b;
+}
+
+//tsi: (pixel - min) * beta in U(8,8), b = beta << 16 | min
+static unsigned int tsi_scale_byte(unsigned int pixel, unsigned int b)
+{
+   return ((((pixel - b) & 0xff) * (b >> 16)) >> 8) & 0xff;
+}
+
+static unsigned int tsi_scale(State *s, unsigned int a, unsigned int b)
+{
+   (void)s;
+   return tsi_scale_byte(a & 0xff, b);
+}
+
+//tsi: min and max of four packed pixels, b = min << 8 | max
+static unsigned int tsi_min_max4(State *s, unsigned int a, unsigned int b)
+{
+   unsigned int min = (b >> 8) & 0xff, max = b & 0xff, pixel;
+   int shift;
+
+   (void)s;
+   for(shift = 0; shift < 32; shift += 8)
+   {
+      pixel = (a >> shift) & 0xff;
+      min = pixel < min ? pixel : min;
+      max = pixel > max ? pixel : max;
+   }
+   return min << 8 | max;
+}
+
+static unsigned int tsi_scale4(State *s, unsigned int a, unsigned int b)
+{
+   unsigned int result = 0;
+   int shift;
+
+   (void)s;
+   for(shift = 0; shift < 32; shift += 8)
+      result |= tsi_scale_byte((a >> shift) & 0xff, b) << shift;
+   return result;
+}
+
+/* mandelbrot: the steps of Convergence_opt() in main.c, Q(13,18) with
+   64-bit products as in Convergence().  The function_6..8.vhd in the
+   tree are adder placeholders; these model what the firmware expects. */
+#define MANDELBROT_NF 18
+
+static unsigned int mandelbrot_y(State *s, unsigned int x, unsigned int y)
+{
+   (void)s;
+   return (unsigned int)(2 * (((long long)(int)x * (int)y) >> MANDELBROT_NF));
+}
+
+static unsigned int mandelbrot_x(State *s, unsigned int x, unsigned int y)
+{
+   (void)s;
+   return (unsigned int)((int)(((long long)(int)x * (int)x) >> MANDELBROT_NF) -
+                         (int)(((long long)(int)y * (int)y) >> MANDELBROT_NF));
+}
+
+static unsigned int mandelbrot_mod2(State *s, unsigned int x, unsigned int y)
+{
+   (void)s;
+   return (unsigned int)((int)(((long long)(int)x * (int)x) >> MANDELBROT_NF) +
+                         (int)(((long long)(int)y * (int)y) >> MANDELBROT_NF));
+}
+
+typedef struct
+{
+   const char *project;       //directory in HDL/CUSTOM
+   int index;                 //custom.aluN
+   CustomOp op;
+   int latency;
+} CustomModel;
+
+static const CustomModel customModels[] = {
+   {"tsi", 1, tsi_max, 1},
+   {"tsi", 2, tsi_min, 1},
+   {"tsi", 3, tsi_scale, 1},
+   {"tsi", 4, tsi_min_max4, 1},
+   {"tsi", 5, tsi_scale4, 1},
+   {"mandelbrot", 6, mandelbrot_y, 1},
+   {"mandelbrot", 7, mandelbrot_x, 1},
+   {"mandelbrot", 8, mandelbrot_mod2, 1},
+   {NULL, 0, NULL, 0}
+};
+/************* End custom instruction models *************/
+
+/************* Frame writer *************/
+/* The OLED and VGA models save their screen as binary PPM files, one per
+   frame.  Frames pass from the CPU to a writer thread through a ring, as
+   trace blocks do, so the CPU only waits when FRAME_RING are queued. */
+
+#define FRAME_RING 8
+
+typedef struct
+{
+   char *pattern;                      //file name, printf() of the frame number
+   int width, height;
+   unsigned char *ring[FRAME_RING];    //RGB, 3 bytes per pixel
+   int number[FRAME_RING];
+   int head, tail;                     //frame filled by the CPU, next to write
+   int done;
+   int frames, written;
+#ifndef WIN32
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t ready, space;
+#endif
+} FrameWriter;
+
+static void frame_save(FrameWriter *f, int slot)
+{
+   char name[1024];
+   FILE *out;
+
+   snprintf(name, sizeof(name), f->pattern, f->number[slot]);
+   out = fopen(name, "wb");
+   if(out == NULL)
+      return;
+   fprintf(out, "P6\n%d %d\n255\n", f->width, f->height);
+   fwrite(f->ring[slot], 3, (size_t)f->width * f->height, out);
+   f->written += fclose(out) == 0;
+}
+
+#ifndef WIN32
+static void *frame_thread(void *arg)
+{
+   FrameWriter *f = (FrameWriter*)arg;
+
+   pthread_mutex_lock(&f->lock);
+   for(;;)
+   {
+      while(f->tail == f->head && f->done == 0)
+         pthread_cond_wait(&f->ready, &f->lock);
+      if(f->tail == f->head)
+         break;
+      pthread_mutex_unlock(&f->lock);
+      frame_save(f, f->tail % FRAME_RING);
+      pthread_mutex_lock(&f->lock);
+      ++f->tail;
+      pthread_cond_signal(&f->space);
+   }
+   pthread_mutex_unlock(&f->lock);
+   return NULL;
+}
+#endif
+
+//The RGB buffer of the next frame, for the CPU to fill
+static unsigned char *frame_next(FrameWriter *f)
+{
+   return f->ring[f->head % FRAME_RING];
+}
+
+//Hand the filled frame to the writer
+static void frame_queue(FrameWriter *f)
+{
+   f->number[f->head % FRAME_RING] = f->frames++;
+#ifndef WIN32
+   pthread_mutex_lock(&f->lock);
+   ++f->head;
+   pthread_cond_signal(&f->ready);
+   while(f->head - f->tail >= FRAME_RING)
+      pthread_cond_wait(&f->space, &f->lock);
+   pthread_mutex_unlock(&f->lock);
+#else
+   frame_save(f, f->head % FRAME_RING);
+   ++f->head;
+   ++f->tail;
+#endif
+}
+
+/* Writer of width x height frames to pattern, a printf() format of the
+   frame number such as "oled%03d.ppm".  Returns NULL for a bad pattern */
+static FrameWriter *frame_open(const char *pattern, int width, int height)
+{
+   const char *p = strchr(pattern, '%');
+   FrameWriter *f;
+   int index;
+
+   if(p == NULL)
+      return NULL;
+   p += 1 + strspn(p + 1, "0123456789");
+   if(*p != 'd' || strchr(p, '%'))
+      return NULL;
+   f = (FrameWriter*)calloc(1, sizeof(FrameWriter));
+   f->pattern = strdup(pattern);
+   f->width = width;
+   f->height = height;
+   for(index = 0; index < FRAME_RING; ++index)
+      f->ring[index] = (unsigned char*)malloc((size_t)width * height * 3);
+#ifndef WIN32
+   pthread_mutex_init(&f->lock, NULL);
+   pthread_cond_init(&f->ready, NULL);
+   pthread_cond_init(&f->space, NULL);
+   pthread_create(&f->thread, NULL, frame_thread, f);
+#endif
+   return f;
+}
+
+//Wait for the queued frames; returns the frames written
+static int frame_close(FrameWriter *f)
+{
+   int written, index;
+
+#ifndef WIN32
+   pthread_mutex_lock(&f->lock);
+   f->done = 1;
+   pthread_cond_signal(&f->ready);
+   pthread_mutex_unlock(&f->lock);
+   pthread_join(f->thread, NULL);
+   pthread_mutex_destroy(&f->lock);
+   pthread_cond_destroy(&f->ready);
+   pthread_cond_destroy(&f->space);
+#endif
+   written = f->written;
+   for(index = 0; index < FRAME_RING; ++index)
+      free(f->ring[index]);
+   free(f->pattern);
+   free(f);
+   return written;
+}
+/************* End frame writer *************/
+
+/************* RGB OLED *************/
+/* Model of the PmodOLEDrgb_bitmap and PmodOLEDrgb_terminal controllers of
+   plasma.vhd, enabled by oled_open().  OLED_MUX picks the controller on
+   the 96x64 RGB565 screen: the terminal for OLED_MUX_TERMINAL, else the
+   bitmap.  The screen is saved as a PPM frame when it changed since the
+   last one: before a reset of the controller on screen or a switch to
+   the other one, at the first write past each interval and at
+   oled_close(). */
+
+#define OLED_WIDTH   96
+#define OLED_HEIGHT  64
+#define OLED_COLUMNS 16                //terminal: characters of 6x8 pixels
+#define OLED_ROWS    8
+
+struct Oled_s {
+   FrameWriter *out;
+   unsigned long long interval;        //clocks between frames, 0=none
+   unsigned long long nextFrame;
+   unsigned int mux;                   //OLED_MUX
+   int dirty;                          //the screen changed since the last frame
+   unsigned short bitmap[OLED_HEIGHT][OLED_WIDTH];    //PmodOLEDrgb_bitmap RAM
+   unsigned short terminal[OLED_HEIGHT][OLED_WIDTH];  //drawn by the terminal
+   unsigned short shown[OLED_HEIGHT][OLED_WIDTH];     //the last frame, black at first
+   unsigned short *pixel;              //bitmap: last write, which OLED_BITMAP_RW reads
+   int col, row;                       //terminal cursor
+   int needScroll;                     //terminal: the last character ended a row
+   int newline;                        //terminal: 0x0a or 0x0d that moved the cursor
+};
+
+/* The charmap of pmodoledrgb_charmap.vhd: six columns of eight pixels,
+   the left column in the top byte and the top pixel in its high bit */
+static const unsigned long long oledFont[256] = {
+   0x007c447c0000ULL, 0x00247c040000ULL, 0x005c54740000ULL, 0x0054547c0000ULL,
+   0x0070107c0000ULL, 0x0074545c0000ULL, 0x007c545c0000ULL, 0x004c50600000ULL,
+   0x007c547c0000ULL, 0x0074547c0000ULL, 0x081c08780000ULL, 0x00247d040000ULL,
+   0x005c55740000ULL, 0x0054557c0000ULL, 0x0070117c0000ULL, 0x0074555c0000ULL,
+   0x007c555c0000ULL, 0x004c51600000ULL, 0x007c557c0000ULL, 0x0074557c0000ULL,
+   0x007d447d0000ULL, 0x00257c050000ULL, 0x005d54750000ULL, 0x0055547d0000ULL,
+   0x0071107d0000ULL, 0x0075545d0000ULL, 0x007d545d0000ULL, 0x004d50610000ULL,
+   0xffabd5abd5ffULL, 0xfefefefefe00ULL, 0x00081c3e1c00ULL, 0x001c3e1c0800ULL,
+   0x000000000000ULL, 0x0000fa000000ULL, 0x00e000e00000ULL, 0x28fe28fe2800ULL,
+   0x2454fe544800ULL, 0xc4c810264600ULL, 0x6c926a040a00ULL, 0x0000e0000000ULL,
+   0x003844820000ULL, 0x008244380000ULL, 0x105438541000ULL, 0x10107c101000ULL,
+   0x000d0e000000ULL, 0x101010101000ULL, 0x000606000000ULL, 0x040810204000ULL,
+   0x7c8a92a27c00ULL, 0x0042fe020000ULL, 0x468a92926200ULL, 0x449292926c00ULL,
+   0x182848fe0800ULL, 0xe4a2a2a29c00ULL, 0x3c5292920c00ULL, 0x808e90a0c000ULL,
+   0x6c9292926c00ULL, 0x609292947800ULL, 0x006c6c000000ULL, 0x006d6e000000ULL,
+   0x102844820000ULL, 0x282828282800ULL, 0x824428100000ULL, 0x40808a906000ULL,
+   0x7c82ba927400ULL, 0x7e9090907e00ULL, 0xfe9292926c00ULL, 0x7c8282824400ULL,
+   0xfe8282443800ULL, 0xfe9292928200ULL, 0xfe9090908000ULL, 0x7c8292925e00ULL,
+   0xfe101010fe00ULL, 0x0082fe820000ULL, 0x0c020202fc00ULL, 0xfe1028448200ULL,
+   0xfe0202020200ULL, 0xfe403040fe00ULL, 0xfe201008fe00ULL, 0x7c8282827c00ULL,
+   0xfe9090906000ULL, 0x7c828a847a00ULL, 0xfe9098946200ULL, 0x649292924c00ULL,
+   0x8080fe808000ULL, 0xfc020202fc00ULL, 0xe0180618e000ULL, 0xfe041804fe00ULL,
+   0xc6281028c600ULL, 0xc0201e20c000ULL, 0x868a92a2c200ULL, 0x00fe82820000ULL,
+   0x402010080400ULL, 0x008282fe0000ULL, 0x204080402000ULL, 0x020202020200ULL,
+   0x00c020000000ULL, 0x042a2a2a1e00ULL, 0xfe1222221c00ULL, 0x1c2222221200ULL,
+   0x1c222212fe00ULL, 0x1c2a2a2a1800ULL, 0x107e90804000ULL, 0x182525291e00ULL,
+   0xfe1020201e00ULL, 0x0022be020000ULL, 0x020121be0000ULL, 0xfe0814220000ULL,
+   0x0082fe020000ULL, 0x3e201c201e00ULL, 0x3e1020201e00ULL, 0x1c2222221c00ULL,
+   0x3f2424241800ULL, 0x182424243f00ULL, 0x3e1020201000ULL, 0x122a2a2a2400ULL,
+   0x20fc22220400ULL, 0x3c0202043e00ULL, 0x380402043800ULL, 0x3c020c023c00ULL,
+   0x22241c122200ULL, 0x380505093e00ULL, 0x22262a322200ULL, 0x106c82820000ULL,
+   0x0000fe000000ULL, 0x0082826c1000ULL, 0x102010081000ULL, 0xaa55aa55aa55ULL,
+   0x060a1a264200ULL, 0xa2948894a200ULL, 0x605844586000ULL, 0x0804fe808000ULL,
+   0x04027c804000ULL, 0x82c6aa92c600ULL, 0xfefe7c381000ULL, 0x203e203e2000ULL,
+   0x0c9252321c00ULL, 0x0a1a2a4a8a00ULL, 0x8a4a2a1a0a00ULL, 0x282c38682800ULL,
+   0x1c22221c2200ULL, 0x101054381000ULL, 0x103854101000ULL, 0x0804fe040800ULL,
+   0x2040fe402000ULL, 0x1020100e3000ULL, 0x0c52b21c0000ULL, 0x1c2a2a2a0000ULL,
+   0x10201c201f00ULL, 0x7c92927c0000ULL, 0x621408040200ULL, 0x013e48483000ULL,
+   0x1c22223c2000ULL, 0x10203c222400ULL, 0x3c020c221c00ULL, 0x0c1424140c00ULL,
+   0x80fe80fe8000ULL, 0x7a8680867a00ULL, 0x003838380000ULL, 0x182418241800ULL,
+   0x000000000000ULL, 0x0000be000000ULL, 0x18247e242400ULL, 0x127e92824200ULL,
+   0xba444444ba00ULL, 0xd4341e34d400ULL, 0x2020f8202000ULL, 0x106aaaac1000ULL,
+   0x008000800000ULL, 0x7cbaaa827c00ULL, 0x14acac740000ULL, 0x102854284400ULL,
+   0x101010180000ULL, 0x101010100000ULL, 0x7cbab28a7c00ULL, 0x202020202000ULL,
+   0x00e0a0e00000ULL, 0x2222fa222200ULL, 0x00b8a8e80000ULL, 0x00a8a8f80000ULL,
+   0x000040800000ULL, 0x1f02021c0200ULL, 0x60f2fe80fe00ULL, 0x001818000000ULL,
+   0x000105020000ULL, 0x0048f8080000ULL, 0x649494946400ULL, 0x442854281000ULL,
+   0xe8102c440e00ULL, 0xe81020561a00ULL, 0xa8f81c244e00ULL, 0x0c12a2020400ULL,
+   0x04126c904000ULL, 0x04020214181cULL, 0xe0107c926000ULL, 0x92aafeaa9200ULL,
+   0x423c08906000ULL, 0x86887c22c200ULL, 0xe010fe10e000ULL, 0x788585864800ULL,
+   0x00e0382638e0ULL, 0x82929292fe00ULL, 0xfe00fe00fe00ULL, 0x00fe00fe0000ULL,
+   0x545454545400ULL, 0x040404040400ULL, 0x0404040e0400ULL, 0x2868aa2c2800ULL,
+   0x10fe92443800ULL, 0x3e508844be00ULL, 0x1ca262221c00ULL, 0x1c2262a21c00ULL,
+   0x1c62a2621c00ULL, 0x5ca262a21c00ULL, 0x1ca222a21c00ULL, 0x442810284400ULL,
+   0x3a4c5464b800ULL, 0x3c8242023c00ULL, 0x3c0242823c00ULL, 0x1c4282421c00ULL,
+   0x3c8202823c00ULL, 0x20104e902000ULL, 0x82feaa281000ULL, 0x7fa8a4a45800ULL,
+   0x04aa6a2a1e00ULL, 0x042a6aaa1e00ULL, 0x046aaa6a1e00ULL, 0x44aa6aaa1e00ULL,
+   0x04aa2aaa1e00ULL, 0x04eaaaea1e00ULL, 0x2e2a1e2a3a00ULL, 0x182525261400ULL,
+   0x1caa6a2a1800ULL, 0x1c2a6aaa1800ULL, 0x1c6aaa6a1800ULL, 0x1caa2aaa1800ULL,
+   0x00925e020000ULL, 0x00125e820000ULL, 0x00529e420000ULL, 0x00921e820000ULL,
+   0x0c1252fc4000ULL, 0x1e4890508e00ULL, 0x0c9252120c00ULL, 0x0c1252920c00ULL,
+   0x0c5292520c00ULL, 0x0c5292528c00ULL, 0x0c9212920c00ULL, 0x101054101000ULL,
+   0x1a242a122c00ULL, 0x1c8242041e00ULL, 0x1c0242841e00ULL, 0x1c4282441e00ULL,
+   0x1c8202841e00ULL, 0x180545891e00ULL, 0x7f2424180000ULL, 0x188505891e00ULL
+};
+
+//Hand the screen to the writer unless it shows the last frame
+static void oled_frame(Oled *o)
+{
+   unsigned char *p;
+   unsigned int color;
+   int x, y;
+
+   o->dirty = 0;
+   if(memcmp(o->shown, o->mux == OLED_MUX_TERMINAL ? o->terminal : o->bitmap,
+             sizeof(o->shown)) == 0)
+      return;
+   memcpy(o->shown, o->mux == OLED_MUX_TERMINAL ? o->terminal : o->bitmap, sizeof(o->shown));
+   p = frame_next(o->out);
+   for(y = 0; y < OLED_HEIGHT; ++y)
+   {
+      for(x = 0; x < OLED_WIDTH; ++x, p += 3)
+      {
+         color = o->shown[y][x];
+         p[0] = (unsigned char)((color >> 8 & 0xf8) | color >> 13);
+         p[1] = (unsigned char)((color >> 3 & 0xfc) | (color >> 9 & 3));
+         p[2] = (unsigned char)((color << 3 & 0xf8) | (color >> 2 & 7));
+      }
+   }
+   frame_queue(o->out);
+}
+
+//Terminal: next row, scrolling the screen up from the last one
+static void oled_newline(Oled *o)
+{
+   if(o->row < OLED_ROWS - 1)
+      ++o->row;
+   else
+   {
+      memmove(o->terminal[0], o->terminal[8], sizeof(o->terminal[0]) * (OLED_HEIGHT - 8));
+      memset(o->terminal[OLED_HEIGHT - 8], 0, sizeof(o->terminal[0]) * 8);
+   }
+}
+
+/* Terminal: the char_recv state of pmodoledrgb_terminal.vhd.  0x0a and
+   0x0d go to the next row, a pair of them only once; a character after
+   the last column goes to the next row first.  White on black */
+static void oled_char(Oled *o, unsigned int ch)
+{
+   unsigned long long glyph = oledFont[ch & 0xff];
+   int x, y;
+
+   if(ch == 0x0a || ch == 0x0d)
+   {
+      o->col = 0;
+      if(o->newline && o->newline != (int)ch)
+      {
+         o->newline = 0;
+         return;
+      }
+      o->newline = ch;
+      o->needScroll = 0;
+      oled_newline(o);
+      return;
+   }
+   o->newline = 0;
+   if(o->needScroll)
+      oled_newline(o);
+   for(x = 0; x < 6; ++x)
+   {
+      for(y = 0; y < 8; ++y)
+         o->terminal[o->row * 8 + y][o->col * 6 + x] =
+            (unsigned short)(glyph >> (47 - x * 8 - y) & 1 ? 0xffff : 0);
+   }
+   o->needScroll = o->col == OLED_COLUMNS - 1;
+   o->col = (o->col + 1) % OLED_COLUMNS;
+}
+
+/* Writes to the OLED registers; 0 for other addresses and OLED_MUX,
+   which reads back from its latch.  Either reset saves the screen it
+   leaves, and so does a switch; the bitmap RAM survives its reset */
+static int oled_write(State *s, unsigned int address, unsigned int value)
+{
+   Oled *o = s->oled;
+   unsigned int col;
+
+   if(o->interval && s->cycles >= o->nextFrame)
+   {
+      if(o->dirty)
+         oled_frame(o);
+      o->nextFrame = s->cycles + o->interval;
+   }
+   switch(address)
+   {
+   case OLED_MUX:
+      if(o->dirty && o->mux != value)
+         oled_frame(o);
+      o->mux = value;
+      return 0;
+   case OLED_TERMINAL_RST:
+   case OLED_BITMAP_RST:
+      if(o->dirty && (o->mux == OLED_MUX_TERMINAL) == (address == OLED_TERMINAL_RST))
+         oled_frame(o);
+      if(address == OLED_TERMINAL_RST)
+      {
+         memset(o->terminal, 0, sizeof(o->terminal));
+         o->col = o->row = o->needScroll = o->newline = 0;
+         o->dirty |= o->mux == OLED_MUX_TERMINAL;
+      }
+      return 1;
+   case OLED_TERMINAL_RW:
+      if(value & 0x01000000)
+      {
+         memset(o->terminal, 0, sizeof(o->terminal));
+         o->col = o->row = o->needScroll = 0;
+      }
+      else
+         oled_char(o, value);
+      o->dirty |= o->mux == OLED_MUX_TERMINAL;
+      return 1;
+   case OLED_BITMAP_RW:
+      col = value & 0x7f;
+      o->pixel = &o->bitmap[value >> 8 & 0x3f][col < OLED_WIDTH ? col : col - 64];
+      *o->pixel = (unsigned short)(value >> 16);
+      o->dirty |= o->mux != OLED_MUX_TERMINAL;
+      return 1;
+   }
+   return 0;
+}
+
+/* Reads of the OLED registers; 0 for other addresses, which stay
+   latches.  The terminal is always ready */
+static int oled_read(State *s, unsigned int address, unsigned int *value)
+{
+   Oled *o = s->oled;
+
+   *value = 0;
+   switch(address)
+   {
+   case OLED_TERMINAL_RST:
+   case OLED_BITMAP_RST:
+      if(s->peek)
+         s->peekFailed = 1;
+      else
+         oled_write(s, address, 0);
+      return 1;
+   case OLED_TERMINAL_RW:
+      *value = 1;
+      return 1;
+   case OLED_BITMAP_RW:
+      *value = o->pixel ? *o->pixel : 0;
+      return 1;
+   }
+   return 0;
+}
+
+/* Model the OLED, saving frames to pattern, see frame_open(), and one
+   every interval clocks the screen changes (0 for resets only).
+   Returns NULL for a bad pattern */
+Oled *oled_open(const char *pattern, unsigned long long interval)
+{
+   FrameWriter *out = frame_open(pattern, OLED_WIDTH, OLED_HEIGHT);
+   Oled *o;
+
+   if(out == NULL)
+      return NULL;
+   o = (Oled*)calloc(1, sizeof(Oled));
+   o->out = out;
+   o->interval = interval;
+   o->nextFrame = interval;
+   return o;
+}
+
+//Save the last frame and wait for the writer; returns the frames written
+int oled_close(Oled *o)
+{
+   int written;
+
+   if(o->dirty)
+      oled_frame(o);
+   written = frame_close(o->out);
+   free(o);
+   return written;
+}
+/************* End RGB OLED *************/
+
+/************* VGA framebuffer *************/
+/* The VGA_bitmap_640x480 of plasma.vhd is the window at VGA_BASE, one
+   word per pixel of which the screen shows 12 bits, red in the high
+   nibble.  The coproc_4.vhd of most HDL/CUSTOM projects streams pixels
+   into a second one through COPROC_4, see coprocVga; here both draw
+   s->vga.  vga_open() saves the screen as a PPM frame when it changed:
+   every interval clocks, when the stream wraps and at vga_close().  The
+   window stays plain host memory, so a frame compares s->vga with the
+   last one row by row and converts only the rows that differ. */
+
+#define VGA_WIDTH  640
+#define VGA_HEIGHT 480
+
+struct Vga_s {
+   FrameWriter *out;
+   unsigned long long interval;        //clocks between frames, 0=none
+   unsigned long long nextFrame;
+   unsigned int *shown;                //s->vga of the last frame
+   unsigned char *rgb;                 //the last frame
+   unsigned long long rows;            //rows converted
+};
+
+//Hand the screen to the writer unless it shows the last frame
+static void vga_frame(State *s)
+{
+   Vga *v = s->vgaOut;
+   const unsigned int *word;
+   unsigned int pixel;
+   unsigned char *p;
+   int x, y, rows = 0;
+
+   for(y = 0; y < VGA_HEIGHT; ++y)
+   {
+      word = (const unsigned int*)s->vga + y * VGA_WIDTH;
+      if(memcmp(word, v->shown + y * VGA_WIDTH, VGA_WIDTH * 4) == 0)
+         continue;
+      memcpy(v->shown + y * VGA_WIDTH, word, VGA_WIDTH * 4);
+      p = v->rgb + y * VGA_WIDTH * 3;
+      for(x = 0; x < VGA_WIDTH; ++x, p += 3)
+      {
+         pixel = s->big_endian ? bswap32(word[x]) : word[x];
+         p[0] = (unsigned char)((pixel >> 8 & 15) * 17);
+         p[1] = (unsigned char)((pixel >> 4 & 15) * 17);
+         p[2] = (unsigned char)((pixel & 15) * 17);
+      }
+      ++rows;
+   }
+   if(rows == 0)
+      return;
+   v->rows += rows;
+   memcpy(frame_next(v->out), v->rgb, VGA_WIDTH * VGA_HEIGHT * 3);
+   frame_queue(v->out);
+}
+
+static void vga_event(State *s, int arg)
+{
+   Vga *v = s->vgaOut;
+
+   (void)arg;
+   if(v == NULL)
+      return;
+   vga_frame(s);
+   v->nextFrame += v->interval;
+   plasma_post(s, v->nextFrame, vga_event, 0);
+}
+
+/* Save the VGA screen to pattern, see frame_open(), and one frame every
+   interval clocks it changes (0 for the stream and vga_close() only).
+   Call after snapshot_restore(), which drops the events.
+   Returns 0, or -1 for a bad pattern */
+int vga_open(State *s, const char *pattern, unsigned long long interval)
+{
+   FrameWriter *out = frame_open(pattern, VGA_WIDTH, VGA_HEIGHT);
+   Vga *v;
+
+   if(out == NULL)
+      return -1;
+   v = (Vga*)calloc(1, sizeof(Vga));
+   v->out = out;
+   v->interval = interval;
+   v->shown = (unsigned int*)calloc(VGA_WIDTH * VGA_HEIGHT, 4);
+   v->rgb = (unsigned char*)calloc(VGA_WIDTH * VGA_HEIGHT, 3);
+   s->vgaOut = v;
+   if(interval)
+   {
+      v->nextFrame = s->cycles + interval;
+      plasma_post(s, v->nextFrame, vga_event, 0);
+   }
+   return 0;
+}
+
+/* Save the last frame and wait for the writer; returns the frames
+   written.  rows gets the rows converted, if not NULL */
+int vga_close(State *s, unsigned long long *rows)
+{
+   Vga *v = s->vgaOut;
+   int written;
+
+   vga_frame(s);
+   written = frame_close(v->out);
+   if(rows)
+      *rows = v->rows;
+   free(v->shown);
+   free(v->rgb);
+   free(v);
+   s->vgaOut = NULL;
+   return written;
+}
+/************* End VGA framebuffer *************/
+
+/************* Streaming FIFOs *************/
+/* The FIFO_BASE registers of plasma.vhd: the CPU pops FIFO_IN at
+   FIFO_IN_DATA_READ and pushes FIFO_OUT at FIFO_OUT_DATA_WRITE.
+   plasma_set_fifo() connects them to files of big-endian words.  A word
+   arrives in FIFO_IN every rate clocks while it has room, the source
+   waiting while it is full, and one leaves FIFO_OUT every rate clocks.
+   Both catch up with s->cycles when the CPU accesses them, so the status
+   registers are a pure function of the clock for spin_forward(). */
+
+#define FIFO_DEPTH 1024                     //words, without a depth in the spec
+
+//Words that arrive in FIFO_IN or leave FIFO_OUT by clock now
+static int fifo_due(const Fifo *f, int out, unsigned long long now)
+{
+   unsigned long long n;
+   int limit = out ? f->count : f->depth - f->count < f->ahead ? f->depth - f->count : f->ahead;
+
+   if(limit == 0 || now < f->next)
+      return 0;
+   n = f->rate ? (now - f->next) / f->rate + 1 : (unsigned long long)limit;
+   return n < (unsigned long long)limit ? (int)n : limit;
+}
+
+//Catch up with s->cycles, then read ahead of FIFO_IN up to depth words
+static void fifo_advance(State *s, Fifo *f, int out)
+{
+   unsigned char word[4];
+   int n = fifo_due(f, out, s->cycles), size = f->depth * 2;
+
+   f->area += (unsigned long long)f->count * (s->cycles - f->last);
+   f->last = s->cycles;
+   f->next += (unsigned long long)n * f->rate;
+   f->moved += n;
+   if(out)
+   {
+      for(; n; --n, --f->count, f->head = (f->head + 1) % size)
+      {
+         if(f->drained)
+         {
+            --f->drained;                 //written before the snapshot, see fifo_free()
+            continue;
+         }
+         word[0] = (unsigned char)(f->ring[f->head] >> 24);
+         word[1] = (unsigned char)(f->ring[f->head] >> 16);
+         word[2] = (unsigned char)(f->ring[f->head] >> 8);
+         word[3] = (unsigned char)f->ring[f->head];
+         fwrite(word, 1, 4, f->file);
+      }
+      return;
+   }
+   f->count += n;
+   f->ahead -= n;
+   if(f->count > f->maxCount)
+      f->maxCount = f->count;
+   while(f->ahead < f->depth && f->eof == 0)
+   {
+      if(fread(word, 1, 4, f->file) != 4)
+         f->eof = 1;
+      else
+         f->ring[(f->head + f->count + f->ahead++) % size] =
+            (unsigned int)word[0] << 24 | word[1] << 16 | word[2] << 8 | word[3];
+   }
+}
+
+static unsigned int fifo_read(State *s, unsigned int address, int size)
+{
+   unsigned int offset = address & PAGE_MASK, value;
+   int out = (offset >> 4) & 1, count;
+   Fifo *f = s->fifo[out];
+
+   if(offset > (FIFO_IN_DATA_READ & PAGE_MASK) || f == NULL)
+      return io_read(s, address, size);
+   if(s->peek)
+   {
+      if(offset == (FIFO_IN_DATA_READ & PAGE_MASK))
+      {
+         s->peekFailed = 1;
+         return 0;
+      }
+      count = out ? f->count - fifo_due(f, 1, s->cycles) : f->count + fifo_due(f, 0, s->cycles);
+   }
+   else
+   {
+      fifo_advance(s, f, out);
+      count = f->count;
+   }
+   switch(offset & 0xf0)
+   {
+   case 0x00:
+   case 0x10:
+      return count == 0;
+   case 0x20:
+   case 0x30:
+      return count == f->depth;
+   case 0x40:
+   case 0x50:
+      return count != 0;
+   case 0x60:
+   case 0x70:
+      return (unsigned int)count;
+   }
+   if(f->count == 0)
+   {
+      ++f->misses;
+      return 0;
+   }
+   if(f->count == f->depth && f->next < s->cycles)
+   {
+      f->waits += s->cycles - f->next;        //the source resumes now
+      f->next = s->cycles;
+   }
+   value = f->ring[f->head];
+   f->head = (f->head + 1) % (f->depth * 2);
+   --f->count;
+   ++f->words;
+   return value;
+}
+
+static void fifo_write(State *s, unsigned int address, unsigned int value, int size)
+{
+   Fifo *f = s->fifo[1];
+
+   if((address & PAGE_MASK) != (FIFO_OUT_DATA_WRITE & PAGE_MASK) || f == NULL)
+   {
+      io_write(s, address, value, size);
+      return;
+   }
+   fifo_advance(s, f, 1);
+   if(f->count == f->depth)
+   {
+      ++f->misses;                            //dropped, as the HDL FIFO does
+      return;
+   }
+   if(f->count == 0)
+      f->next = s->cycles + f->rate;
+   f->ring[(f->head + f->count++) % (f->depth * 2)] = value;
+   if(f->count > f->maxCount)
+      f->maxCount = f->count;
+   ++f->words;
+}
+
+//Drain FIFO_OUT into its file and close both
+static void fifo_free(State *s)
+{
+   int out;
+
+   for(out = 0; out < 2; ++out)
+   {
+      if(s->fifo[out] == NULL)
+         continue;
+      if(out)
+      {
+         s->fifo[1]->rate = 0;
+         s->fifo[1]->next = 0;
+         fifo_advance(s, s->fifo[1], 1);
+      }
+      if(s->fifo[out]->file != stdin && s->fifo[out]->file != stdout)
+         fclose(s->fifo[out]->file);
+      free(s->fifo[out]->ring);
+      free(s->fifo[out]);
+      s->fifo[out] = NULL;
+   }
+}
+
+//Words, misses, occupancy and throughput of the connected FIFOs
+void fifo_report(State *s, FILE *info)
+{
+   const Fifo *f;
+   int out;
+
+   for(out = 0; out < 2; ++out)
+   {
+      f = s->fifo[out];
+      if(f == NULL)
+         continue;
+      fprintf(info, "%s: %llu words %s, %llu %s, occupancy %.1f average %d max of %d, "
+         "%.0f words/s\n", out ? "FIFO_OUT" : "FIFO_IN", f->words, out ? "written" : "read",
+         f->misses, out ? "dropped while full" : "reads while empty",
+         f->last ? (double)f->area / f->last : 0.0, f->maxCount, f->depth,
+         s->cycles ? (double)f->words * CLOCK_HZ / s->cycles : 0.0);
+      if(out == 0)
+         fprintf(info, "FIFO_IN: source waited %llu clocks for room, %s\n",
+            f->waits, f->eof && f->ahead == 0 ? "at end of file" : "more to come");
+   }
+}
+/************* End streaming FIFOs *************/
+
+/************* Buttons and switches *************/
+/* buttons.vhd and the switches of ctrl_SL.vhd driven by a script of
+   timestamped events, see plasma_set_input().  Each access to either
+   buttons register latches the inputs: BUTTONS_CHANGE returns what
+   changed between the two accesses before it.  For every event the
+   report gives the clock the firmware read it and the clock it next
+   polled BUTTONS_CHANGE with nothing new, so a replayed session times
+   the work each button press causes. */
+
+#define INPUT_BUTTONS  0
+#define INPUT_SWITCHES 1
+
+typedef struct
+{
+   unsigned long long when;   //clock
+   int kind;                  //INPUT_BUTTONS or INPUT_SWITCHES
+   unsigned int value;
+   unsigned long long seen;   //clock of the first read after it, 0=never
+   unsigned long long idle;   //clock of the next BUTTONS_CHANGE poll reading 0
+} InputEvent;
+
+struct Input_s
+{
+   InputEvent *list;
+   int count, next;           //next: first event not applied yet
+   int unseen[2];             //first event that kind has not read, by kind
+   int busy;                  //first event without idle
+   unsigned int buttons;      //btnC..btnR now
+   unsigned int buffer;       //at the last access
+   unsigned int change;       //buttons xor buffer at the last access
+   unsigned int switches;     //SW
+};
+
+//Apply the due events and post the next one
+static void input_event(State *s, int arg)
+{
+   Input *in = s->input;
+   InputEvent *e;
+
+   (void)arg;
+   for(; in->next < in->count && in->list[in->next].when <= s->cycles; ++in->next)
+   {
+      e = &in->list[in->next];
+      if(e->kind == INPUT_BUTTONS)
+         in->buttons = e->value;
+      else
+         in->switches = e->value;
+   }
+   if(in->next < in->count)
+      plasma_post(s, in->list[in->next].when, input_event, 0);
+}
+
+//The firmware read the registers of kind, or polled BUTTONS_CHANGE with nothing new
+static void input_mark(Input *in, unsigned long long now, int kind, int idle)
+{
+   InputEvent *e;
+
+   for(e = in->list + in->unseen[kind]; e < in->list + in->next; ++e)
+   {
+      if(e->kind == kind)
+         e->seen = now;
+   }
+   in->unseen[kind] = in->next;
+   if(idle == 0)
+      return;
+   for(e = in->list + in->busy; e < in->list + in->next; ++e)
+      e->idle = now;
+   in->busy = in->next;
+}
+
+//Returns 1 with *value for the registers modelled
+static int input_read(State *s, unsigned int address, unsigned int *value)
+{
+   Input *in = s->input;
+
+   if(address == CTRL_SL_RW)
+   {
+      if(in->unseen[INPUT_SWITCHES] < in->next)
+         input_mark(in, s->cycles, INPUT_SWITCHES, 0);
+      *value = in->switches;
+      return 1;
+   }
+   if(address != BUTTONS_VALUES && address != BUTTONS_CHANGE)
+      return 0;
+   if(s->peek)
+   {
+      if(in->change || in->buffer != in->buttons)
+      {
+         s->peekFailed = 1;               //latches a change, polls after it are pure
+         s->peekLater = 1;
+      }
+      else                                //the first probe reads when the real poll would
+         input_mark(in, s->cycles, INPUT_BUTTONS, address == BUTTONS_CHANGE);
+      *value = address == BUTTONS_CHANGE ? 0 : in->buttons;
+      return 1;
+   }
+   *value = address == BUTTONS_CHANGE ? in->change : in->buttons;
+   in->change = in->buttons ^ in->buffer;
+   in->buffer = in->buttons;
+   input_mark(in, s->cycles, INPUT_BUTTONS,
+              address == BUTTONS_CHANGE && *value == 0 && in->change == 0);
+   return 1;
+}
+
+static void input_free(Input *in)
+{
+   if(in == NULL)
+      return;
+   free(in->list);
+   free(in);
+}
+
+/* Drive the buttons and switches from a script: one event per line,
+   "ms btn buttons" or "ms sw value", ms of emulated time since reset
+   or +ms after the previous event, buttons letters of CUDLR or '-' for
+   none, value a C number for the 16 switches, '#' starts a comment.
+      0      sw  0x0001
+      200    btn C
+      +50    btn -
+   Returns 0, -1 when the file can't be opened or the number of the
+   first bad line */
+int plasma_set_input(State *s, const char *name)
+{
+   FILE *file = fopen(name, "r");
+   char line[256], time[64], kind[16], value[64], *end;
+   unsigned long long last = 0;
+   InputEvent *e;
+   Input *in;
+   int number = 0, bad = 0;
+   double ms;
+
+   if(file == NULL)
+      return -1;
+   in = (Input*)calloc(1, sizeof(Input));
+   while(bad == 0 && fgets(line, sizeof(line), file))
+   {
+      bad = ++number;
+      if((end = strchr(line, '#')) != NULL)
+         *end = 0;
+      if(sscanf(line, "%63s %15s %63s", time, kind, value) != 3)
+      {
+         if(sscanf(line, "%63s", time) != 1)
+            bad = 0;                      //blank line
+         continue;
+      }
+      ms = strtod(time + (time[0] == '+'), &end);
+      if(*end || ms < 0)
+         continue;
+      if((in->count & 63) == 0)
+         in->list = (InputEvent*)realloc(in->list, sizeof(InputEvent) * (in->count + 64));
+      e = &in->list[in->count];
+      memset(e, 0, sizeof(InputEvent));
+      e->when = (time[0] == '+' ? last : 0) + (unsigned long long)(ms * CLOCK_HZ / 1000);
+      e->kind = strcmp(kind, "sw") == 0 ? INPUT_SWITCHES : INPUT_BUTTONS;
+      if(e->kind == INPUT_SWITCHES)
+         e->value = (unsigned int)strtoul(value, &end, 0) & 0xffff;
+      else if(strcmp(value, "-") == 0)
+         end = value + 1;
+      else
+      {
+         for(end = value; *end && strchr("CUDLR", *end); ++end)
+            e->value |= 1 << (strchr("CUDLR", *end) - "CUDLR");
+      }
+      if(*end || e->when < last || (e->kind == INPUT_BUTTONS && strcmp(kind, "btn")))
+         continue;
+      last = e->when;
+      ++in->count;
+      bad = 0;
+   }
+   fclose(file);
+   if(bad)
+   {
+      input_free(in);
+      return bad;
+   }
+   input_free(s->input);
+   s->input = in;
+   snapshot_resume(s);
+   if(in->next < in->count)
+      plasma_post(s, in->list[in->next].when, input_event, 0);
+   return 0;
+}
+
+//Per event: when the firmware read it and when it polled the buttons again
+void input_report(State *s, FILE *info)
+{
+   const Input *in = s->input;
+   const InputEvent *e;
+   double ms = 1000.0 / CLOCK_HZ, total = 0, worst = 0;
+   int polled = 0;
+
+   for(e = in->list; e < in->list + in->next; ++e)
+   {
+      fprintf(info, "input: %10.3f ms %-3s 0x%4.4x", e->when * ms,
+         e->kind == INPUT_SWITCHES ? "sw" : "btn", e->value);
+      if(e->seen)
+         fprintf(info, ", read after %.3f ms", (e->seen - e->when) * ms);
+      else
+         fprintf(info, ", never read");
+      if(e->idle)
+      {
+         fprintf(info, ", polling again after %.3f ms", (e->idle - e->when) * ms);
+         total += (e->idle - e->when) * ms;
+         if((e->idle - e->when) * ms > worst)
+            worst = (e->idle - e->when) * ms;
+         ++polled;
+      }
+      fprintf(info, "\n");
+   }
+   fprintf(info, "input: %d of %d events applied, %d answered: %.3f ms average, %.3f ms max\n",
+      in->next, in->count, polled, polled ? total / polled : 0.0, worst);
+}
+/************* End buttons and switches *************/
+
+/************* PWM audio *************/
+/* ctrl_pwm.vhd: CTRL_PWM_RW stores 8-bit samples from address 0 up to
+   PWM_MAX_ADDR, the first access to CTRL_RW starts playback and
+   CTRL_ETAT selects the state (high nibble: 0xA stop, 0xF forward, 0xB
+   backward, else pause) and the volume (low nibble 1..6 keeps the top
+   2..7 bits).  Every period clocks the duty cycle takes the next sample;
+   they go to an 8-bit WAV file from the start of playback.  Samples are
+   worked out lazily when the firmware touches the controller and at the
+   end of the run.  Playing an address not written since the reset is an
+   underrun: the firmware did not keep up. */
+
+#define PWM_MAX_ADDR 38423            //generics of top_plasma.vhd
+#define PWM_FREQ     1134             //a sample every PWM_FREQ + 1 clocks
+#define PWM_STOP     0xA
+#define PWM_FORWARD  0xF
+#define PWM_BACKWARD 0xB
+
+struct Pwm_s
+{
+   FILE *file;                        //WAV, the sizes patched by pwm_close(); NULL: none
+   int period;                        //clocks per sample
+   int rate;                          //Hz in the WAV header
+   unsigned char ram[PWM_MAX_ADDR + 1];
+   int writeAddr;                     //compteur_addr
+   int filled;                        //addresses written since the reset
+   int playAddr;                      //compteur_addr1
+   int reading;                       //CTRL_RW accessed since the reset
+   unsigned int etat;                 //CTRL_ETAT: state and volume
+   unsigned long long next;           //clock of the next sample
+   unsigned long long samples;        //written to the file
+   unsigned long long underruns;
+   unsigned long long firstUnderrun;  //clock
+   int lead;                          //fewest samples written ahead of forward playback
+   unsigned char buffer[4096];
+   int used;
+};
+
+static void pwm_flush(Pwm *p)
+{
+   if(p->file)
+      fwrite(p->buffer, 1, p->used, p->file);
+   p->used = 0;
+}
+
+//Play the samples due by s->cycles
+static void pwm_advance(State *s)
+{
+   Pwm *p = s->pwm;
+   unsigned int volume = p->etat & 0xf, state = p->etat >> 4;
+   unsigned char level;
+
+   for(; p->next <= s->cycles; p->next += p->period)
+   {
+      level = p->ram[p->playAddr];
+      if(volume >= 1 && volume <= 6)
+         level >>= 7 - volume;            //NB_TICKS
+      if(p->reading == 0)
+         continue;
+      p->buffer[p->used++] = level;
+      if(p->used == sizeof(p->buffer))
+         pwm_flush(p);
+      ++p->samples;
+      if(state == PWM_STOP)
+         p->playAddr = 0;
+      else if(state == PWM_FORWARD || state == PWM_BACKWARD)
+      {
+         if(p->playAddr >= p->filled && p->underruns++ == 0)
+            p->firstUnderrun = p->next;
+         else if(state == PWM_FORWARD && p->filled - p->playAddr < p->lead)
+            p->lead = p->filled - p->playAddr;
+         if(state == PWM_FORWARD)
+            p->playAddr = p->playAddr >= PWM_MAX_ADDR - 1 ? 0 : p->playAddr + 1;
+         else
+            p->playAddr = p->playAddr == 0 ? PWM_MAX_ADDR - 1 : p->playAddr - 1;
+      }
+   }
+}
+
+//Returns 1 when address belongs to the controller
+static int pwm_access(State *s, unsigned int address, unsigned int value, int write)
+{
+   Pwm *p = s->pwm;
+
+   if(address != CTRL_PWM_RST && address != CTRL_PWM_RW && address != CTRL_RW &&
+      address != CTRL_ETAT)
+      return 0;
+   if(write == 0 && (address == CTRL_PWM_RW || address == CTRL_ETAT))
+      return 0;                           //no read back, see periph_read()
+   if(s->peek)
+   {
+      s->peekFailed = 1;
+      return 1;
+   }
+   pwm_advance(s);
+   switch(address)
+   {
+   case CTRL_PWM_RST:
+      p->writeAddr = p->filled = p->playAddr = p->reading = 0;
+      p->next = s->cycles + p->period;
+      break;
+   case CTRL_PWM_RW:
+      p->ram[p->writeAddr] = (unsigned char)value;
+      if(p->writeAddr >= p->filled)
+         p->filled = p->writeAddr + 1;
+      if(p->writeAddr < PWM_MAX_ADDR)
+         ++p->writeAddr;
+      break;
+   case CTRL_RW:
+      p->reading = 1;
+      break;
+   case CTRL_ETAT:
+      p->etat = value & 0xff;
+      break;
+   }
+   return 1;
+}
+
+/* Write the PWM samples to the WAV file name from the first access to
+   CTRL_RW.  rate in Hz sets the sample clock, 0 for the FREQ generic of
+   the board.  A NULL name models the controller without a file, so that
+   snapshot_save() keeps its state.  Returns 0, or -1 when the file can't
+   be created */
+int pwm_open(State *s, const char *name, int rate)
+{
+   FILE *file = NULL;
+   Pwm *p;
+
+   if(name && (file = fopen(name, "wb")) == NULL)
+      return -1;
+   p = (Pwm*)calloc(1, sizeof(Pwm));
+   p->file = file;
+   p->period = rate > 0 ? (CLOCK_HZ + rate / 2) / rate : PWM_FREQ + 1;
+   if(p->period < 1)
+      p->period = 1;
+   p->rate = (CLOCK_HZ + p->period / 2) / p->period;
+   p->etat = PWM_STOP << 4;               //the default of etat
+   p->next = s->cycles + p->period;
+   p->lead = PWM_MAX_ADDR + 1;
+   if(file)
+      fwrite(p->buffer, 1, 44, file);     //header, see pwm_close()
+   s->pwm = p;
+   snapshot_resume(s);
+   return 0;
+}
+
+//Samples, underruns and how far ahead of playback the firmware stayed
+void pwm_report(State *s, FILE *info)
+{
+   Pwm *p = s->pwm;
+
+   pwm_advance(s);
+   fprintf(info, "PWM: %llu samples at %d Hz (%.3f s), %llu underruns", p->samples, p->rate,
+      (double)p->samples / p->rate, p->underruns);
+   if(p->underruns)
+      fprintf(info, ", the first at %.3f ms", p->firstUnderrun * 1000.0 / CLOCK_HZ);
+   else if(p->lead <= PWM_MAX_ADDR)
+      fprintf(info, ", the writer at least %d samples (%.3f ms) ahead of forward playback",
+         p->lead, p->lead * 1000.0 / p->rate);
+   fprintf(info, "\n");
+}
+
+//Finish the WAV file
+static void pwm_close(State *s)
+{
+   static const unsigned char format[16] = {1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 8, 0};
+   Pwm *p = s->pwm;
+   unsigned char header[44];
+   unsigned int size;
+   int index;
+
+   pwm_advance(s);
+   pwm_flush(p);
+   size = (unsigned int)p->samples;
+   memcpy(header, "RIFF....WAVEfmt \x10\0\0\0", 20);
+   memcpy(header + 20, format, 16);
+   memcpy(header + 36, "data", 4);
+   for(index = 0; index < 4; ++index)
+   {
+      header[4 + index] = (unsigned char)((size + 36 + (size & 1)) >> index * 8);
+      header[24 + index] = header[28 + index] = (unsigned char)(p->rate >> index * 8);
+      header[40 + index] = (unsigned char)(size >> index * 8);
+   }
+   if(p->file)
+   {
+      if(size & 1)
+         fputc(0, p->file);               //RIFF chunks are padded to even sizes
+      fseek(p->file, 0, SEEK_SET);
+      fwrite(header, 1, sizeof(header), p->file);
+      fclose(p->file);
+   }
+   free(p);
+   s->pwm = NULL;
+}
+/************* End PWM audio *************/
+
+/************* Coprocessor models *************/
+/* C models of the coproc_n.vhd of the projects in HDL/CUSTOM, bound to
+   COPROC_1..4 by plasma_coproc_project().  In the HDL each access to
+   COPROC_n_RST pulses reset, each write to COPROC_n_RW pulses
+   INPUT_1_valid and reads of COPROC_n_RW return OUTPUT_1.  With timing
+   a write waits until the coprocessor accepts it and a read until the
+   output of the last write is ready, see periph_read(). */
+
+//tsi: min and max of four packed pixels; reg[0] = min << 8 | max
+static void minmax_reset(Coproc *c)
+{
+   c->reg[0] = 0xff << 8;
+   c->output = c->reg[0];
+}
+
+static void minmax_write(Coproc *c, unsigned int value, unsigned long long now)
+{
+   (void)now;
+   c->reg[0] = tsi_min_max4(NULL, value, c->reg[0]);
+   c->output = c->reg[0];
+}
+
+/* tsi: the first write after reset is min << 8 | max, the next ones four
+   packed pixels to scale; reg[0] = 1 until the first write, reg[1] is
+   beta << 16 | min for tsi_scale4() */
+static void scale_reset(Coproc *c)
+{
+   c->reg[0] = 1;
+   c->reg[1] = 0;
+   c->output = 0;
+}
+
+static void scale_write(Coproc *c, unsigned int value, unsigned long long now)
+{
+   unsigned int min = (value >> 8) & 0xff, range = (value - min) & 0xff;
+
+   (void)now;
+   if(c->reg[0])
+   {
+      c->reg[0] = 0;
+      c->reg[1] = (range ? (255 << 8) / range : 0xffff) << 16 | min;
+      c->output = value;
+   }
+   else
+      c->output = tsi_scale4(NULL, value, c->reg[1]);
+}
+
+//The template of every project: OUTPUT_1 = INPUT_1 + 3
+static void add3_reset(Coproc *c)
+{
+   c->output = 0;
+}
+
+static void add3_write(Coproc *c, unsigned int value, unsigned long long now)
+{
+   (void)now;
+   c->output = value + 3;
+}
+
+/* ray_tracer_v3: R0*R1 + R2*R3 + R4*R5 over the last six writes, Q(21,11)
+   products; reg[0] is the last write (R0) */
+#define RAY_NF 11
+
+static void dot3_reset(Coproc *c)
+{
+   memset(c->reg, 0, sizeof(c->reg));
+   c->output = 0;
+}
+
+static void dot3_write(Coproc *c, unsigned int value, unsigned long long now)
+{
+   unsigned int sum = 0;
+   int index;
+
+   (void)now;
+   memmove(c->reg + 1, c->reg, 5 * sizeof(c->reg[0]));
+   c->reg[0] = value;
+   for(index = 0; index < 6; index += 2)
+      sum += (unsigned int)(((long long)(int)c->reg[index] * (int)c->reg[index + 1]) >> RAY_NF);
+   c->output = sum;
+}
+
+/* mandelbrot: Iterator.vhd takes x0 then y0 in Q(13,18) and, if done,
+   starts two clocks after y0, one iteration per clock up to 255.  The
+   output is done << 31 | iterations; the firmware polls it, so reads never
+   wait.  reg[0] = x0, reg[1] = y0, reg[2] = writes of the pair, reg[3] =
+   iterations, c->ready = clock of done */
+static void mandelbrot_reset(Coproc *c)
+{
+   memset(c->reg, 0, sizeof(c->reg));
+   c->output = 1u << 31;
+   c->ready = 0;
+}
+
+static void mandelbrot_write(Coproc *c, unsigned int value, unsigned long long now)
+{
+   unsigned int x = 0, y = 0, xx = 0, yy = 0, iters = 0;
+
+   c->reg[0] = c->reg[1];
+   c->reg[1] = value;
+   if(++c->reg[2] < 2)
+      return;
+   c->reg[2] = 0;
+   if(now < c->ready)
+      return;                 //busy: Iterator.vhd drops the pair
+   while(iters < 255 && (int)(xx + yy) < (4 << MANDELBROT_NF))
+   {
+      y = mandelbrot_y(NULL, x, y) + c->reg[1];
+      x = xx - yy + c->reg[0];
+      xx = (unsigned int)(((long long)(int)x * (int)x) >> MANDELBROT_NF);
+      yy = (unsigned int)(((long long)(int)y * (int)y) >> MANDELBROT_NF);
+      ++iters;
+   }
+   c->reg[3] = iters;
+   c->output = 1u << 31 | iters;
+   c->ready = now + 3 + iters;
+}
+
+static unsigned int mandelbrot_read(Coproc *c, unsigned long long now)
+{
+   unsigned long long start = c->ready - c->reg[3] - 1;
+
+   if(now >= c->ready)
+      return c->output;
+   return now > start ? (unsigned int)(now - start) : 0;
+}
+
+/* coproc_4 with a VGA_bitmap_640x480: each write stores a pixel at a
+   counter that wraps at the end of the screen and OUTPUT_1 returns it.
+   reg[0] = counter; the greyscale one keeps 4 bits, stored as 12 */
+static void vga_reset(Coproc *c)
+{
+   c->reg[0] = 0;
+   c->output = 0;
+}
+
+static void vga_pixel(Coproc *c, unsigned int pixel)
+{
+   State *s = c->s;
+
+   ((unsigned int*)s->vga)[c->reg[0]] = s->big_endian ? bswap32(pixel) : pixel;
+   if(++c->reg[0] == VGA_WIDTH * VGA_HEIGHT)
+   {
+      c->reg[0] = 0;
+      if(s->vgaOut)
+         vga_frame(s);
+   }
+   c->output = c->reg[0];
+}
+
+static void vga_write(Coproc *c, unsigned int value, unsigned long long now)
+{
+   (void)now;
+   vga_pixel(c, value & 0xfff);
+}
+
+static void vga_grey_write(Coproc *c, unsigned int value, unsigned long long now)
+{
+   (void)now;
+   vga_pixel(c, (value & 15) * 0x111);
+}
+
+static const CoprocModel coprocMinMax = {"minmax", minmax_reset, minmax_write, NULL};
+static const CoprocModel coprocScale = {"scale", scale_reset, scale_write, NULL};
+static const CoprocModel coprocAdd3 = {"add3", add3_reset, add3_write, NULL};
+static const CoprocModel coprocDot3 = {"dot3", dot3_reset, dot3_write, NULL};
+static const CoprocModel coprocMandelbrot =
+   {"iterator", mandelbrot_reset, mandelbrot_write, mandelbrot_read};
+static const CoprocModel coprocVga = {"vga", vga_reset, vga_write, NULL};
+static const CoprocModel coprocVgaGrey = {"vga_grey", vga_reset, vga_grey_write, NULL};
+
+typedef struct
+{
+   const char *project;       //directory in HDL/CUSTOM
+   int index;                 //COPROC_n
+   const CoprocModel *model;
+   int latency, interval;
+} CoprocBinding;
+
+static const CoprocBinding coprocBindings[] = {
+   {"boot_loader", 1, &coprocMinMax, 1, 1},
+   {"boot_loader", 2, &coprocScale, 1, 1},
+   {"boot_loader", 3, &coprocAdd3, 1, 1},
+   {"boot_loader", 4, &coprocVga, 1, 1},
+   {"filtre", 1, &coprocMinMax, 1, 1},
+   {"filtre", 2, &coprocScale, 1, 1},
+   {"filtre", 3, &coprocAdd3, 1, 1},
+   {"filtre", 4, &coprocVga, 1, 1},
+   {"filtre_no_fifo", 1, &coprocMinMax, 1, 1},
+   {"filtre_no_fifo", 2, &coprocScale, 1, 1},
+   {"filtre_no_fifo", 3, &coprocAdd3, 1, 1},
+   {"hello", 1, &coprocMinMax, 1, 1},
+   {"hello", 2, &coprocScale, 1, 1},
+   {"hello", 3, &coprocAdd3, 1, 1},
+   {"mandelbrot", 1, &coprocMandelbrot, 1, 1},
+   {"mandelbrot", 2, &coprocScale, 1, 1},
+   {"mandelbrot", 3, &coprocAdd3, 1, 1},
+   {"mandelbrot", 4, &coprocVgaGrey, 1, 1},
+   {"ray_tracer_v3", 1, &coprocDot3, 2, 1},
+   {"ray_tracer_v3", 3, &coprocAdd3, 1, 1},
+   {"ray_tracer_v3", 4, &coprocVga, 1, 1},
+   {"tsi", 1, &coprocMinMax, 1, 1},
+   {"tsi", 2, &coprocScale, 1, 1},
+   {"tsi", 3, &coprocAdd3, 1, 1},
+   {"tuto_plasma", 1, &coprocMinMax, 1, 1},
+   {"tuto_plasma", 2, &coprocScale, 1, 1},
+   {"tuto_plasma", 3, &coprocAdd3, 1, 1},
+   {"tuto_plasma", 4, &coprocVga, 1, 1},
+   {NULL, 0, NULL, 0, 0}
+};
+
+//The coprocessor behind a PERIPH_BASE address, or NULL for a latch
+static Coproc *coproc_find(State *s, unsigned int address)
+{
+   unsigned int index = (address - COPROC_BASE) / COPROC_STRIDE;
+
+   if(index >= COPROCS || s->coproc[index].model == NULL ||
+      (address - COPROC_BASE) % COPROC_STRIDE > 4)
+      return NULL;
+   return &s->coproc[index];
+}
+
+/* Timing: stall the CPU until clock, as the mem_pause of plasma.vhd does.
+   Device handlers only see s->cycles, like COUNTER_REG */
+static void coproc_wait(State *s, Coproc *c, unsigned long long clock)
+{
+   if(s->timing && clock > s->cycles && s->peek)
+      s->peekFailed = 1;
+   else if(s->timing && clock > s->cycles)
+   {
+      c->stalls += clock - s->cycles;
+      s->cycles = clock;
+   }
+}
+
+static unsigned int periph_read(State *s, unsigned int address, int size)
+{
+   Coproc *c = coproc_find(s, address);
+   unsigned int value;
+
+   if(c == NULL && s->oled && oled_read(s, address, &value))
+      return value;
+   if(c == NULL && s->input && input_read(s, address, &value))
+      return value;
+   if(c == NULL && s->pwm && pwm_access(s, address, 0, 0))
+      return s->peek ? 0 : io_read(s, address, size);
+   if(c == NULL)
+      return io_read(s, address, size);
+   if(((address - COPROC_BASE) % COPROC_STRIDE) == 0)
+   {
+      if(s->peek)
+      {
+         s->peekFailed = 1;
+         return 0;
+      }
+      c->model->reset(c);
+      return c->output;
+   }
+   c->reads += s->peek == 0;
+   if(c->model->read)
+      return c->model->read(c, s->cycles);
+   coproc_wait(s, c, c->ready);
+   return c->output;
+}
+
+static void periph_write(State *s, unsigned int address, unsigned int value, int size)
+{
+   Coproc *c = coproc_find(s, address);
+
+   if(c == NULL)
+   {
+      if((s->oled == NULL || oled_write(s, address, value) == 0) &&
+         (s->pwm == NULL || pwm_access(s, address, value, 1) == 0))
+         io_write(s, address, value, size);
+      return;
+   }
+   if(((address - COPROC_BASE) % COPROC_STRIDE) == 0)
+   {
+      c->model->reset(c);
+      return;
+   }
+   coproc_wait(s, c, c->accept);
+   ++c->writes;
+   c->accept = s->cycles + c->interval;
+   if(c->model->read == NULL)
+      c->ready = s->cycles + c->latency;
+   c->model->write(c, value, s->cycles);
+}
+
+//Writes, reads and stalls of the bound coprocessors
+void coproc_report(State *s, FILE *info)
+{
+   const Coproc *c;
+   int index;
+
+   for(index = 0; index < COPROCS; ++index)
+   {
+      c = &s->coproc[index];
+      if(c->model)
+         fprintf(info, "COPROC_%d %s: %llu writes, %llu reads, %llu stall clocks\n",
+            index + 1, c->model->name, c->writes, c->reads, c->stalls);
+   }
+}
+/************* End coprocessor models *************/
+
+/************* Instances *************/
+/* A State is a whole machine.  The front end sets the options in State
+   (batch, timing, engine, uartIn/uartOut, console...) between
+   plasma_create() and the first run. */
+
+State *plasma_create(void)
+{
+   State *s = (State*)calloc(1, sizeof(State));
+
+   if(s == NULL)
+      return NULL;
+   s->big_endian = 1;
+   s->budget = ~0ULL;
+   s->stopAt = 0xffffffff;
+   s->spinWait = 1;
+   memory_init(s);
+   predecode_init(s);
+   cache_init(s);
+   if(s->mem == NULL || s->vga == NULL || s->decoded == NULL)
+   {
+      plasma_destroy(s);
+      return NULL;
+   }
+   return s;
+}
+
+//Frees everything the instance owns; reports are the caller's business
+void plasma_destroy(State *s)
+{
+   if(s->blockMap)
+   {
+      block_flush(s);
+      free(s->blockMap);
+   }
+#ifdef ENABLE_JIT
+   jit_free(s);
+#endif
+   if(s->trace)
+      trace_close(s->trace);
+   if(s->oled)
+      oled_close(s->oled);
+   if(s->vgaOut)
+      vga_close(s, NULL);
+   fifo_free(s);
+   input_free(s->input);
+   if(s->pwm)
+      pwm_close(s);
+   free(s->resume);
+   if(s->calls)
+      calls_free(s->calls);
+   symbols_free(s->symbols);
+   free(s->profile);
+   cache_free(s);
+   free(s->decoded);
+   memory_free(s);
+   free(s);
+}
+
+/* Load a raw image at base and point the pc at it.  With PLASMA_BASE_AUTO
+   images linked for external RAM, which start with lui gp,0x1000, go to
+   RAM_EXTERNAL with a copy of the boot and interrupt vector in internal
+   RAM; others go to RAM_INTERNAL.  Set big_endian first.
+   Returns the bytes read, -1 when the file can't be opened */
+int plasma_load(State *s, const char *name, unsigned int base)
+{
+   FILE *in = fopen(name, "rb");
+   unsigned int word, index;
+   int bytes, autoBase = base == PLASMA_BASE_AUTO;
+
+   if(in == NULL)
+      return -1;
+   if(autoBase)
+   {
+      base = RAM_INTERNAL;
+      if(fread(&word, 4, 1, in) == 1)
+      {
+         if(s->big_endian)
+            word = ntohl(word);
+         if((word & 0xffffff00) == 0x3c1c1000)
+            base = RAM_EXTERNAL;
+      }
+      rewind(in);
+   }
+   index = mem_offset(base);
+   bytes = (int)fread(s->mem + index, 1, RAM_WINDOW - (index & (RAM_WINDOW - 1)), in);
+   if(autoBase && base == RAM_EXTERNAL)
+      memcpy(s->mem, s->mem + index, RAM_INTERNAL_SIZE);
+   fclose(in);
+   s->pc = base;
+   s->pc_next = base + 4;
+   s->skip = 0;
+   return bytes;
+}
+
+//Timing model: extra clocks per external RAM access; a data cache
+//model charges them per line instead
+void plasma_set_wait(State *s, int clocks)
+{
+   int index;
+
+   s->waitExternal = clocks;
+   for(index = 0; index < RAM_WINDOW; index += PAGE_SIZE)
+      PAGE(s, RAM_EXTERNAL + index)->wait = s->dcache ? 0 : clocks;
+}
+
+/* Add a cache model, see cache_lookup().  spec is
+   "size,line,ways[,lru|random][,wb|wt][,penalty]" with sizes in bytes
+   (a k suffix for KB), power-of-two geometry, LRU and write-back by
+   default and an automatic penalty, see cache_penalty().
+   Returns 0, or -1 for a bad spec */
+int plasma_set_cache(State *s, int data, const char *spec)
+{
+   CacheSim g;
+   char *end;
+   int *field[3], index;
+
+   memset(&g, 0, sizeof(g));
+   g.writeBack = 1;
+   g.penalty = -1;
+   field[0] = &g.size;
+   field[1] = &g.line;
+   field[2] = &g.ways;
+   for(index = 0; index < 3; ++index)
+   {
+      *field[index] = (int)strtol(spec, &end, 0);
+      if(*end == 'k' || *end == 'K')
+      {
+         *field[index] <<= 10;
+         ++end;
+      }
+      if(*field[index] <= 0 || (*field[index] & (*field[index] - 1)) ||
+         (*end != ',' && (index < 2 || *end)))
+         return -1;
+      spec = *end ? end + 1 : end;
+   }
+   while(*spec)
+   {
+      if(strncmp(spec, "lru", 3) == 0)
+         g.replace = CACHE_LRU;
+      else if(strncmp(spec, "random", 6) == 0)
+         g.replace = CACHE_RANDOM;
+      else if(strncmp(spec, "wb", 2) == 0)
+         g.writeBack = 1;
+      else if(strncmp(spec, "wt", 2) == 0)
+         g.writeBack = 0;
+      else if(isdigit((unsigned char)*spec))
+         g.penalty = atoi(spec);
+      else
+         return -1;
+      spec = strchr(spec, ',') ? strchr(spec, ',') + 1 : "";
+   }
+   if(g.line < 4 || g.size < g.line * g.ways)
+      return -1;
+   if(cache_attach(s, data, &g))
+      return -1;
+   plasma_set_wait(s, s->waitExternal);
+   return 0;
+}
+
+/* Bind custom.alu<index> to op costing latency clocks in the timing
+   model; a NULL op makes it illegal again.  Call before the first run.
+   Returns 0, or -1 for a bad index */
+int plasma_set_custom(State *s, int index, CustomOp op, int latency)
+{
+   if(index < 1 || index > CUSTOM_OPS)
+      return -1;
+   s->customCount += (op != NULL) - (s->custom[index] != NULL);
+   s->custom[index] = op;
+   s->customCost[index] = (unsigned char)(latency < 1 ? 1 : latency > 255 ? 255 : latency);
+   return 0;
+}
+
+/* Bind the models of a project, see customModels[].  spec is
+   "project[,N=clocks...]" to change the latency of custom.aluN.
+   Returns the models bound, or -1 for an unknown project or bad spec */
+int plasma_custom_project(State *s, const char *spec)
+{
+   const CustomModel *m;
+   const char *comma = strchr(spec, ',');
+   size_t length = comma ? (size_t)(comma - spec) : strlen(spec);
+   int count = 0, index;
+   char *end;
+
+   for(m = customModels; m->project; ++m)
+   {
+      if(strlen(m->project) == length && strncmp(m->project, spec, length) == 0)
+         count += plasma_set_custom(s, m->index, m->op, m->latency) == 0;
+   }
+   if(count == 0)
+      return -1;
+   while(comma)
+   {
+      index = (int)strtol(comma + 1, &end, 10);
+      if(*end != '=' || index < 1 || index > CUSTOM_OPS || s->custom[index] == NULL)
+         return -1;
+      plasma_set_custom(s, index, s->custom[index], atoi(end + 1));
+      comma = strchr(end, ',');
+   }
+   return count;
+}
+
+/* Bind COPROC_<index> to model; a write is accepted every interval
+   clocks and its output is ready latency clocks later in the timing
+   model.  A NULL model makes the registers plain latches again.
+   Returns 0, or -1 for a bad index */
+int plasma_set_coproc(State *s, int index, const CoprocModel *model, int latency, int interval)
+{
+   Coproc *c;
+
+   if(index < 1 || index > COPROCS)
+      return -1;
+   c = &s->coproc[index - 1];
+   memset(c, 0, sizeof(*c));
+   c->s = s;
+   c->model = model;
+   c->latency = latency < 1 ? 1 : latency;
+   c->interval = interval < 1 ? 1 : interval;
+   if(model)
+      model->reset(c);
+   snapshot_resume(s);
+   return 0;
+}
+
+/* Bind the coprocessors of a project, see coprocBindings[].  spec is
+   "project[,N=latency[/interval]...]" to change the timing of COPROC_N.
+   Returns the coprocessors bound, or -1 for an unknown project or bad spec */
+int plasma_coproc_project(State *s, const char *spec)
+{
+   const CoprocBinding *b;
+   const char *comma = strchr(spec, ',');
+   size_t length = comma ? (size_t)(comma - spec) : strlen(spec);
+   int count = 0, index, latency;
+   Coproc *c;
+   char *end;
+
+   for(b = coprocBindings; b->project; ++b)
+   {
+      if(strlen(b->project) == length && strncmp(b->project, spec, length) == 0)
+         count += plasma_set_coproc(s, b->index, b->model, b->latency, b->interval) == 0;
+   }
+   if(count == 0)
+      return -1;
+   while(comma)
+   {
+      index = (int)strtol(comma + 1, &end, 10);
+      if(*end != '=' || index < 1 || index > COPROCS || s->coproc[index - 1].model == NULL)
+         return -1;
+      c = &s->coproc[index - 1];
+      latency = (int)strtol(end + 1, &end, 10);
+      plasma_set_coproc(s, index, c->model, latency,
+                        *end == '/' ? (int)strtol(end + 1, &end, 10) : c->interval);
+      comma = strchr(end, ',');
+   }
+   return count;
+}
+
+/* Connect FIFO_IN (out = 0) or FIFO_OUT (out = 1) to a file of
+   big-endian words.  spec is "file[,depth[,clocks]]" with '-' for stdin
+   or stdout, FIFO_DEPTH words and a word every clock by default; clocks
+   0 moves words as fast as there is room.
+   Returns 0, or -1 for a bad spec or a file that can't be opened */
+int plasma_set_fifo(State *s, int out, const char *spec)
+{
+   const char *comma = strchr(spec, ',');
+   size_t length = comma ? (size_t)(comma - spec) : strlen(spec);
+   char name[1024];
+   Fifo *f;
+   FILE *file;
+   int depth = FIFO_DEPTH, rate = 1;
+   char *end;
+
+   if(comma)
+   {
+      depth = (int)strtol(comma + 1, &end, 0);
+      if(*end == ',')
+         rate = (int)strtol(end + 1, &end, 0);
+      if(*end || depth < 1 || rate < 0)
+         return -1;
+   }
+   if(length == 0 || length >= sizeof(name))
+      return -1;
+   memcpy(name, spec, length);
+   name[length] = 0;
+   if(strcmp(name, "-") == 0)
+      file = out ? stdout : stdin;
+   else
+      file = fopen(name, out ? "wb" : "rb");
+   if(file == NULL)
+      return -1;
+   f = (Fifo*)calloc(1, sizeof(Fifo));
+   f->file = file;
+   f->ring = (unsigned int*)malloc(sizeof(unsigned int) * depth * 2);
+   f->depth = depth;
+   f->rate = rate;
+   f->next = s->cycles + rate;
+   f->last = s->cycles;
+   s->fifo[out] = f;
+   snapshot_resume(s);
+   if(out == 0)
+      fifo_advance(s, f, 0);
+   return 0;
+}
+
+void plasma_step(State *s)
+{
+   cycle(s, 0);
+}
+
+//Run until the pc reaches address or the CPU stops; returns 1 at address
+int plasma_run_until(State *s, unsigned int address)
+{
+   s->wakeup = 0;
+   run(s, address);
+   return s->pc == (int)address;
+}
+
+unsigned int plasma_read(State *s, unsigned int address, int size)
+{
+   s->at = 0;
+   return mem_read(s, size, address);
+}
+
+//Store like the CPU does, dropping decoded code at the address
+void plasma_write(State *s, unsigned int address, unsigned int value, int size)
+{
+   s->at = 0;
+   mem_write(s, size, address, value);
+   code_invalidate(s, address);
+}
+
+/* Device handlers for whole 4 KB pages from address.  They get the exact
+   address, the access size and register values; the owner's data is in
+   s->user */
+void plasma_map_device(State *s, unsigned int address, unsigned int size,
+                       DeviceRead read, DeviceWrite write)
+{
+   page_map(s, address & ~PAGE_MASK, size + (address & PAGE_MASK), NULL, read, write);
+}
+/************* End instances *************/
+
+/************* Multi-core SoC *************/
+/* soc_create() turns a loaded State into core 0 of count cores.  Each
+   core is a full State with its own internal RAM, registers, MISC
+   registers and caches; CORE_ID_REG tells them apart.  External RAM and
+   the framebuffer are shared, with deterministic results:
+   every core runs on its own host thread for a quantum of instructions
+   against its own copy, and stores to the shared pages go to a per-core
+   log.  At the sync after each quantum the logs are replayed into every
+   copy in core order, so all copies agree again and the outcome does not
+   depend on host scheduling.  Stores by other cores become visible at the
+   next sync, as with a store buffer drained once per quantum.  Pages in
+   [privateBase, privateBase + privateSize) stay private to each core,
+   for instance the InitStack of boot.asm.  Firmware splits the work by
+   CORE_ID_REG; only one core should clear .bss.
+   UART input goes to core 0 only; the output of every core goes to core
+   0's uartOut, core by core at each sync. */
+
+#ifndef WIN32
+typedef struct
+{
+   unsigned int address, value;
+   int size;
+} SocStore;
+
+typedef struct
+{
+   State *s;
+   unsigned long long limit;          //the core's own instruction budget
+   SocStore *log;                     //shared stores of this quantum
+   int logCount, logSize;
+   unsigned long long stores;
+   char *uart;                        //UART output of this quantum
+   size_t uartSize;
+   pthread_t thread;
+} SocCore;
+
+struct Soc_s {
+   SocCore *core;
+   int count;
+   unsigned int privateBase, privateEnd;
+   unsigned long long quantum, quanta;
+   int committing;                    //replaying logs: don't log again
+   FILE *uartOut;
+   pthread_mutex_t lock;
+   pthread_cond_t start, done;
+   int generation, pending, quit;
+};
+
+static int soc_count(const Soc *soc)
+{
+   return soc ? soc->count : 1;
+}
+
+//Write hook of the shared pages
+static void soc_log(State *s, unsigned int address, unsigned int value, int size)
+{
+   SocCore *c = &s->soc->core[s->coreId];
+
+   if(s->soc->committing)
+      return;
+   if(c->logCount == c->logSize)
+   {
+      c->logSize = c->logSize ? c->logSize * 2 : 1024;
+      c->log = (SocStore*)realloc(c->log, c->logSize * sizeof(SocStore));
+   }
+   c->log[c->logCount].address = address;
+   c->log[c->logCount].value = value;
+   c->log[c->logCount++].size = size;
+   ++c->stores;
+}
+
+static void soc_share(Soc *soc, State *s)
+{
+   unsigned int index;
+
+   for(index = 0; index < RAM_WINDOW; index += PAGE_SIZE)
+   {
+      if(RAM_EXTERNAL + index < soc->privateBase || RAM_EXTERNAL + index >= soc->privateEnd)
+         PAGE(s, RAM_EXTERNAL + index)->write = soc_log;
+   }
+   for(index = 0; index < VGA_SIZE; index += PAGE_SIZE)
+      PAGE(s, VGA_BASE + index)->write = soc_log;
+}
+
+//s is loaded and configured; the other cores start as copies of it
+Soc *soc_create(State *s, int count, unsigned int privateBase, unsigned int privateSize)
+{
+   Soc *soc = (Soc*)calloc(1, sizeof(Soc));
+   State *core;
+   int index;
+
+   soc->core = (SocCore*)calloc(count, sizeof(SocCore));
+   soc->privateBase = privateBase & ~PAGE_MASK;
+   soc->privateEnd = (privateBase + privateSize + PAGE_MASK) & ~PAGE_MASK;
+   soc->core[0].s = s;
+   for(soc->count = 1; soc->count < count; ++soc->count)
+   {
+      core = plasma_create();
+      if(core == NULL)
+      {
+         soc_destroy(soc);
+         return NULL;
+      }
+      memcpy(core->mem, s->mem, MEM_SIZE);
+      memcpy(core->vga, s->vga, VGA_SIZE);
+      memcpy(core->r, s->r, sizeof(core->r));
+      core->pc = s->pc;
+      core->pc_next = s->pc_next;
+      core->skip = s->skip;
+      core->big_endian = s->big_endian;
+      core->engine = s->engine;
+      core->timing = s->timing;
+      memcpy(core->custom, s->custom, sizeof(core->custom));
+      memcpy(core->customCost, s->customCost, sizeof(core->customCost));
+      core->customCount = s->customCount;
+      for(index = 0; index < COPROCS; ++index)
+         plasma_set_coproc(core, index + 1, s->coproc[index].model,
+                           s->coproc[index].latency, s->coproc[index].interval);
+      if((s->icache && cache_attach(core, 0, s->icache)) ||
+         (s->dcache && cache_attach(core, 1, s->dcache)))
+      {
+         plasma_destroy(core);
+         soc_destroy(soc);
+         return NULL;
+      }
+      plasma_set_wait(core, s->waitExternal);
+      core->uartBaud = s->uartBaud;
+      core->batch = 1;
+      core->quiet = 1;
+      core->budget = s->budget;
+      core->stopAt = s->stopAt;
+      core->coreId = soc->count;
+      soc->core[soc->count].s = core;
+   }
+   for(index = 0; index < soc->count; ++index)
+   {
+      soc->core[index].s->soc = soc;
+      soc->core[index].limit = soc->core[index].s->budget;
+      soc_share(soc, soc->core[index].s);
+   }
+   return soc;
+}
+
+State *soc_core(Soc *soc, int index)
+{
+   return soc->core[index].s;
+}
+
+//Frees the cores made by soc_create(); core 0 goes back to a lone CPU
+void soc_destroy(Soc *soc)
+{
+   State *s;
+   unsigned int index;
+
+   if(soc == NULL)
+      return;
+   s = soc->core[0].s;
+   for(index = 1; index < (unsigned int)soc->count; ++index)
+      plasma_destroy(soc->core[index].s);
+   for(index = 0; index < (unsigned int)soc->count; ++index)
+      free(soc->core[index].log);
+   for(index = 0; index < RAM_WINDOW; index += PAGE_SIZE)
+      PAGE(s, RAM_EXTERNAL + index)->write = NULL;
+   for(index = 0; index < VGA_SIZE; index += PAGE_SIZE)
+      PAGE(s, VGA_BASE + index)->write = NULL;
+   s->soc = NULL;
+   free(soc->core);
+   free(soc);
+}
+
+//One quantum on one core, like run_batch() without the time limit
+static void soc_quantum(Soc *soc, SocCore *c)
+{
+   State *s = c->s;
+   unsigned long long end = s->instructions + soc->quantum;
+
+   if(s->stopReason != STOP_NONE)
+      return;
+   s->budget = end < c->limit ? end : c->limit;
+   while(s->stopReason == STOP_NONE)
+   {
+      s->wakeup = 0;
+      run(s, s->stopAt);
+      if(s->stopReason == STOP_NONE && s->pc == s->stopAt)
+         s->stopReason = STOP_AT;
+   }
+   if(s->stopReason == STOP_BUDGET && s->instructions < c->limit)
+      s->stopReason = STOP_NONE;         //only the quantum is used up
+}
+
+static void *soc_thread(void *arg)
+{
+   SocCore *c = (SocCore*)arg;
+   Soc *soc = c->s->soc;
+   int generation = 0;
+
+   pthread_mutex_lock(&soc->lock);
+   for(;;)
+   {
+      while(soc->generation == generation && soc->quit == 0)
+         pthread_cond_wait(&soc->start, &soc->lock);
+      if(soc->quit)
+         break;
+      generation = soc->generation;
+      pthread_mutex_unlock(&soc->lock);
+      soc_quantum(soc, c);
+      fflush(c->s->uartOut);
+      pthread_mutex_lock(&soc->lock);
+      if(--soc->pending == 0)
+         pthread_cond_signal(&soc->done);
+   }
+   pthread_mutex_unlock(&soc->lock);
+   return NULL;
+}
+
+//The sync: replay the logs into every core, then pass on the UART output
+static void soc_commit(Soc *soc)
+{
+   SocCore *c;
+   SocStore *store;
+   State *s;
+   unsigned long long cycles;
+   int index, core;
+
+   soc->committing = 1;
+   for(index = 0; index < soc->count; ++index)
+   {
+      c = &soc->core[index];
+      for(store = c->log; store < c->log + c->logCount; ++store)
+      {
+         for(core = 0; core < soc->count; ++core)
+         {
+            s = soc->core[core].s;
+            cycles = s->cycles;           //wait states were charged to the writer
+            mem_write(s, store->size, store->address, store->value);
+            code_invalidate(s, store->address);
+            s->cycles = cycles;
+         }
+      }
+      c->logCount = 0;
+      fwrite(c->uart, 1, c->uartSize, soc->uartOut);
+      fclose(c->s->uartOut);
+      free(c->uart);
+      c->s->uartOut = open_memstream(&c->uart, &c->uartSize);
+   }
+   soc->committing = 0;
+}
+
+//Returns the process exit code, that of the first core with a nonzero one
+int soc_run(Soc *soc, unsigned long long quantum, double timeLimit)
+{
+   SocCore *c;
+   State *s;
+   unsigned long long instructions = 0, cycles = 0;
+   double start, elapsed;
+   int index, running, result = 0;
+
+   soc->quantum = quantum ? quantum : 1;
+   soc->uartOut = soc->core[0].s->uartOut;
+   pthread_mutex_init(&soc->lock, NULL);
+   pthread_cond_init(&soc->start, NULL);
+   pthread_cond_init(&soc->done, NULL);
+   for(index = 0; index < soc->count; ++index)
+   {
+      c = &soc->core[index];
+      c->s->uartOut = open_memstream(&c->uart, &c->uartSize);
+      c->s->deadline = 0;
+      pthread_create(&c->thread, NULL, soc_thread, c);
+   }
+
+   start = host_time();
+   do
+   {
+      pthread_mutex_lock(&soc->lock);
+      soc->pending = soc->count;
+      ++soc->generation;
+      pthread_cond_broadcast(&soc->start);
+      while(soc->pending)
+         pthread_cond_wait(&soc->done, &soc->lock);
+      pthread_mutex_unlock(&soc->lock);
+      soc_commit(soc);
+      ++soc->quanta;
+      for(running = index = 0; index < soc->count; ++index)
+         running += soc->core[index].s->stopReason == STOP_NONE;
+      if(running && timeLimit > 0 && host_time() - start >= timeLimit)
+      {
+         for(index = 0; index < soc->count; ++index)
+         {
+            if(soc->core[index].s->stopReason == STOP_NONE)
+               soc->core[index].s->stopReason = STOP_TIME;
+         }
+         running = 0;
+      }
+   } while(running);
+   elapsed = host_time() - start;
+
+   pthread_mutex_lock(&soc->lock);
+   soc->quit = 1;
+   pthread_cond_broadcast(&soc->start);
+   pthread_mutex_unlock(&soc->lock);
+   for(index = 0; index < soc->count; ++index)
+   {
+      c = &soc->core[index];
+      pthread_join(c->thread, NULL);
+      fclose(c->s->uartOut);
+      free(c->uart);
+      c->uart = NULL;
+      c->s->uartOut = soc->uartOut;
+      c->s->budget = c->limit;
+   }
+   pthread_mutex_destroy(&soc->lock);
+   pthread_cond_destroy(&soc->start);
+   pthread_cond_destroy(&soc->done);
+   fflush(soc->uartOut);
+
+   for(index = 0; index < soc->count; ++index)
+   {
+      s = soc->core[index].s;
+      if(result == 0)
+         result = stopCodes[s->stopReason];
+      instructions += s->instructions;
+      if(s->cycles > cycles)
+         cycles = s->cycles;
+   }
+   if(soc->core[0].s->quiet)
+      return result;
+   for(index = 0; index < soc->count; ++index)
+   {
+      s = soc->core[index].s;
+      fprintf(stderr, "mlite: core %d: %s at pc=0x%8.8x, %llu instructions, "
+         "%llu cycles, %llu shared stores\n", index, stopReasons[s->stopReason], s->pc,
+         s->instructions, s->cycles, soc->core[index].stores);
+   }
+   fprintf(stderr, "mlite: %d cores, %llu quanta of %llu instructions, %.3f s, %.2f MIPS\n",
+      soc->count, soc->quanta, soc->quantum, elapsed,
+      elapsed > 0 ? instructions / elapsed * 1e-6 : 0.0);
+   if(cycles)
+      fprintf(stderr, "mlite: %llu instructions in %llu cycles of the slowest core, "
+         "%.3f instructions per cycle\n", instructions, cycles, (double)instructions / cycles);
+   return result;
+}
+#else
+static int soc_count(const Soc *soc)
+{
+   (void)soc;
+   return 1;
+}
+
+Soc *soc_create(State *s, int count, unsigned int privateBase, unsigned int privateSize)
+{
+   (void)s; (void)count; (void)privateBase; (void)privateSize;
+   fprintf(stderr, "The multi-core SoC needs a POSIX host\n");
+   return NULL;
+}
+
+State *soc_core(Soc *soc, int index)
+{
+   (void)soc; (void)index;
+   return NULL;
+}
+
+int soc_run(Soc *soc, unsigned long long quantum, double timeLimit)
+{
+   (void)soc; (void)quantum; (void)timeLimit;
+   return 1;
+}
+
+void soc_destroy(Soc *soc)
+{
+   (void)soc;
+}
+#endif
+/************* End multi-core SoC *************/
+
+/************* Symbols and profile report *************/
+#define SHT_SYMTAB    2
+#define SHF_ALLOC     2
+#define SHF_EXECINSTR 4
+#define STT_OBJECT    1
+#define STT_FUNC      2
+#define STB_GLOBAL    1
+#define PROFILE_TOP   40      //rows per table in the report
+
+static unsigned int elf_get(const unsigned char *p, int size, int big)
+{
+   unsigned int value = 0;
+   int index;
+
+   for(index = 0; index < size; ++index)
+      value |= (unsigned int)p[big ? index : size - 1 - index] << (8 * (size - 1 - index));
+   return value;
+}
+
+static unsigned int uleb128(const unsigned char **p, const unsigned char *end)
+{
+   unsigned int value = 0;
+   int shift = 0;
+
+   while(*p < end)
+   {
+      unsigned char byte = *(*p)++;
+      if(shift < 32)
+         value |= (unsigned int)(byte & 0x7f) << shift;
+      shift += 7;
+      if((byte & 0x80) == 0)
+         break;
+   }
+   return value;
+}
+
+static int sleb128(const unsigned char **p, const unsigned char *end)
+{
+   int value = 0, shift = 0;
+   unsigned char byte = 0;
+
+   while(*p < end)
+   {
+      byte = *(*p)++;
+      if(shift < 32)
+         value |= (byte & 0x7f) << shift;
+      shift += 7;
+      if((byte & 0x80) == 0)
+         break;
+   }
+   if(shift < 32 && (byte & 0x40))
+      value |= (int)(~0u << shift);
+   return value;
+}
+
+static void symbol_append(Symbol **list, int *count, unsigned int address,
+                          unsigned int size, const char *name)
+{
+   if((*count & 255) == 0)
+      *list = (Symbol*)realloc(*list, (*count + 256) * sizeof(Symbol));
+   (*list)[*count].address = address;
+   (*list)[*count].size = size;
+   (*list)[*count].name = strdup(name);
+   ++*count;
+}
+
+static void symbol_add(Symbols *sym, unsigned int address, unsigned int size,
+                       const char *name)
+{
+   symbol_append(&sym->sym, &sym->symCount, address, size, name);
+}
+
+//Data object: a global array or variable
+static void object_add(Symbols *sym, unsigned int address, unsigned int size,
+                       const char *name)
+{
+   symbol_append(&sym->obj, &sym->objCount, address, size, name);
+}
+
+static void line_add(Symbols *sym, unsigned int address, int line, int file)
+{
+   if((sym->rowCount & 1023) == 0)
+      sym->row = (LineRow*)realloc(sym->row, (sym->rowCount + 1024) * sizeof(LineRow));
+   sym->row[sym->rowCount].address = address;
+   sym->row[sym->rowCount].line = line;
+   sym->row[sym->rowCount].file = file;
+   ++sym->rowCount;
+}
+
+static int file_add(Symbols *sym, const char *name)
+{
+   if((sym->fileCount & 63) == 0)
+      sym->files = (char**)realloc(sym->files, (sym->fileCount + 64) * sizeof(char*));
+   sym->files[sym->fileCount] = strdup(name);
+   return sym->fileCount++;
+}
+
+//Run the DWARF 2-4 line number programs of a .debug_line section
+static void dwarf_lines(Symbols *sym, const unsigned char *p,
+                        const unsigned char *end, int big)
+{
+   while(end - p >= 16)
+   {
+      const unsigned char *unit = p + 4 + elf_get(p, 4, big), *op, *lengths;
+      unsigned int version, minLength, lineRange, opcodeBase, address = 0;
+      int lineBase, line = 1, file = 1, fileBase = sym->fileCount - 1;
+
+      if(elf_get(p, 4, big) >= 0xfffffff0 || unit > end)
+         break;                      //64-bit DWARF or truncated
+      version = elf_get(p + 4, 2, big);
+      op = p + 10 + elf_get(p + 6, 4, big);
+      p += 10;
+      if(version < 2 || version > 4 || op > unit)
+      {
+         p = unit;
+         continue;
+      }
+      minLength = *p++;
+      if(version >= 4)
+         ++p;                        //maximum_operations_per_instruction
+      ++p;                           //default_is_stmt
+      lineBase = (signed char)*p++;
+      lineRange = *p++;
+      opcodeBase = *p++;
+      lengths = p;
+      p += opcodeBase - 1;
+      while(p < op && *p)            //include_directories
+         p += strlen((const char*)p) + 1;
+      for(++p; p < op && *p; )       //file_names
+      {
+         file_add(sym, (const char*)p);
+         p += strlen((const char*)p) + 1;
+         uleb128(&p, op);
+         uleb128(&p, op);
+         uleb128(&p, op);
+      }
+      if(lineRange == 0)
+      {
+         p = unit;
+         continue;
+      }
+
+      for(p = op; p < unit; )
+      {
+         unsigned int code = *p++, length, index;
+         const unsigned char *next;
+
+         if(code >= opcodeBase)
+         {
+            code -= opcodeBase;
+            address += code / lineRange * minLength;
+            line += lineBase + (int)(code % lineRange);
+            line_add(sym, address, line, fileBase + file);
+            continue;
+         }
+         switch(code)
+         {
+         case 0:                     //extended opcode
+            length = uleb128(&p, unit);
+            next = p + length;
+            if(length && next <= unit)
+            {
+               switch(*p)
+               {
+               case 1:               //DW_LNE_end_sequence
+                  line_add(sym, address, 0, 0);
+                  address = 0;
+                  line = 1;
+                  file = 1;
+                  break;
+               case 2:               //DW_LNE_set_address
+                  address = elf_get(p + 1, length > 4 ? 4 : length - 1, big);
+                  break;
+               case 3:               //DW_LNE_define_file
+                  file_add(sym, (const char*)p + 1);
+                  break;
+               }
+            }
+            p = next;
+            break;
+         case 1: line_add(sym, address, line, fileBase + file); break;
+         case 2: address += uleb128(&p, unit) * minLength; break;
+         case 3: line += sleb128(&p, unit); break;
+         case 4: file = uleb128(&p, unit); break;
+         case 8: address += (255 - opcodeBase) / lineRange * minLength; break;
+         case 9: address += elf_get(p, 2, big); p += 2; break;
+         default:                    //skip the operands
+            for(index = 0; index < lengths[code - 1]; ++index)
+               uleb128(&p, unit);
+         }
+      }
+      p = unit;
+   }
+}
+
+//Function symbols and line rows of an ELF32 executable
+static int symbols_elf(Symbols *sym, const unsigned char *elf, long bytes)
+{
+   int big = elf[5] == 2, index, count;
+   unsigned int shoff, shentsize, shnum, strtab;
+   const unsigned char *sh, *names;
+
+   if(bytes < 52 || elf[4] != 1)
+      return 0;
+   shoff = elf_get(elf + 0x20, 4, big);
+   shentsize = elf_get(elf + 0x2e, 2, big);
+   shnum = elf_get(elf + 0x30, 2, big);
+   if(shentsize < 40 || shoff + (unsigned long long)shnum * shentsize > (unsigned long)bytes)
+      return 0;
+   strtab = elf_get(elf + 0x32, 2, big);
+   names = strtab < shnum ? elf + elf_get(elf + shoff + strtab * shentsize + 0x10, 4, big) : NULL;
+
+   for(index = 0; index < (int)shnum; ++index)
+   {
+      unsigned int offset, size, link;
+      sh = elf + shoff + index * shentsize;
+      offset = elf_get(sh + 0x10, 4, big);
+      size = elf_get(sh + 0x14, 4, big);
+      if((unsigned long long)offset + size > (unsigned long)bytes)
+         continue;
+      if(names && strcmp((const char*)names + elf_get(sh, 4, big), ".debug_line") == 0)
+         dwarf_lines(sym, elf + offset, elf + offset + size, big);
+      if(elf_get(sh + 4, 4, big) != SHT_SYMTAB)
+         continue;
+      link = elf_get(sh + 0x18, 4, big);
+      if(link >= shnum)
+         continue;
+      for(count = 16; count + 16 <= (int)size; count += 16)
+      {
+         const unsigned char *st = elf + offset + count;
+         unsigned int info = st[12], shndx = elf_get(st + 14, 2, big);
+         const unsigned char *text = elf + shoff + shndx * shentsize;
+
+         if(shndx == 0 || shndx >= shnum)
+            continue;
+         if((elf_get(text + 8, 4, big) & (SHF_ALLOC | SHF_EXECINSTR)) == SHF_ALLOC)
+         {
+            if((info & 15) == STT_OBJECT)
+               object_add(sym, elf_get(st + 4, 4, big), elf_get(st + 8, 4, big),
+                  (const char*)elf + elf_get(elf + shoff + link * shentsize + 0x10, 4, big) +
+                  elf_get(st, 4, big));
+            continue;
+         }
+         if((elf_get(text + 8, 4, big) & SHF_EXECINSTR) == 0)
+            continue;
+         if((info & 15) == STT_FUNC || ((info & 15) == 0 && (info >> 4) == STB_GLOBAL))
+            symbol_add(sym, elf_get(st + 4, 4, big), elf_get(st + 8, 4, big),
+               (const char*)elf + elf_get(elf + shoff + link * shentsize + 0x10, 4, big) +
+               elf_get(st, 4, big));
+      }
+   }
+   return sym->symCount + sym->rowCount;
+}
+
+//Global symbols of a GNU ld map file; statics are not listed so
+//their time is charged to the preceding global
+static int symbols_map(Symbols *sym, FILE *in)
+{
+   static const char *data[] = {".data ", ".sdata ", ".sbss ", ".bss ", ".rodata ", NULL};
+   char line[512], name[256], extra[2];
+   unsigned long long address, size;
+   int inText = 0, inData = 0, index;
+
+   while(fgets(line, sizeof(line), in))
+   {
+      if(line[0] != ' ' && line[0] != '\n')
+      {
+         inText = sscanf(line, ".text %llx %llx", &address, &size) == 2;
+         if(inText)
+            symbol_add(sym, (unsigned int)(address + size), 0, "");  //end marker
+         for(inData = index = 0; data[index] && inText == 0; ++index)
+         {
+            if(strncmp(line, data[index], strlen(data[index])) == 0 &&
+               sscanf(line + strlen(data[index]), "%llx %llx", &address, &size) == 2)
+            {
+               object_add(sym, (unsigned int)(address + size), 0, "");
+               inData = 1;
+            }
+         }
+      }
+      else if((inText || inData) &&
+              sscanf(line, " 0x%llx %255s %1s", &address, name, extra) == 2 &&
+              (isalpha((unsigned char)name[0]) || name[0] == '_'))
+      {
+         if(inText)
+            symbol_add(sym, (unsigned int)address, 0, name);
+         else
+            object_add(sym, (unsigned int)address, 0, name);
+      }
+   }
+   return sym->symCount;
+}
+
+static int symbol_compare(const void *a, const void *b)
+{
+   const Symbol *x = (const Symbol*)a, *y = (const Symbol*)b;
+   if(x->address != y->address)
+      return x->address < y->address ? -1 : 1;
+   return (x->name[0] == 0) - (y->name[0] == 0);  //end markers last
+}
+
+static int row_compare(const void *a, const void *b)
+{
+   const LineRow *x = (const LineRow*)a, *y = (const LineRow*)b;
+   if(x->address != y->address)
+      return x->address < y->address ? -1 : 1;
+   return (x->line != 0) - (y->line != 0);  //sequence ends first
+}
+
+void symbols_free(Symbols *sym)
+{
+   int index;
+
+   if(sym == NULL)
+      return;
+   for(index = 0; index < sym->symCount; ++index)
+      free(sym->sym[index].name);
+   for(index = 0; index < sym->objCount; ++index)
+      free(sym->obj[index].name);
+   for(index = 0; index < sym->fileCount; ++index)
+      free(sym->files[index]);
+   free(sym->sym);
+   free(sym->obj);
+   free(sym->row);
+   free(sym->files);
+   free(sym);
+}
+
+//Sizeless symbols run to the next one; drop the end markers
+static void symbol_sort(Symbol *list, int *count)
+{
+   int index, found;
+
+   qsort(list, *count, sizeof(Symbol), symbol_compare);
+   for(index = 0; index + 1 < *count; ++index)
+   {
+      if(list[index].size == 0)
+         list[index].size = list[index + 1].address - list[index].address;
+   }
+   for(index = found = 0; index < *count; ++index)
+   {
+      if(list[index].name[0])
+         list[found++] = list[index];
+      else
+         free(list[index].name);
+   }
+   *count = found;
+}
+
+//Load an ELF (.axf) or a linker map; NULL if it has no symbols
+Symbols *symbols_load(const char *name)
+{
+   Symbols *sym;
+   FILE *in = fopen(name, "rb");
+   unsigned char *elf;
+   long bytes;
+   int found;
+
+   if(in == NULL)
+      return NULL;
+   sym = (Symbols*)calloc(1, sizeof(Symbols));
+   fseek(in, 0, SEEK_END);
+   bytes = ftell(in);
+   rewind(in);
+   elf = (unsigned char*)malloc(bytes > 4 ? bytes : 4);
+   if(fread(elf, 1, bytes, in) == (size_t)bytes && bytes > 4 && memcmp(elf, "\177ELF", 4) == 0)
+      found = symbols_elf(sym, elf, bytes);
+   else
+   {
+      rewind(in);
+      found = symbols_map(sym, in);
+   }
+   free(elf);
+   fclose(in);
+   if(found == 0)
+   {
+      symbols_free(sym);
+      return NULL;
+   }
+
+   symbol_sort(sym->sym, &sym->symCount);
+   symbol_sort(sym->obj, &sym->objCount);
+   qsort(sym->row, sym->rowCount, sizeof(LineRow), row_compare);
+   return sym;
+}
+
+static const Symbol *symbol_search(const Symbol *list, int count, unsigned int address)
+{
+   int low = 0, high = count - 1, mid;
+
+   while(low <= high)
+   {
+      mid = (low + high) / 2;
+      if(list[mid].address <= address)
+         low = mid + 1;
+      else
+         high = mid - 1;
+   }
+   for(; high >= 0 && list[high].address <= address; --high)
+   {
+      if(address - list[high].address < list[high].size ||
+         (list[high].size == 0 && high == count - 1))
+         return &list[high];
+   }
+   return NULL;
+}
+
+//Function holding address, or NULL
+static const Symbol *symbol_find(const Symbols *sym, unsigned int address)
+{
+   return sym ? symbol_search(sym->sym, sym->symCount, address) : NULL;
+}
+
+//Data object holding address, or NULL
+static const Symbol *object_find(const Symbols *sym, unsigned int address)
+{
+   return sym ? symbol_search(sym->obj, sym->objCount, address) : NULL;
+}
+
+//Address of the function or data object called name, 0 if unknown
+unsigned int symbol_address(const Symbols *sym, const char *name)
+{
+   int index;
+
+   for(index = 0; sym && index < sym->symCount; ++index)
+   {
+      if(strcmp(sym->sym[index].name, name) == 0)
+         return sym->sym[index].address;
+   }
+   for(index = 0; sym && index < sym->objCount; ++index)
+   {
+      if(strcmp(sym->obj[index].name, name) == 0)
+         return sym->obj[index].address;
+   }
+   return 0;
+}
+
+//Source line holding address, or NULL
+static const LineRow *line_find(const Symbols *sym, unsigned int address)
+{
+   int low = 0, high, mid;
+
+   if(sym == NULL || sym->rowCount == 0)
+      return NULL;
+   high = sym->rowCount - 1;
+   while(low <= high)
+   {
+      mid = (low + high) / 2;
+      if(sym->row[mid].address <= address)
+         low = mid + 1;
+      else
+         high = mid - 1;
+   }
+   return high >= 0 && sym->row[high].line ? &sym->row[high] : NULL;
+}
+
+//Address of word index of s->mem, inverse of mem_offset()
+static unsigned int profile_address(unsigned int index)
+{
+   unsigned int offset = index * 4;
+   return offset < RAM_WINDOW ? RAM_INTERNAL + offset : RAM_EXTERNAL + offset - RAM_WINDOW;
+}
+
+typedef struct
+{
+   const char *name;
+   int line;
+   unsigned int address;         //lowest address, PC rows use it as the key
+   unsigned long long count, cycles;
+} ProfileRow;
+
+static int profile_by_cycles(const void *a, const void *b)
+{
+   const ProfileRow *x = (const ProfileRow*)a, *y = (const ProfileRow*)b;
+   if(x->cycles != y->cycles)
+      return x->cycles < y->cycles ? 1 : -1;
+   return x->address < y->address ? -1 : x->address > y->address;
+}
+
+static int profile_by_line(const void *a, const void *b)
+{
+   const ProfileRow *x = (const ProfileRow*)a, *y = (const ProfileRow*)b;
+   int result = strcmp(x->name, y->name);
+   if(result == 0)
+      result = x->line - y->line;
+   return result;
+}
+
+static void profile_table(FILE *out, const char *title, ProfileRow *row, int count,
+                          unsigned long long total, int lines)
+{
+   int index;
+
+   qsort(row, count, sizeof(ProfileRow), profile_by_cycles);
+   fprintf(out, "\n%s\n   %%time       cycles  instructions   CPI  %s\n",
+      title, lines ? "file:line" : "function");
+   for(index = 0; index < count && index < PROFILE_TOP; ++index)
+   {
+      fprintf(out, "  %6.2f %12llu  %12llu %5.2f  %s",
+         total ? 100.0 * row[index].cycles / total : 0.0, row[index].cycles,
+         row[index].count, row[index].count ? (double)row[index].cycles / row[index].count : 0.0,
+         row[index].name);
+      if(lines)
+         fprintf(out, ":%d", row[index].line);
+      fprintf(out, "\n");
+   }
+}
+
+//Write the report sorted by cycles to name and one row per PC to name.csv
+void profile_report(State *s, const char *name)
+{
+   const Symbols *sym = s->symbols;
+   ProfileRow *func, *rows;
+   unsigned long long total = 0;
+   int index, funcCount, rowCount = 0, merged, hasLines = sym && sym->rowCount;
+   unsigned int word;
+   char csvName[1024], label[300];
+   FILE *out, *csv;
+
+   if(s->blockMap)
+      block_flush(s);                 //blocks add their counts when dropped
+   out = fopen(name, "w");
+   snprintf(csvName, sizeof(csvName), "%s.csv", name);
+   csv = fopen(csvName, "w");
+   if(out == NULL || csv == NULL)
+   {
+      fprintf(stderr, "Can't write profile %s\n", name);
+      if(out)
+         fclose(out);
+      if(csv)
+         fclose(csv);
+      return;
+   }
+
+   //One bucket per symbol plus one for addresses outside them all
+   funcCount = sym ? sym->symCount : 0;
+   func = (ProfileRow*)calloc(funcCount + 1, sizeof(ProfileRow));
+   for(index = 0; index < funcCount; ++index)
+   {
+      func[index].name = sym->sym[index].name;
+      func[index].address = sym->sym[index].address;
+   }
+   func[funcCount].name = "[unknown]";
+   func[funcCount].address = ~0u;
+   rows = (ProfileRow*)calloc(MEM_SIZE / 4, sizeof(ProfileRow));
+
+   fprintf(csv, "pc,function,file,line,instructions,cycles\n");
+   for(word = 0; word < MEM_SIZE / 4; ++word)
+   {
+      const ProfileCount *p = &s->profile[word];
+      unsigned int address = profile_address(word);
+      const Symbol *f;
+      const LineRow *l;
+      ProfileRow *r;
+
+      if(p->count == 0 && p->cycles == 0)
+         continue;
+      f = symbol_find(sym, address);
+      l = hasLines ? line_find(sym, address) : NULL;
+      r = f ? &func[f - sym->sym] : &func[funcCount];
+      r->count += p->count;
+      r->cycles += p->cycles;
+      total += p->cycles;
+      fprintf(csv, "0x%8.8x,%s,%s,%d,%llu,%llu\n", address, f ? f->name : "",
+         l ? sym->files[l->file] : "", l ? l->line : 0, p->count, p->cycles);
+
+      r = &rows[rowCount++];
+      r->address = address;
+      r->count = p->count;
+      r->cycles = p->cycles;
+      if(l)
+      {
+         r->name = sym->files[l->file];
+         r->line = l->line;
+      }
+      else if(hasLines)
+         r->name = "[unknown]";
+      else
+      {
+         if(f)
+            snprintf(label, sizeof(label), "%s+0x%x", f->name, address - f->address);
+         else
+            snprintf(label, sizeof(label), "0x%8.8x", address);
+         r->name = strdup(label);
+      }
+   }
+
+   fprintf(out, "Plasma profile: %llu instructions, %llu cycles%s\n",
+      s->instructions, s->cycles, s->timing ? "" : " (1 CPI, no -c)");
+   if(sym == NULL)
+      fprintf(out, "No symbols: give -s file.axf or file.map\n");
+   for(index = merged = 0; index <= funcCount; ++index)
+   {
+      if(func[index].count || func[index].cycles)
+         func[merged++] = func[index];
+   }
+   profile_table(out, "Functions", func, merged, total, 0);
+   if(hasLines)
+   {
+      //Merge the PCs of each source line
+      qsort(rows, rowCount, sizeof(ProfileRow), profile_by_line);
+      for(index = merged = 0; index < rowCount; ++index)
+      {
+         if(merged && rows[merged - 1].line == rows[index].line &&
+            strcmp(rows[merged - 1].name, rows[index].name) == 0)
+         {
+            rows[merged - 1].count += rows[index].count;
+            rows[merged - 1].cycles += rows[index].cycles;
+         }
+         else
+            rows[merged++] = rows[index];
+      }
+      profile_table(out, "Lines", rows, merged, total, 1);
+   }
+   else
+   {
+      profile_table(out, "Instructions", rows, rowCount, total, 0);
+      for(index = 0; index < rowCount; ++index)
+         free((char*)rows[index].name);
+   }
+   free(rows);
+   free(func);
+   fclose(csv);
+   fclose(out);
+}
+
+//Name of the function entered at address
+static const char *calls_name(const Symbols *sym, unsigned int address, char *buf)
+{
+   const Symbol *f = symbol_find(sym, address);
+
+   if(f && f->address == address)
+      return f->name;
+   if(f)
+      sprintf(buf, "%.200s+0x%x", f->name, address - f->address);
+   else
+      sprintf(buf, "0x%8.8x", address);
+   return buf;
+}
+
+//"outer;...;inner" call path of node, truncated to size
+static void calls_path(const Symbols *sym, const CallNode *node, char *path, int size)
+{
+   const CallNode *frame[CALL_DEPTH_MAX + 1];
+   char buf[256];
+   int depth, length = 0;
+
+   for(depth = 0; node; node = node->parent)
+      frame[depth++] = node;
+   path[0] = 0;
+   while(depth-- && length < size - 1)
+      length += snprintf(path + length, size - length, "%s%s", length ? ";" : "",
+         calls_name(sym, frame[depth]->function, buf));
+}
+
+static int calls_by_cycles(const void *a, const void *b)
+{
+   const CallNode *x = *(CallNode* const*)a, *y = *(CallNode* const*)b;
+   if(x->inclCycles != y->inclCycles)
+      return x->inclCycles < y->inclCycles ? 1 : -1;
+   return x->depth - y->depth;
+}
+
+//Folded stacks weighted by exclusive cycles, the input of flamegraph.pl,
+//and the call paths by inclusive cycles appended to the profile report
+void calls_report(State *s, const char *foldName, const char *profileName)
+{
+   CallStack *c = s->calls;
+   CallNode *node, **list;
+   char *path;
+   int count = 0, index;
+   FILE *out;
+
+   path = (char*)malloc(CALL_DEPTH_MAX * 64);
+   for(node = c->all; node; node = node->all)
+   {
+      node->inclCount = node->count;
+      node->inclCycles = node->cycles;
+      ++count;
+   }
+   //Children are created after their parents, so c->all lists them first
+   for(node = c->all; node; node = node->all)
+   {
+      if(node->parent)
+      {
+         node->parent->inclCount += node->inclCount;
+         node->parent->inclCycles += node->inclCycles;
+      }
+   }
+
+   if(foldName)
+   {
+      out = fopen(foldName, "w");
+      if(out == NULL)
+         fprintf(stderr, "Can't write %s\n", foldName);
+      for(node = c->all; out && node; node = node->all)
+      {
+         if(node->cycles == 0)
+            continue;
+         calls_path(s->symbols, node, path, CALL_DEPTH_MAX * 64);
+         fprintf(out, "%s %llu\n", path, node->cycles);
+      }
+      if(out)
+         fclose(out);
+   }
+
+   out = profileName ? fopen(profileName, "a") : NULL;
+   if(out)
+   {
+      list = (CallNode**)malloc(count * sizeof(CallNode*));
+      for(node = c->all, index = 0; node; node = node->all)
+         list[index++] = node;
+      qsort(list, count, sizeof(CallNode*), calls_by_cycles);
+      fprintf(out, "\nCall paths\n   %%time    inclusive    exclusive  incl instr  excl instr"
+         "      calls  path\n");
+      for(index = 0; index < count && index < PROFILE_TOP; ++index)
+      {
+         node = list[index];
+         calls_path(s->symbols, node, path, CALL_DEPTH_MAX * 64);
+         fprintf(out, "  %6.2f %12llu %12llu %11llu %11llu %10llu  %s\n",
+            c->root->inclCycles ? 100.0 * node->inclCycles / c->root->inclCycles : 0.0,
+            node->inclCycles, node->cycles, node->inclCount, node->count, node->calls, path);
+      }
+      free(list);
+      fclose(out);
+   }
+   free(path);
+}
+/************* End symbols and profile report *************/
+
+/************* Cache model report *************/
+typedef struct
+{
+   const char *name;
+   unsigned int address, size;
+   CacheCount n;
+} CacheRow;
+
+static unsigned long long cache_misses(const CacheCount *n)
+{
+   return n->iMiss + n->dMiss + n->writeBack;
+}
+
+static int cache_by_misses(const void *a, const void *b)
+{
+   const CacheRow *x = (const CacheRow*)a, *y = (const CacheRow*)b;
+   if(cache_misses(&x->n) != cache_misses(&y->n))
+      return cache_misses(&x->n) < cache_misses(&y->n) ? 1 : -1;
+   return x->address < y->address ? -1 : x->address > y->address;
+}
+
+static void cache_add(CacheCount *sum, const CacheCount *n)
+{
+   sum->iAccess += n->iAccess;
+   sum->iMiss += n->iMiss;
+   sum->dAccess += n->dAccess;
+   sum->dMiss += n->dMiss;
+   sum->writeBack += n->writeBack;
+}
+
+static double cache_rate(unsigned long long miss, unsigned long long access)
+{
+   return access ? 100.0 * miss / access : 0.0;
+}
+
+static void cache_summary(FILE *out, const char *title, const CacheSim *c)
+{
+   if(c == NULL)
+      return;
+   if(c->ways == 1)
+      fprintf(out, "%s: %d bytes, %d byte lines, direct mapped", title, c->size, c->line);
+   else
+      fprintf(out, "%s: %d bytes, %d byte lines, %d-way %s", title, c->size, c->line,
+         c->ways, c->replace == CACHE_RANDOM ? "random" : "LRU");
+   fprintf(out, "%s\n", title[0] == 'D' ? (c->writeBack ? ", write-back" : ", write-through") : "");
+   fprintf(out, "   %llu accesses (%llu writes), %llu misses (%.2f%%), %llu write-backs\n",
+      c->access, c->writes, c->miss, cache_rate(c->miss, c->access), c->writeBacks);
+}
+
+//Rows with misses or write-backs, worst first
+static void cache_table(FILE *out, const char *title, CacheRow *row, int count, int code)
+{
+   int index;
+
+   qsort(row, count, sizeof(CacheRow), cache_by_misses);
+   fprintf(out, "\n%s\n", title);
+   if(code)
+      fprintf(out, "   i-access    i-miss   %%miss    d-access    d-miss   %%miss  write-back  function\n");
+   else
+      fprintf(out, "   address     bytes    d-access    d-miss   %%miss  write-back  object\n");
+   for(index = 0; index < count && index < PROFILE_TOP && cache_misses(&row[index].n); ++index)
+   {
+      const CacheCount *n = &row[index].n;
+      if(code)
+         fprintf(out, "%11llu %9llu %7.2f %11llu %9llu %7.2f %11llu  %s\n",
+            n->iAccess, n->iMiss, cache_rate(n->iMiss, n->iAccess),
+            n->dAccess, n->dMiss, cache_rate(n->dMiss, n->dAccess), n->writeBack, row[index].name);
+      else if(row[index].address == ~0u)
+         fprintf(out, "   %-10s %7s %11llu %9llu %7.2f %11llu  %s\n", "-", "-",
+            n->dAccess, n->dMiss, cache_rate(n->dMiss, n->dAccess), n->writeBack,
+            row[index].name);
+      else
+         fprintf(out, "   0x%8.8x %7u %11llu %9llu %7.2f %11llu  %s\n",
+            row[index].address, row[index].size, n->dAccess, n->dMiss,
+            cache_rate(n->dMiss, n->dAccess), n->writeBack, row[index].name);
+   }
+}
+
+/* Summary to info; with a name also the functions and the data objects
+   of external RAM that miss most, the candidates for internal RAM.
+   Without data symbols all of external RAM is one region. */
+void cache_report(State *s, FILE *info, const char *name)
+{
+   const Symbols *sym = s->symbols;
+   CacheRow *func, *obj;
+   int index, funcCount, objCount, merged;
+   unsigned int word;
+   FILE *out;
+
+   cache_summary(info, "I-cache", s->icache);
+   cache_summary(info, "D-cache", s->dcache);
+   if(name == NULL || s->cacheByPc == NULL)
+      return;
+   out = fopen(name, "w");
+   if(out == NULL)
+   {
+      fprintf(stderr, "Can't write cache report %s\n", name);
+      return;
+   }
+   fprintf(out, "Plasma cache model: %llu instructions, %llu cycles%s\n",
+      s->instructions, s->cycles, s->timing ? "" : " (1 CPI, no -c)");
+   cache_summary(out, "I-cache", s->icache);
+   cache_summary(out, "D-cache", s->dcache);
+   if(sym == NULL)
+      fprintf(out, "No symbols: give -s file.axf or file.map\n");
+
+   //One bucket per symbol plus one for addresses outside them all
+   funcCount = sym ? sym->symCount : 0;
+   objCount = sym ? sym->objCount : 0;
+   func = (CacheRow*)calloc(funcCount + 1, sizeof(CacheRow));
+   obj = (CacheRow*)calloc(objCount + 1, sizeof(CacheRow));
+   for(index = 0; index < funcCount; ++index)
+   {
+      func[index].name = sym->sym[index].name;
+      func[index].address = sym->sym[index].address;
+      func[index].size = sym->sym[index].size;
+   }
+   for(index = 0; index < objCount; ++index)
+   {
+      obj[index].name = sym->obj[index].name;
+      obj[index].address = sym->obj[index].address;
+      obj[index].size = sym->obj[index].size;
+   }
+   func[funcCount].name = "[unknown]";
+   func[funcCount].address = ~0u;
+   obj[objCount].name = "[other external RAM]";
+   obj[objCount].address = ~0u;
+   for(word = 0; word < MEM_SIZE / 4; ++word)
+   {
+      unsigned int address = profile_address(word);
+      const Symbol *f;
+      CacheRow *r;
+
+      if(s->cacheByPc[word].iAccess || s->cacheByPc[word].dAccess)
+      {
+         f = symbol_find(sym, address);
+         r = f ? &func[f - sym->sym] : &func[funcCount];
+         cache_add(&r->n, &s->cacheByPc[word]);
+      }
+      if(s->cacheByData[word].dAccess || s->cacheByData[word].writeBack)
+      {
+         f = object_find(sym, address);
+         r = f ? &obj[f - sym->obj] : &obj[objCount];
+         cache_add(&r->n, &s->cacheByData[word]);
+      }
+   }
+   for(index = merged = 0; index <= objCount; ++index)
+   {
+      if(obj[index].n.dAccess || obj[index].n.writeBack)
+         obj[merged++] = obj[index];
+   }
+   cache_table(out, "Functions", func, funcCount + 1, 1);
+   cache_table(out, "Data in external RAM", obj, merged, 0);
+   free(obj);
+   free(func);
+   fclose(out);
+}
+/************* End cache model report *************/
+
+/************* Snapshots *************/
+/* -S file writes the CPU and device state plus the non-zero pages of RAM
+   and the framebuffer when a batch run stops; -R file starts from it.
+   Pages sit at page-aligned file offsets, so restoring maps runs of them
+   copy-on-write over freshly zeroed memory: nothing is copied up front
+   and the snapshot file is never written.  The header holds host-layout
+   structs, so a snapshot only loads into the build that wrote it.
+   Device records after the run table keep the coprocessors, FIFOs,
+   button script and PWM controller; a device connected after
+   snapshot_restore() takes its record when it is set up, and one left
+   out of the restored run drops it. */
+
+#define SNAPSHOT_MAGIC   "PLASMSNP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_REGIONS 2            //s->mem, s->vga
+
+#define SNAPSHOT_APPLIED 0            //device record kinds
+#define SNAPSHOT_COPROC  1            //index 0..3
+#define SNAPSHOT_FIFO    2            //index 0 FIFO_IN, 1 FIFO_OUT
+#define SNAPSHOT_INPUT   3
+#define SNAPSHOT_PWM     4
+
+typedef struct
+{
+   int r[32];
+   int pc, pc_next, epc;
+   unsigned int hi, lo;
+   int status, userMode, processId, exceptionId, faultAddr, irqStatus, skip;
+   int big_endian;
+   MmuEntry mmuEntry[MMU_ENTRIES];
+   unsigned long long instructions, cycles, multDone;
+   long long uartInOffset;            //-1 when the input was not seekable
+   unsigned int ioLatch[IO_WINDOWS][PAGE_SIZE / 4];
+} SnapshotCpu;
+
+//Pages [page, page + count) of a region stored from file page filePage
+typedef struct
+{
+   unsigned int region, page, count, filePage;
+} SnapshotRun;
+
+//Followed by size bytes of data, a multiple of 8
+typedef struct
+{
+   unsigned int kind, index, size, pad;
+} SnapshotDevice;
+
+typedef struct
+{
+   char model[16];                    //applied to the same model only
+   unsigned int reg[6], output;
+   unsigned long long ready, accept, writes, reads, stalls;
+} SnapshotCoproc;
+
+//Followed by the count words in the FIFO
+typedef struct
+{
+   int count, maxCount;
+   unsigned long long next, last, words, moved, misses, waits, area;
+} SnapshotFifo;
+
+//Followed by seen and idle of the next events applied
+typedef struct
+{
+   int next, unseen[2], busy;
+   unsigned int buttons, buffer, change, switches;
+} SnapshotInput;
+
+typedef struct
+{
+   unsigned char ram[PWM_MAX_ADDR + 1];
+   int writeAddr, filled, playAddr, reading, lead;
+   unsigned int etat;
+   unsigned long long next, underruns, firstUnderrun;
+} SnapshotPwm;
+
+typedef struct
+{
+   char magic[8];
+   unsigned int version;
+   unsigned int cpuSize;
+   unsigned int runCount;
+   unsigned int deviceSize;           //bytes of device records after the runs
+   unsigned int headerPages;
+   SnapshotCpu cpu;
+} SnapshotHeader;
+
+static unsigned char *snapshot_region(State *s, int region, unsigned int *size)
+{
+   *size = region ? VGA_SIZE : MEM_SIZE;
+   return region ? s->vga : s->mem;
+}
+
+//Append a zeroed record of bytes to *list, returns its data
+static void *snapshot_device(unsigned char **list, unsigned int *size, int kind, int index,
+                             unsigned int bytes)
+{
+   SnapshotDevice *d;
+
+   bytes = (bytes + 7) & ~7u;
+   *list = (unsigned char*)realloc(*list, *size + sizeof(SnapshotDevice) + bytes);
+   d = (SnapshotDevice*)(*list + *size);
+   memset(d, 0, sizeof(SnapshotDevice) + bytes);
+   d->kind = kind;
+   d->index = index;
+   d->size = bytes;
+   *size += sizeof(SnapshotDevice) + bytes;
+   return d + 1;
+}
+
+//Records of the devices connected to s at s->cycles, returns their size
+static unsigned int snapshot_devices(State *s, unsigned char **list)
+{
+   unsigned int size = 0, *words;
+   SnapshotCoproc *c;
+   SnapshotFifo *f;
+   SnapshotInput *in;
+   SnapshotPwm *p;
+   unsigned long long *clock;
+   int index, word;
+
+   *list = NULL;
+   for(index = 0; index < COPROCS; ++index)
+   {
+      if(s->coproc[index].model == NULL)
+         continue;
+      c = (SnapshotCoproc*)snapshot_device(list, &size, SNAPSHOT_COPROC, index,
+                                           sizeof(SnapshotCoproc));
+      snprintf(c->model, sizeof(c->model), "%s", s->coproc[index].model->name);
+      memcpy(c->reg, s->coproc[index].reg, sizeof(c->reg));
+      c->output = s->coproc[index].output;
+      c->ready = s->coproc[index].ready;
+      c->accept = s->coproc[index].accept;
+      c->writes = s->coproc[index].writes;
+      c->reads = s->coproc[index].reads;
+      c->stalls = s->coproc[index].stalls;
+   }
+   for(index = 0; index < 2; ++index)
+   {
+      if(s->fifo[index] == NULL)
+         continue;
+      fifo_advance(s, s->fifo[index], index);
+      f = (SnapshotFifo*)snapshot_device(list, &size, SNAPSHOT_FIFO, index,
+         sizeof(SnapshotFifo) + s->fifo[index]->count * sizeof(unsigned int));
+      f->count = s->fifo[index]->count;
+      f->maxCount = s->fifo[index]->maxCount;
+      f->next = s->fifo[index]->next;
+      f->last = s->fifo[index]->last;
+      f->words = s->fifo[index]->words;
+      f->moved = s->fifo[index]->moved;
+      f->misses = s->fifo[index]->misses;
+      f->waits = s->fifo[index]->waits;
+      f->area = s->fifo[index]->area;
+      words = (unsigned int*)(f + 1);
+      for(word = 0; word < f->count; ++word)
+         words[word] = s->fifo[index]->ring[(s->fifo[index]->head + word) %
+                                            (s->fifo[index]->depth * 2)];
+   }
+   if(s->input)
+   {
+      in = (SnapshotInput*)snapshot_device(list, &size, SNAPSHOT_INPUT, 0,
+         sizeof(SnapshotInput) + s->input->next * 2 * sizeof(unsigned long long));
+      in->next = s->input->next;
+      in->unseen[0] = s->input->unseen[0];
+      in->unseen[1] = s->input->unseen[1];
+      in->busy = s->input->busy;
+      in->buttons = s->input->buttons;
+      in->buffer = s->input->buffer;
+      in->change = s->input->change;
+      in->switches = s->input->switches;
+      clock = (unsigned long long*)(in + 1);
+      for(index = 0; index < in->next; ++index)
+      {
+         *clock++ = s->input->list[index].seen;
+         *clock++ = s->input->list[index].idle;
+      }
+   }
+   if(s->pwm)
+   {
+      pwm_advance(s);
+      p = (SnapshotPwm*)snapshot_device(list, &size, SNAPSHOT_PWM, 0, sizeof(SnapshotPwm));
+      memcpy(p->ram, s->pwm->ram, sizeof(p->ram));
+      p->writeAddr = s->pwm->writeAddr;
+      p->filled = s->pwm->filled;
+      p->playAddr = s->pwm->playAddr;
+      p->reading = s->pwm->reading;
+      p->lead = s->pwm->lead;
+      p->etat = s->pwm->etat;
+      p->next = s->pwm->next;
+      p->underruns = s->pwm->underruns;
+      p->firstUnderrun = s->pwm->firstUnderrun;
+   }
+   return size;
+}
+
+static void snapshot_fifo(State *s, Fifo *f, int out, const SnapshotFifo *saved)
+{
+   const unsigned int *words = (const unsigned int*)(saved + 1);
+   unsigned char word[4];
+   unsigned long long skip;
+
+   f->head = f->ahead = f->eof = 0;
+   for(f->count = 0; f->count < saved->count && f->count < f->depth; ++f->count)
+      f->ring[f->count] = words[f->count];
+   f->drained = out ? f->count : 0;      //the saving run wrote them when it closed
+   f->maxCount = saved->maxCount;
+   f->next = saved->next;
+   f->last = saved->last;
+   f->words = saved->words;
+   f->moved = saved->moved;
+   f->misses = saved->misses;
+   f->waits = saved->waits;
+   f->area = saved->area;
+   if(out)
+      return;
+   //FIFO_IN goes on from the word after the last one that arrived
+   if(fseek(f->file, (long)(f->moved * 4), SEEK_SET))
+   {
+      for(skip = f->moved; skip && fread(word, 1, 4, f->file) == 4; --skip)
+         ;
+   }
+   fifo_advance(s, f, 0);
+}
+
+//Apply the records of snapshot_restore() to the devices connected now
+static void snapshot_resume(State *s)
+{
+   SnapshotDevice *d;
+   const SnapshotCoproc *c;
+   const SnapshotInput *in;
+   const SnapshotPwm *p;
+   const unsigned long long *clock;
+   Coproc *coproc;
+   unsigned int offset;
+   int index;
+
+   for(offset = 0; offset + sizeof(SnapshotDevice) <= s->resumeSize;
+       offset += sizeof(SnapshotDevice) + d->size)
+   {
+      d = (SnapshotDevice*)(s->resume + offset);
+      if(d->kind == SNAPSHOT_COPROC && d->index < COPROCS &&
+         (coproc = &s->coproc[d->index])->model)
+      {
+         c = (const SnapshotCoproc*)(d + 1);
+         if(strncmp(coproc->model->name, c->model, sizeof(c->model)) == 0)
+         {
+            memcpy(coproc->reg, c->reg, sizeof(coproc->reg));
+            coproc->output = c->output;
+            coproc->ready = c->ready;
+            coproc->accept = c->accept;
+            coproc->writes = c->writes;
+            coproc->reads = c->reads;
+            coproc->stalls = c->stalls;
+         }
+      }
+      else if(d->kind == SNAPSHOT_FIFO && d->index < 2 && s->fifo[d->index])
+         snapshot_fifo(s, s->fifo[d->index], d->index, (const SnapshotFifo*)(d + 1));
+      else if(d->kind == SNAPSHOT_INPUT && s->input)
+      {
+         in = (const SnapshotInput*)(d + 1);
+         clock = (const unsigned long long*)(in + 1);
+         if(in->next <= s->input->count)
+         {
+            for(index = 0; index < in->next; ++index)
+            {
+               s->input->list[index].seen = *clock++;
+               s->input->list[index].idle = *clock++;
+            }
+            s->input->next = in->next;
+            s->input->unseen[0] = in->unseen[0];
+            s->input->unseen[1] = in->unseen[1];
+            s->input->busy = in->busy;
+            s->input->buttons = in->buttons;
+            s->input->switches = in->switches;
+         }
+         s->input->buffer = in->buffer;
+         s->input->change = in->change;
+      }
+      else if(d->kind == SNAPSHOT_PWM && s->pwm)
+      {
+         p = (const SnapshotPwm*)(d + 1);
+         memcpy(s->pwm->ram, p->ram, sizeof(p->ram));
+         s->pwm->writeAddr = p->writeAddr;
+         s->pwm->filled = p->filled;
+         s->pwm->playAddr = p->playAddr;
+         s->pwm->reading = p->reading;
+         s->pwm->lead = p->lead;
+         s->pwm->etat = p->etat;
+         s->pwm->next = p->next;
+         s->pwm->underruns = p->underruns;
+         s->pwm->firstUnderrun = p->firstUnderrun;
+      }
+      else
+         continue;
+      d->kind = SNAPSHOT_APPLIED;
+   }
+}
+
+//Returns 0 on success
+int snapshot_save(State *s, const char *name)
+{
+   static const unsigned char zero[PAGE_SIZE];
+   SnapshotHeader *h;
+   SnapshotRun *run = NULL;
+   unsigned char *base, *device;
+   unsigned int size, page, filePage = 0, bytes, deviceSize;
+   int region, runCount = 0, index;
+   FILE *out = fopen(name, "wb");
+
+   if(out == NULL)
+      return 1;
+   for(region = 0; region < SNAPSHOT_REGIONS; ++region)
+   {
+      base = snapshot_region(s, region, &size);
+      for(page = 0; page < size / PAGE_SIZE; ++page)
+      {
+         if(memcmp(base + page * PAGE_SIZE, zero, PAGE_SIZE) == 0)
+            continue;
+         if(runCount && run[runCount - 1].region == (unsigned int)region &&
+            run[runCount - 1].page + run[runCount - 1].count == page)
+         {
+            ++run[runCount - 1].count;
+         }
+         else
+         {
+            if((runCount & 63) == 0)
+               run = (SnapshotRun*)realloc(run, (runCount + 64) * sizeof(SnapshotRun));
+            run[runCount].region = region;
+            run[runCount].page = page;
+            run[runCount].count = 1;
+            run[runCount].filePage = filePage;
+            ++runCount;
+         }
+         ++filePage;
+      }
+   }
+
+   deviceSize = snapshot_devices(s, &device);
+   bytes = sizeof(SnapshotHeader) + runCount * sizeof(SnapshotRun) + deviceSize;
+   h = (SnapshotHeader*)calloc(1, (bytes + PAGE_SIZE - 1) & ~PAGE_MASK);
+   memcpy(h->magic, SNAPSHOT_MAGIC, 8);
+   h->version = SNAPSHOT_VERSION;
+   h->cpuSize = sizeof(SnapshotCpu);
+   h->runCount = runCount;
+   h->deviceSize = deviceSize;
+   h->headerPages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+   memcpy(h->cpu.r, s->r, sizeof(s->r));
+   h->cpu.pc = s->pc;
+   h->cpu.pc_next = s->pc_next;
+   h->cpu.epc = s->epc;
+   h->cpu.hi = s->hi;
+   h->cpu.lo = s->lo;
+   h->cpu.status = s->status;
+   h->cpu.userMode = s->userMode;
+   h->cpu.processId = s->processId;
+   h->cpu.exceptionId = s->exceptionId;
+   h->cpu.faultAddr = s->faultAddr;
+   h->cpu.irqStatus = s->irqStatus;
+   h->cpu.skip = s->skip;
+   h->cpu.big_endian = s->big_endian;
+   memcpy(h->cpu.mmuEntry, s->mmuEntry, sizeof(s->mmuEntry));
+   h->cpu.instructions = s->instructions;
+   h->cpu.cycles = s->cycles;
+   h->cpu.multDone = s->multDone;
+   h->cpu.uartInOffset = s->uartIn && s->uartIn != stdin ? ftell(s->uartIn) : -1;
+   memcpy(h->cpu.ioLatch, s->ioLatch, sizeof(s->ioLatch));
+   memcpy(h + 1, run, runCount * sizeof(SnapshotRun));
+   if(deviceSize)
+      memcpy((SnapshotRun*)(h + 1) + runCount, device, deviceSize);
+   fwrite(h, PAGE_SIZE, h->headerPages, out);
+
+   for(index = 0; index < runCount; ++index)
+   {
+      base = snapshot_region(s, run[index].region, &size);
+      fwrite(base + run[index].page * PAGE_SIZE, PAGE_SIZE, run[index].count, out);
+   }
+   free(h);
+   free(run);
+   free(device);
+   return fclose(out) != 0;
+}
+
+//Returns 0 on success; *uartInOffset is where the UART input resumes
+int snapshot_restore(State *s, const char *name, long long *uartInOffset)
+{
+   SnapshotHeader h;
+   SnapshotRun *run;
+   unsigned char *base;
+   unsigned int size, index;
+   int mapped = 0;
+   long fileSize;
+   FILE *in = fopen(name, "rb");
+
+   if(in == NULL)
+      return 1;
+   fseek(in, 0, SEEK_END);
+   fileSize = ftell(in);
+   rewind(in);
+   if(fread(&h, sizeof(h), 1, in) != 1 || memcmp(h.magic, SNAPSHOT_MAGIC, 8) ||
+      h.version != SNAPSHOT_VERSION || h.cpuSize != sizeof(SnapshotCpu))
+   {
+      fclose(in);
+      return 1;
+   }
+   run = (SnapshotRun*)malloc(h.runCount * sizeof(SnapshotRun) + 1);
+   free(s->resume);
+   s->resume = (unsigned char*)malloc(h.deviceSize + 1);
+   s->resumeSize = 0;
+   if(fread(run, sizeof(SnapshotRun), h.runCount, in) != h.runCount ||
+      fread(s->resume, 1, h.deviceSize, in) != h.deviceSize)
+   {
+      free(run);
+      fclose(in);
+      return 1;
+   }
+   s->resumeSize = h.deviceSize;
+
+#ifndef WIN32
+   mapped = sysconf(_SC_PAGESIZE) == PAGE_SIZE;
+#endif
+   for(index = 0; index < SNAPSHOT_REGIONS; ++index)
+   {
+      base = snapshot_region(s, index, &size);
+      host_zero(base, size);
+   }
+   for(index = 0; index < h.runCount; ++index)
+   {
+      base = snapshot_region(s, run[index].region ? 1 : 0, &size);
+      if(run[index].page + run[index].count > size / PAGE_SIZE)
+         continue;
+      base += run[index].page * PAGE_SIZE;
+      if((long)(h.headerPages + run[index].filePage + run[index].count) * PAGE_SIZE > fileSize)
+         break;                       //a mapping past the end would fault later
+#ifndef WIN32
+      if(mapped && mmap(base, run[index].count * PAGE_SIZE, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_FIXED, fileno(in),
+         (off_t)(h.headerPages + run[index].filePage) * PAGE_SIZE) != MAP_FAILED)
+         continue;
+#endif
+      fseek(in, (long)(h.headerPages + run[index].filePage) * PAGE_SIZE, SEEK_SET);
+      if(fread(base, PAGE_SIZE, run[index].count, in) != run[index].count)
+         break;
+   }
+   free(run);
+   fclose(in);                        //the mappings keep the file open
+   if(index < h.runCount)
+      return 1;                       //truncated: memory is incomplete
+
+   memcpy(s->r, h.cpu.r, sizeof(s->r));
+   s->pc = h.cpu.pc;
+   s->pc_next = h.cpu.pc_next;
+   s->epc = h.cpu.epc;
+   s->hi = h.cpu.hi;
+   s->lo = h.cpu.lo;
+   s->status = h.cpu.status;
+   s->userMode = h.cpu.userMode;
+   s->processId = h.cpu.processId;
+   s->exceptionId = h.cpu.exceptionId;
+   s->faultAddr = h.cpu.faultAddr;
+   s->irqStatus = h.cpu.irqStatus;
+   s->skip = h.cpu.skip;
+   s->big_endian = h.cpu.big_endian;
+   memcpy(s->mmuEntry, h.cpu.mmuEntry, sizeof(s->mmuEntry));
+   s->instructions = h.cpu.instructions;
+   s->cycles = h.cpu.cycles;
+   s->multDone = h.cpu.multDone;
+   memcpy(s->ioLatch, h.cpu.ioLatch, sizeof(s->ioLatch));
+   s->eventCount = 0;                     //device events start over
+   s->nextEvent = 0;
+   s->uartTxDone = s->uartRxReady = 0;
+   *uartInOffset = h.cpu.uartInOffset;
+
+   //Nothing decoded or cached from the old memory survives
+   for(index = 0; index < sizeof(s->codePage); ++index)
+   {
+      if(s->codePage[index])
+         memset(&s->decoded[index * (PAGE_SIZE / 4)], 0, PAGE_SIZE / 4 * sizeof(Decoded));
+   }
+   memset(s->codePage, 0, sizeof(s->codePage));
+   if(s->blockMap)
+      block_flush(s);
+   cache_init(s);
+   snapshot_resume(s);
+   return 0;
+}
+/************* End snapshots *************/
@@ -0,0 +1,472 @@
+/*-------------------------------------------------------------------
+-- TITLE: Plasma CPU simulator library
+-- AUTHOR: Steve Rhoads (rhoadss@yahoo.com)
+-- DATE CREATED: 1/31/01
+-- FILENAME: plasmasim.h
+-- PROJECT: Plasma CPU core
+-- COPYRIGHT: Software placed into the public domain by the author.
+--    Software 'as is' without warranty.  Author liable for nothing.
+-- DESCRIPTION:
+--   Interface to the Plasma CPU simulator in plasmasim.c.  Each State
+--   is an independent machine: nothing is shared between instances, so
+--   several may run on separate threads of one process.  mlite.c is the
+--   command line front end.
+--------------------------------------------------------------------*/
+#ifndef __PLASMASIM_H__
+#define __PLASMASIM_H__
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//#define ENABLE_CACHE
+#define SIMPLE_CACHE
+
+#if defined(__x86_64__) && !defined(WIN32)
+#define ENABLE_JIT
+#endif
+
+#define MEM_SIZE (1024*1024*2)
+#define ntohs(A) ( ((A)>>8) | (((A)&0xff)<<8) )
+#define htons(A) ntohs(A)
+#define ntohl(A) ( ((A)>>24) | (((A)&0xff0000)>>8) | (((A)&0xff00)<<8) | ((A)<<24) )
+#define htonl(A) ntohl(A)
+
+#define UART_WRITE        0x20000000
+#define UART_READ         0x20000000
+#define IRQ_MASK          0x20000010
+#define IRQ_STATUS        0x20000020
+#define CONFIG_REG        0x20000070
+#define MMU_PROCESS_ID    0x20000080
+#define MMU_FAULT_ADDR    0x20000090
+#define MMU_TLB           0x200000a0
+#define GPIOA_IN          0x20000050
+#define COUNTER_REG       0x20000060
+#define CORE_ID_REG       0x200000e0   //multi-core SoC: this core, 0..count-1
+#define CORE_COUNT_REG    0x200000f0   //multi-core SoC: number of cores
+
+#define IRQ_UART_READ_AVAILABLE  0x001
+#define IRQ_UART_WRITE_AVAILABLE 0x002
+#define IRQ_COUNTER18_NOT        0x004
+#define IRQ_COUNTER18            0x008
+#define IRQ_GPIO31_NOT           0x040
+#define IRQ_GPIO31               0x080
+#define IRQ_MMU                  0x200
+
+#define CLOCK_HZ          50000000     //board clock, see sleep() in projet_e2
+#define INTERRUPT_VECTOR  0x3c
+
+#define MMU_ENTRIES 4
+#define MMU_MASK (1024*4-1)
+
+//Memory map, see C/shared/plasma.h and plasmaSoPCDesign.h
+#define RAM_WINDOW        (1024*1024)  //host bytes behind each RAM window
+#define RAM_INTERNAL      0x00000000   //s->mem
+#define RAM_INTERNAL_SIZE (8*1024)     //SRAM holding the boot/interrupt vector
+#define RAM_EXTERNAL      0x10000000   //s->mem + RAM_WINDOW
+#define MISC_BASE         0x20000000
+#define FIFO_BASE         0x30000000   //FIFO_IN_EMPTY, see plasmaSoPCDesign.h
+#define FIFO_IN_DATA_READ 0x30000080
+#define FIFO_OUT_DATA_WRITE 0x30000090
+#define PERIPH_BASE       0x40000000
+#define COPROC_BASE       0x40000000   //COPROC_1_RST, see plasmaCoprocessors.h
+#define COPROC_STRIDE     0x30         //COPROC_n_RST to COPROC_n+1_RST
+#define COPROCS           4
+#define CTRL_SL_RW        0x400000C4   //ctrl_SL.vhd: reads the switches, writes the LEDs
+#define BUTTONS_VALUES    0x40000100   //buttons.vhd: btnC, U, D, L, R in bits 0..4
+#define BUTTONS_CHANGE    0x40000104   //bits that changed between the last two accesses
+#define OLED_MUX          0x40000400   //PmodOLEDrgb controller driving the screen
+#define OLED_TERMINAL_RST 0x400004A4
+#define OLED_TERMINAL_RW  0x400004AC
+#define OLED_BITMAP_RST   0x400004B0
+#define OLED_BITMAP_RW    0x400004B8
+#define OLED_MUX_TERMINAL 0x03
+#define CTRL_PWM_RST      0x400004D4   //ctrl_pwm.vhd: audio samples, see pwm_open()
+#define CTRL_PWM_RW       0x400004DC
+#define CTRL_RW           0x400004E0   //starts playback
+#define CTRL_ETAT         0x400004E4   //state and volume
+#define VGA_BASE          0x50000000
+#define VGA_SIZE          (640*480*4)  //one word per pixel
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE  (1 << PAGE_SHIFT)
+#define PAGE_MASK  (PAGE_SIZE - 1)
+#define PAGE_DIR   1024                //4 MB per directory entry
+#define IO_WINDOWS 3                   //MISC, FIFO, PERIPH
+
+typedef struct
+{
+   unsigned int virtualAddress;
+   unsigned int physicalAddress;
+} MmuEntry;
+
+typedef struct State_s State;
+typedef struct Decoded_s Decoded;
+typedef struct Block_s Block;
+typedef struct Trace_s Trace;
+typedef struct Oled_s Oled;
+typedef struct Vga_s Vga;
+typedef struct Input_s Input;
+typedef struct Pwm_s Pwm;
+typedef struct Soc_s Soc;
+
+typedef unsigned int (*DeviceRead)(State *s, unsigned int address, int size);
+typedef void (*DeviceWrite)(State *s, unsigned int address, unsigned int value, int size);
+
+/* Device event: handler runs before the first instruction that starts at
+   or after clock when; NULL only re-evaluates the interrupt line */
+typedef void (*EventHandler)(State *s, int arg);
+typedef struct
+{
+   unsigned long long when;
+   EventHandler handler;
+   int arg;
+} Event;
+
+#define EVENTS 16
+
+//Profiler counters for one instruction word
+typedef struct
+{
+   unsigned long long count;  //executions
+   unsigned long long cycles; //clocks charged, stalls included
+} ProfileCount;
+
+//Function symbol, from the .axf or the linker map
+typedef struct
+{
+   unsigned int address;
+   unsigned int size;
+   char *name;
+} Symbol;
+
+//Row of the DWARF line table; line 0 ends a sequence
+typedef struct
+{
+   unsigned int address;
+   int line;
+   int file;                  //index into Symbols.files
+} LineRow;
+
+typedef struct
+{
+   Symbol *sym;               //sorted by address
+   int symCount;
+   Symbol *obj;               //data objects, sorted by address
+   int objCount;
+   LineRow *row;              //sorted by address
+   int rowCount;
+   char **files;
+   int fileCount;
+} Symbols;
+
+//Calling context: one node per distinct call path
+typedef struct CallNode_s CallNode;
+struct CallNode_s {
+   unsigned int function;     //entry address
+   unsigned int ret;          //return address of the active call
+   int depth;
+   unsigned long long calls;
+   unsigned long long count, cycles;   //exclusive
+   unsigned long long inclCount, inclCycles;  //filled in by the report
+   CallNode *parent, *child, *sibling;
+   CallNode *all;             //every node, for freeing
+};
+
+#define CALL_ENTER 1
+#define CALL_LEAVE 2
+#define CALL_DEPTH_MAX 256    //deeper recursion stays in the last node
+
+//Shadow call stack following JAL/JALR/BAL and JR
+typedef struct
+{
+   CallNode *root, *node, *all;
+   int pending;               //cycle(): the delay slot has yet to run
+   int kind;                  //CALL_ENTER or CALL_LEAVE
+   unsigned int target, ret;
+} CallStack;
+
+//One 4 KB page: host memory or a device
+typedef struct
+{
+   unsigned char *host;       //RAM: host address of the page, else NULL
+   DeviceRead read;           //device handlers, NULL when unmapped
+   DeviceWrite write;
+   int wait;                  //timing: extra clocks per access
+} Page;
+
+#ifdef ENABLE_CACHE
+#define CACHE_SET_ASSOC_LN2   0
+#define CACHE_SET_ASSOC       (1 << CACHE_SET_ASSOC_LN2)
+#define CACHE_SIZE_LN2        (13 - CACHE_SET_ASSOC_LN2)  //8 KB
+#define CACHE_SIZE            (1 << CACHE_SIZE_LN2)
+#define CACHE_LINE_SIZE_LN2   2                           //4 bytes
+#define CACHE_LINE_SIZE       (1 << CACHE_LINE_SIZE_LN2)
+
+//Write-back cache with the MMU, see cache_load()
+typedef struct
+{
+   int data[CACHE_SET_ASSOC][CACHE_SIZE/sizeof(int)];
+   int addr[CACHE_SET_ASSOC][CACHE_SIZE/CACHE_LINE_SIZE];
+   int setNext;
+   int miss, writeBack, count;
+} Cache;
+#endif
+
+#ifdef SIMPLE_CACHE
+//Write through direct mapped 4KB cache
+typedef struct
+{
+   unsigned int data[1024];
+   unsigned int addr[1024];   //9-bit addresses
+   int tries, miss;
+} Cache;
+#endif
+
+//Runtime cache model in front of external RAM, see cache_lookup()
+#define CACHE_LRU     0
+#define CACHE_RANDOM  1
+typedef struct
+{
+   int size, line, ways;                 //bytes, bytes per line, lines per set
+   int replace;                          //CACHE_LRU or CACHE_RANDOM
+   int writeBack;                        //else write-through without write-allocate
+   int penalty;                          //timing: clocks per fill or write-back, -1=auto
+   int sets, lineShift;
+   unsigned int *tag;                    //sets * ways: line address | CACHE_VALID...
+   unsigned long long *used;             //LRU stamp of each line
+   unsigned long long clock;
+   unsigned int seed;                    //CACHE_RANDOM victims
+   unsigned long long access, miss, writes, writeBacks;
+} CacheSim;
+
+//Cache model counters for one word, by pc or by data address
+typedef struct
+{
+   unsigned long long iAccess, iMiss;
+   unsigned long long dAccess, dMiss;    //misses are line fills
+   unsigned long long writeBack;
+} CacheCount;
+
+//C model of a custom.aluN instruction (plasmaIsaCustom.h): rd = op(rs, rt)
+#define CUSTOM_OPS 19
+typedef unsigned int (*CustomOp)(State *s, unsigned int a, unsigned int b);
+
+/* Stream coprocessor model: a write to COPROC_n_RST (or a read of it)
+   resets it, writes to COPROC_n_RW feed INPUT_1 and reads return
+   OUTPUT_1, as in the coproc_n.vhd of HDL/CUSTOM projects */
+typedef struct Coproc_s Coproc;
+typedef struct
+{
+   const char *name;
+   void (*reset)(Coproc *c);
+   void (*write)(Coproc *c, unsigned int value, unsigned long long now);
+   unsigned int (*read)(Coproc *c, unsigned long long now);  //NULL: c->output
+} CoprocModel;
+
+struct Coproc_s {
+   const CoprocModel *model;  //NULL: the registers are latched
+   State *s;                  //owner, for models that draw
+   unsigned int reg[6];       //model state
+   unsigned int output;       //OUTPUT_1
+   int latency;               //timing: clocks from a write to its output
+   int interval;              //timing: clocks between accepted writes
+   unsigned long long ready;  //clock of the output, see periph_write()
+   unsigned long long accept; //clock of the next accepted write
+   unsigned long long writes, reads, stalls;
+};
+
+/* Streaming FIFO behind FIFO_BASE, see plasma_set_fifo().  ring holds
+   the count words in the FIFO, then for FIFO_IN the ahead words read
+   from the file that have not arrived yet */
+typedef struct
+{
+   FILE *file;                //FIFO_IN source, FIFO_OUT sink
+   unsigned int *ring;        //2 * depth words
+   int depth;
+   int rate;                  //clocks between arrivals or departures
+   int head, count, ahead;
+   int eof;
+   int drained;               //FIFO_OUT: words at head the run of a snapshot wrote
+   unsigned long long next;   //clock of the next arrival or departure
+   unsigned long long last;   //clock of the last update
+   unsigned long long words;  //popped or pushed by the CPU
+   unsigned long long moved;  //arrived from or left to the file
+   unsigned long long misses; //pops while empty, pushes while full
+   unsigned long long waits;  //FIFO_IN: clocks the source waited for room
+   unsigned long long area;   //occupancy x clocks
+   int maxCount;
+} Fifo;
+
+//Host console for the UART outside batch mode, supplied by the front end
+typedef struct
+{
+   int (*kbhit)(void);
+   int (*getch)(void);
+   void (*putch)(int ch);
+   void (*idle)(unsigned int ms);  //the OS polls IRQ_MASK+4 when it has nothing to do
+} Console;
+
+#define ENGINE_CYCLE 0    //one cycle() per instruction
+#define ENGINE_BLOCK 1    //basic-block threaded code
+#define ENGINE_JIT   2    //basic blocks, hot ones compiled to x86-64
+
+struct State_s {
+   int r[32];
+   int pc, pc_next, epc;
+   unsigned int hi;
+   unsigned int lo;
+   int status;
+   int userMode;
+   int processId;
+   int exceptionId;
+   int faultAddr;
+   int irqStatus;
+   int skip;
+   unsigned char *mem;                   //internal then external RAM
+   unsigned char *vga;                   //framebuffer at VGA_BASE
+   Page *pageDir[PAGE_DIR];              //see PAGE()
+   unsigned int ioLatch[IO_WINDOWS][PAGE_SIZE / 4];  //unmodelled registers
+   int wakeup;
+   int big_endian;
+   MmuEntry mmuEntry[MMU_ENTRIES];
+   Decoded *decoded;                     //one entry per word of s->mem
+   unsigned char codePage[MEM_SIZE >> 12];  //page holds decoded entries
+   int engine;
+   Block **blockMap;                     //block starting at each word
+   Block *blockList;
+   int blockStale;                       //a store hit code inside a block
+   unsigned int blockBreak;              //blocks end before this address
+   int spinWait;                         //batch blocks: fast-forward polling loops
+   Event event[EVENTS];                  //pending device events, by clock
+   int eventCount;
+   unsigned long long nextEvent;         //engines call event_run() from this clock
+   unsigned long long interrupts;        //taken at INTERRUPT_VECTOR
+   int uartBaud;                         //UART line rate, 0=a byte per access
+   unsigned long long uartTxDone;        //uartBaud: clock the transmitter is free
+   unsigned long long uartRxReady;       //uartBaud: clock of the next input byte
+   int peek;                             //spin_forward() probe: device reads must be pure
+   int peekFailed;                       //a probe read had side effects
+   int peekLater;                        //only until the read runs once, probe again then
+   unsigned long long spinSkipped;       //instructions fast-forwarded
+   unsigned char *jitCode;               //executable buffer for hot blocks
+   unsigned int jitUsed;
+   unsigned long long instructions;      //nullified delay slots included
+   unsigned long long cycles;            //clocks, drives COUNTER_REG
+   int at;                               //load/store running at s->cycles + at, see Decoded.at
+   int timing;                           //charge decode() costs, else 1 CPI
+   int waitExternal;                     //timing: extra clocks per external RAM access
+   unsigned long long multDone;          //timing: clock the mult/div unit is idle
+   ProfileCount *profile;                //per word of s->mem, NULL when off
+   Symbols *symbols;                     //NULL without -s or a .axf/.map
+   CallStack *calls;                     //NULL when off
+   Trace *trace;                         //binary trace writer, NULL when off
+   Oled *oled;                           //PmodOLEDrgb model, NULL: latched registers
+   Vga *vgaOut;                          //VGA frame writer, NULL when off
+   Pwm *pwm;                             //PWM audio to WAV, NULL: latched registers
+   int batch;                            //headless, see run_batch()
+   unsigned long long budget;            //batch: instruction limit
+   double deadline;                      //batch: host_time() limit, 0=none
+   int stopReason;                       //batch: STOP_*
+   unsigned int timeCheck;
+   FILE *uartIn, *uartOut;               //batch: UART streams
+   unsigned int stopAt;                  //batch: stop when the pc gets here
+   int quiet;                            //batch: no summary on stderr
+#if defined(ENABLE_CACHE) || defined(SIMPLE_CACHE)
+   Cache cache;
+#endif
+   CacheSim *icache, *dcache;            //runtime cache models, NULL when off
+   CacheCount *cacheByPc;                //per word of s->mem, with a cache model
+   CacheCount *cacheByData;
+   unsigned int cachePc;                 //pc of the instruction in cycle()
+   CustomOp custom[CUSTOM_OPS + 1];      //custom.alu1..19, NULL=illegal opcode
+   unsigned char customCost[CUSTOM_OPS + 1];  //timing: clocks of each one
+   int customCount;                      //models bound
+   Coproc coproc[COPROCS];               //COPROC_1..4
+   Fifo *fifo[2];                        //FIFO_IN, FIFO_OUT; NULL: latched registers
+   Input *input;                         //button and switch script, NULL: latched registers
+   unsigned char *resume;                //device records of snapshot_restore() not applied yet
+   unsigned int resumeSize;
+   const Console *console;               //UART without batch streams, NULL=stdout
+   void *user;                           //owner data for device handlers
+   Soc *soc;                             //multi-core SoC, NULL for a lone CPU
+   int coreId;
+};
+
+//Why a batch run ended
+#define STOP_NONE    0
+#define STOP_BREAK   1    //BREAK instruction, see stop() in plasmaMisc.h
+#define STOP_HALT    2    //jump to itself, the loop after main() returns
+#define STOP_ERROR   3    //unknown opcode
+#define STOP_BUDGET  4    //instruction budget used up
+#define STOP_TIME    5    //host time limit reached
+#define STOP_AT      6    //reached the -x address
+
+
+#define PLASMA_BASE_AUTO 0xffffffff  //plasma_load(): internal or external RAM
+
+/************* Instances *************/
+State *plasma_create(void);
+void plasma_destroy(State *s);
+int plasma_load(State *s, const char *name, unsigned int base);
+void plasma_set_wait(State *s, int clocks);
+int plasma_set_cache(State *s, int data, const char *spec);
+int plasma_set_custom(State *s, int index, CustomOp op, int latency);
+int plasma_custom_project(State *s, const char *spec);
+int plasma_set_coproc(State *s, int index, const CoprocModel *model, int latency, int interval);
+int plasma_coproc_project(State *s, const char *spec);
+int plasma_set_fifo(State *s, int out, const char *spec);
+int plasma_set_input(State *s, const char *name);
+int plasma_post(State *s, unsigned long long when, EventHandler handler, int arg);
+void plasma_step(State *s);
+int plasma_run_until(State *s, unsigned int address);
+unsigned int plasma_read(State *s, unsigned int address, int size);
+void plasma_write(State *s, unsigned int address, unsigned int value, int size);
+void plasma_map_device(State *s, unsigned int address, unsigned int size,
+                       DeviceRead read, DeviceWrite write);
+
+/************* Engines and debugger support *************/
+double host_time(void);
+unsigned int mem_offset(unsigned int address);
+void cycle(State *s, int show_mode);
+void run(State *s, unsigned int breakpoint);
+int run_batch(State *s, double timeLimit);
+void show_state(State *s);
+
+/************* Profiling, traces and snapshots *************/
+Symbols *symbols_load(const char *name);
+void symbols_free(Symbols *sym);
+unsigned int symbol_address(const Symbols *sym, const char *name);
+void profile_report(State *s, const char *name);
+void cache_report(State *s, FILE *info, const char *name);
+void coproc_report(State *s, FILE *info);
+void fifo_report(State *s, FILE *info);
+void input_report(State *s, FILE *info);
+CallStack *calls_init(unsigned int entry);
+void calls_free(CallStack *c);
+void calls_report(State *s, const char *foldName, const char *profileName);
+Trace *trace_open(const char *name);
+unsigned long long trace_close(Trace *t);
+Oled *oled_open(const char *pattern, unsigned long long interval);
+int oled_close(Oled *o);
+int vga_open(State *s, const char *pattern, unsigned long long interval);
+int vga_close(State *s, unsigned long long *rows);
+int pwm_open(State *s, const char *name, int rate);
+void pwm_report(State *s, FILE *info);
+int trace_render(const char *name, unsigned long long first,
+                 unsigned long long count, int verbose);
+int snapshot_save(State *s, const char *name);
+int snapshot_restore(State *s, const char *name, long long *uartInOffset);
+
+/************* Multi-core SoC *************/
+Soc *soc_create(State *s, int count, unsigned int privateBase, unsigned int privateSize);
+State *soc_core(Soc *soc, int index);
+int soc_run(Soc *soc, unsigned long long quantum, double timeLimit);
+void soc_destroy(Soc *soc);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //__PLASMASIM_H__